@@ -0,0 +1,110 @@
+// Minimal benchmark harness. Each benchmark binary prints one JSON object on
+// stdout, progress goes to stderr:
+//   {"bench": name, "compiler": ..., "threads": ...,
+//    "results": [{"name": ..., "reps": ..., "median_s": ..., "min_s": ...,
+//                 "items": ..., "items_per_s": ...}, ...],
+//    "values": [{"name": ..., "value": ..., "unit": ...}, ...]}
+// Runs have fixed inputs and repetition counts so results compare over time,
+// the median is the figure to track.
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <thread>
+#include <iostream>
+
+class Bench {
+public:
+  Bench(const std::string &name_) : name(name_) {}
+
+  // Times reps runs of fn, after setup and an untimed warmup run. items is
+  // what one run processes (nodes, operations, bytes...), for the rate.
+  // Returns the median.
+  double run(const std::string &what, unsigned int reps, double items,
+           const std::function<void ()> &fn,
+           const std::function<void ()> &setup = [] () {}) {
+    std::cerr << this->name << ": " << what << std::endl;
+    setup();
+    fn();
+    std::vector<double> times;
+    for (unsigned int i = 0; i < reps; i++) {
+      setup();
+      auto start = std::chrono::steady_clock::now();
+      fn();
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      times.push_back(elapsed.count());
+    }
+    std::sort(times.begin(), times.end());
+    Result r;
+    r.name = what;
+    r.reps = reps;
+    r.median = times.empty() ? 0 : times[times.size() / 2];
+    r.min = times.empty() ? 0 : times[0];
+    r.items = items;
+    this->results.push_back(r);
+    return r.median;
+  }
+
+  // A measured quantity other than time, e.g. a size.
+  void value(const std::string &what, double v, const std::string &unit) {
+    this->values.push_back({what, v, unit});
+  }
+
+  // The JSON report, once everything ran.
+  void print() {
+    printf("{\"bench\": %s, \"compiler\": %s, \"threads\": %u,\n \"results\": [",
+           quoted(this->name).c_str(), quoted(__VERSION__).c_str(),
+           std::thread::hardware_concurrency());
+    for (size_t i = 0; i < this->results.size(); i++) {
+      auto &r = this->results[i];
+      printf("%s\n  {\"name\": %s, \"reps\": %u, \"median_s\": %.9g, \"min_s\": %.9g, "
+             "\"items\": %.9g, \"items_per_s\": %.9g}", i ? "," : "", quoted(r.name).c_str(),
+             r.reps, r.median, r.min, r.items, r.median > 0 ? r.items / r.median : 0);
+    }
+    printf("],\n \"values\": [");
+    for (size_t i = 0; i < this->values.size(); i++) {
+      auto &v = this->values[i];
+      printf("%s\n  {\"name\": %s, \"value\": %.9g, \"unit\": %s}", i ? "," : "",
+             quoted(v.name).c_str(), v.value, quoted(v.unit).c_str());
+    }
+    printf("]}\n");
+    fflush(stdout);
+  }
+
+private:
+  struct Result {
+    std::string name;
+    unsigned int reps;
+    double median;
+    double min;
+    double items;
+  };
+
+  struct Value {
+    std::string name;
+    double value;
+    std::string unit;
+  };
+
+  std::string name;
+  std::vector<Result> results;
+  std::vector<Value> values;
+
+  static std::string quoted(const std::string &s) {
+    std::string ret = "\"";
+    for (auto c : s) {
+      if (c == '"' || c == '\\')
+        ret += '\\';
+      ret += c;
+    }
+    return ret + "\"";
+  }
+};
+
+#endif  // BENCH_H
@@ -0,0 +1,65 @@
+// EncBit gate latencies and end to end UInt circuits on EncBits.
+//
+// Usage: bench_crypto [key_security] [depth]
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdlib>
+
+#include "HELContext.h"
+#include "EncBit.h"
+#include "ArithmeticTree.h"
+#include "Evaluator.h"
+#include "Worker.h"
+#include "UInt.h"
+#include "Log.h"
+#include "Bench.h"
+
+using namespace std;
+
+int main(int argc, char **argv) {
+  Log::set_level(Log::DISABLE);
+  long key_security = argc > 1 ? atol(argv[1]) : 80;
+  long depth = argc > 2 ? atol(argv[2]) : 10;
+  Bench bench("crypto/k=" + to_string(key_security) + ",L=" + to_string(depth));
+
+  PrivateCtx priv(key_security, depth);
+  auto ctx = make_shared<PublicCtx>(priv);
+  EncBit a(ctx, true), b(ctx, false), out(ctx);
+
+  bench.run("encrypt", 20, 1, [&] () { out.encrypt(true); });
+  bench.run("decrypt", 20, 1, [&] () { out.decrypt(priv); });
+  bench.run("sum", 100, 1, [&] () { out = a + b; });
+  bench.run("not", 100, 1, [&] () { out = ! a; });
+  bench.run("prod", 20, 1, [&] () { out = a * b; });
+  bench.run("prod_lazy", 20, 1, [&] () { out = a; out.mul_lazy(b); });
+  EncBit lazy(ctx);
+  bench.run("relinearize", 20, 1, [&] () { out = lazy; out.relinearize(); },
+            [&] () { lazy = a; lazy.mul_lazy(b); });
+  bench.run("mod_switch", 20, 1, [&] () { out = a; out.mod_switch_to(a.level() / 2); });
+  bench.value("fresh_noise_budget", a.noise_budget(), "bits");
+  bench.value("prod_noise_budget", (a * b).noise_budget(), "bits");
+
+  auto ev = make_shared<Evaluator<EncBit> >();
+  WorkerStub<EncBit>::create_n(*ev->get_scheduler(), 4);
+  unique_ptr<ArithmeticTree<EncBit> > tree;
+  unique_ptr<UInt<EncBit, 8> > sum;
+  bench.run("uint_add/n=8,workers=4", 3, 1, [&] () { ev->exec(); }, [&] () {
+    ev->reset();
+    tree.reset(new ArithmeticTree<EncBit>(ev));
+    vector<ArithmeticNode<EncBit>* > x, y;
+    for (int i = 0; i < 8; i++) {
+      x.push_back(&tree->new_node(EncBit(ctx, (123 >> i) & 1)));
+      y.push_back(&tree->new_node(EncBit(ctx, (45 >> i) & 1)));
+    }
+    sum.reset(new UInt<EncBit, 8>(UInt<EncBit, 8>(*tree, x) + UInt<EncBit, 8>(*tree, y)));
+    sum->eval();
+  });
+
+  sum.reset();
+  tree.reset();
+  bench.print();
+  return 0;
+}
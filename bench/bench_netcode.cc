@@ -0,0 +1,74 @@
+// NetWorker over loopback: round trip latency of dependent operations and
+// throughput of independent ones, against a forked NetWorkerRemote.
+
+#include <iostream>
+#include <sstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <unistd.h>
+
+#include "ArithmeticTree.h"
+#include "Evaluator.h"
+#include "Scheduler.h"
+#include "NetWorker.h"
+#include "Log.h"
+#include "Bench.h"
+
+using namespace std;
+
+int main(int argc, char **argv) {
+  Log::set_level(Log::DISABLE);
+  Bench bench("netcode");
+
+  const uint32_t port = 9201;
+  auto ev = make_shared<Evaluator<int> >();
+  fork_remote_worker<int>("localhost:" + to_string(port), [] () { return 0; }, nullptr,
+                          "/tmp/hehelp_bench_" + to_string(getpid()));
+  NetWorkerListener<int> listener(*ev->get_scheduler(), port);
+  listener.set_context("");
+  for (int i = 0; i < 100 && ev->get_scheduler()->get_workers().empty(); i++)
+    this_thread::sleep_for(chrono::milliseconds(50));
+  if (ev->get_scheduler()->get_workers().empty()) {
+    cerr << "No remote worker connected" << endl;
+    return 1;
+  }
+
+  // Each sum waits for the previous one, so every one is a round trip.
+  const size_t chain = 50;
+  unique_ptr<ArithmeticTree<int> > tree;
+  auto latency = bench.run("round_trip/chain=" + to_string(chain), 3, chain, [&] () {
+    ev->exec();
+  }, [&] () {
+    ev->reset();
+    tree.reset(new ArithmeticTree<int>(ev));
+    auto *node = &tree->new_node(1);
+    for (size_t i = 0; i < chain; i++)
+      node = &(*node + tree->new_node(int(i)));
+    tree->eval(*node);
+  });
+  bench.value("round_trip", latency / chain, "s");
+
+  // Independent sums, batched into frames.
+  const size_t wide = 1024;
+  auto elapsed = bench.run("throughput/ops=" + to_string(wide), 3, wide, [&] () {
+    ev->exec();
+  }, [&] () {
+    ev->reset();
+    tree.reset(new ArithmeticTree<int>(ev));
+    for (size_t i = 0; i < wide; i++)
+      tree->eval(tree->new_node(int(i)) + tree->new_node(int(i + 1)));
+  });
+  NetWorkerMsg<int> msg;
+  msg.op = NetWorkerMsg<int>::SUM;
+  stringstream ss;
+  ss << msg;
+  bench.value("request_bytes", ss.str().size(), "B");
+  bench.value("bandwidth", ss.str().size() * wide / elapsed, "B/s");
+
+  tree.reset();
+  bench.print();
+  return 0;
+}
@@ -0,0 +1,86 @@
+// Round trip times and sizes of the text and binary serialization of a
+// private context and of a ciphertext.
+//
+// Usage: bench_serialization [key_security] [depth] [reps]
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <memory>
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include <unistd.h>
+
+#include "HELContext.h"
+#include "EncBit.h"
+#include "Util.h"
+#include "Log.h"
+#include "Bench.h"
+
+using namespace std;
+
+int main(int argc, char **argv) {
+  Log::set_level(Log::DISABLE);
+  long key_security = argc > 1 ? atol(argv[1]) : 80;
+  long depth = argc > 2 ? atol(argv[2]) : 10;
+  int reps = argc > 3 ? atoi(argv[3]) : 3;
+  Bench bench("serialization/k=" + to_string(key_security) + ",L=" + to_string(depth));
+
+  PrivateCtx priv(key_security, depth);
+#ifdef HEHELP_BINIO
+  bench.value("binary_io", 1, "bool");
+#else
+  // Binary falls back to text.
+  bench.value("binary_io", 0, "bool");
+#endif
+
+  string text, binary;
+  bench.run("context_text_write", reps, 1, [&] () { stringstream ss; ss << priv;
+                                                    text = ss.str(); });
+  bench.run("context_text_read", reps, 1, [&] () { stringstream ss(text); PrivateCtx ctx;
+                                                   ss >> ctx; });
+  bench.value("context_text", text.size(), "B");
+
+  bench.run("context_binary_write", reps, 1, [&] () { stringstream ss;
+                                                      write_binary(ss, priv);
+                                                      binary = ss.str(); });
+  bench.run("context_binary_read", reps, 1, [&] () { stringstream ss(binary);
+                                                     PrivateCtx ctx;
+                                                     read_binary(ss, ctx); });
+  bench.value("context_binary", binary.size(), "B");
+
+  // Loading from a mapped file skips reading it into a buffer.
+  string path = "/tmp/bench_serialization_" + to_string(getpid());
+  write_file_atomic(path, binary);
+  bench.run("context_binary_mmap_read", reps, 1, [&] () {
+    MappedFile file(path);
+    MemoryStreambuf buf(file.data(), file.size());
+    istream in(&buf);
+    PrivateCtx ctx;
+    read_binary(in, ctx);
+  });
+  remove(path.c_str());
+
+  auto ctx = make_shared<PublicCtx>(priv);
+  EncBit bit(ctx, true);
+  int bit_reps = reps * 100;
+  // Plain Ctxt for the text baseline, EncBit only exposes its wire format.
+  Ctxt ctxt(*ctx->key);
+  ctx->ea->encrypt(ctxt, *ctx->key, vector<long>(ctx->ea->size(), 1));
+  bench.run("ciphertext_text_write", bit_reps, 1, [&] () { stringstream ss; ss << ctxt;
+                                                           text = ss.str(); });
+  bench.run("ciphertext_text_read", bit_reps, 1, [&] () { stringstream ss(text);
+                                                          Ctxt c(*ctx->key); ss >> c; });
+  bench.value("ciphertext_text", text.size(), "B");
+
+  bench.run("ciphertext_binary_write", bit_reps, 1, [&] () { stringstream ss;
+                                                             bit.write(ss);
+                                                             binary = ss.str(); });
+  bench.run("ciphertext_binary_read", bit_reps, 1, [&] () { stringstream ss(binary);
+                                                            EncBit b(ctx); b.read(ss); });
+  bench.value("ciphertext_binary", binary.size(), "B");
+
+  bench.print();
+  return 0;
+}
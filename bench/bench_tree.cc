@@ -0,0 +1,101 @@
+// Circuit building and evaluation without encryption: node construction
+// rates, scheduler throughput per number of WorkerStubs, and end to end UInt
+// circuits over GFN<2>.
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ArithmeticTree.h"
+#include "Evaluator.h"
+#include "Scheduler.h"
+#include "Worker.h"
+#include "Log.h"
+#include "GFN.h"
+#include "UInt.h"
+#include "Bench.h"
+
+using namespace std;
+
+// Sum of n independent products, as a balanced tree.
+ArithmeticNode<int>& products_sum(ArithmeticTree<int> &tree, size_t n) {
+  vector<ArithmeticNode<int>* > layer;
+  for (size_t i = 0; i < n; i++)
+    layer.push_back(&(tree.new_node(int(i % 7)) * tree.new_node(int(i % 5))));
+  while (layer.size() > 1) {
+    vector<ArithmeticNode<int>* > next;
+    for (size_t i = 0; i + 1 < layer.size(); i += 2)
+      next.push_back(&(*layer[i] + *layer[i + 1]));
+    if (layer.size() % 2)
+      next.push_back(layer.back());
+    layer = next;
+  }
+  return *layer[0];
+}
+
+int main(int argc, char **argv) {
+  Log::set_level(Log::DISABLE);
+  Bench bench("tree");
+
+  for (size_t n : {1000, 10000}) {
+    unique_ptr<ArithmeticTree<int> > tree;
+    bench.run("new_node/n=" + to_string(n), 5, n, [&] () {
+      for (size_t i = 0; i < n; i++)
+        tree->new_node(int(i));
+    }, [&] () { tree.reset(new ArithmeticTree<int>()); });
+  }
+
+  // Operator nodes go through the tree's check for an equivalent node.
+  for (size_t n : {1000, 4000}) {
+    unique_ptr<ArithmeticTree<int> > tree;
+    vector<ArithmeticNode<int>* > leaves;
+    bench.run("new_op/n=" + to_string(n), 3, n, [&] () {
+      for (size_t i = 0; i < n; i++)
+        *leaves[i] * *leaves[(i + 1) % n];
+    }, [&] () {
+      tree.reset(new ArithmeticTree<int>());
+      leaves.clear();
+      for (size_t i = 0; i < n; i++)
+        leaves.push_back(&tree->new_node(int(i)));
+    });
+  }
+
+  // 2n - 1 operations, n of them independent products.
+  const size_t n_products = 1024;
+  for (unsigned int workers : {1, 2, 4, 8}) {
+    auto ev = make_shared<Evaluator<int> >();
+    WorkerStub<int>::create_n(*ev->get_scheduler(), workers);
+    unique_ptr<ArithmeticTree<int> > tree;
+    bench.run("schedule/workers=" + to_string(workers), 5, 2 * n_products - 1, [&] () {
+      ev->exec();
+    }, [&] () {
+      ev->reset();
+      tree.reset(new ArithmeticTree<int>(ev));
+      tree->eval(products_sum(*tree, n_products));
+    });
+  }
+
+  typedef GFN<2> Bit;
+  auto ev = make_shared<Evaluator<Bit> >();
+  WorkerStub<Bit>::create_n(*ev->get_scheduler(), 4);
+  bench.run("uint_add/n=32", 10, 1, [&] () {
+    ev->reset();
+    ArithmeticTree<Bit> tree(ev);
+    UInt<Bit, 32> x(tree, 123456789), y(tree, 987654321);
+    auto sum = x + y;
+    sum.eval();
+    ev->exec();
+  });
+  bench.run("uint_mul/n=16", 5, 1, [&] () {
+    ev->reset();
+    ArithmeticTree<Bit> tree(ev);
+    UInt<Bit, 16> x(tree, 12345), y(tree, 54321);
+    auto prod = x * y;
+    prod.eval();
+    ev->exec();
+  });
+
+  bench.print();
+  return 0;
+}
@@ -6,15 +6,23 @@
 #include <memory>
 #include <atomic>
 #include <string>
+#include <limits>
 #include <boost/optional.hpp>
 
 #include "ArithmeticTree.h"
 #include "Evaluator.h"
 #include "Worker.h"
+#include "ElementOps.h"
 
-// Forward declaration.
+// Forward declarations.
 template <typename T>
 class ArithmeticTree;
+template <typename T>
+class Scheduler;
+template <typename T>
+class CircuitAnalyzer;
+template <typename T>
+class VectorizingEvaluator;
 
 // This is a generic container class for describing arithmetic trees. The
 // template parameter should be a type that implements operators +, *, = and ==.
@@ -24,6 +32,9 @@ class ArithmeticNode {
 friend class ArithmeticTree<T>;
 friend class Evaluator<T>;
 friend class Worker<T>;
+friend class Scheduler<T>;
+friend class CircuitAnalyzer<T>;
+friend class VectorizingEvaluator<T>;
 
 public:
   typedef boost::optional<T> Value_t;
@@ -47,18 +58,48 @@ public:
     return this->get_operator_result(rhs, PROD);
   }
 
+  // Slot operations, see ElementOps. Rotations move slot i to i + k, shifts
+  // fill the emptied slots with 0, a total sum leaves the sum of all slots in
+  // every slot. Neither consumes a level, a rotate-and-add reduction over n
+  // slots is log2(n) of them.
+  ArithmeticNode<T>& rotate(long k) {
+    return this->get_unary_result(ROTATE, k);
+  }
+
+  ArithmeticNode<T>& shift(long k) {
+    return this->get_unary_result(SHIFT, k);
+  }
+
+  ArithmeticNode<T>& total_sum() {
+    return this->get_unary_result(TOTAL_SUM, 0);
+  }
+
+  // Product by a constant c >= 0, see ElementOps::scale().
+  ArithmeticNode<T>& scale(long c) {
+    return this->get_unary_result(SCALE, c);
+  }
+
+  // Masks and rotates the slots into place, its masks cost about as much noise
+  // as a product.
+  ArithmeticNode<T>& permute(const SlotMoves_t &moves_) {
+    auto &node = this->get_unary_result(PERMUTE, 0);
+    node.moves = std::make_shared<const SlotMoves_t>(moves_);
+    return node;
+  }
+
   // Compare and swap. T must be a GF2-like class for this to have meaning.
   ArithmeticNode<T>& CAS(ArithmeticNode<T>& condition, ArithmeticNode<T>& result_true,
                          ArithmeticNode<T>& result_false) {
-    auto one = this->tree.new_node(T(1));
+    auto &one = this->tree.new_node(T(1));
     return condition * result_true + (condition + one) * result_false;
   }
 
   bool operator==(const ArithmeticNode<T>& rhs) const {
     bool ret = &this->tree == &rhs.tree && this->state == rhs.state;
     // Explicit comparison because of boost::optional semantics.
-    if (this->state == SUM || this->state == PROD)
-      ret &= this->left == rhs.left && this->right == rhs.right;
+    if (this->state != RESOLVED)
+      ret &= this->left == rhs.left && this->right == rhs.right
+             && this->amount == rhs.amount && this->moves == rhs.moves;
     if (this->state == RESOLVED)
       ret &= this-> data == rhs.data;
     return ret;
@@ -68,6 +109,13 @@ public:
     return this->label;
   }
 
+  // Noise budget left in the value (see ElementOps), NaN if not computed yet.
+  double noise_budget() const {
+    if (! *this->data)
+      return std::numeric_limits<double>::quiet_NaN();
+    return ElementOps<T>::noise_budget(this->data->get());
+  }
+
 private:
   ArithmeticNode();
   ArithmeticNode(ArithmeticTree<T> &tree_, const std::string &label_ = "")
@@ -87,14 +135,32 @@ private:
   // Parent tree.
   ArithmeticTree<T> &tree;
 
-  // Edges to parent nodes.
+  // Edges to parent nodes, unary operations have both pointing to the operand.
   typedef boost::optional<ArithmeticNode<T> &> Edge_t;
   Edge_t left, right;
 
-  // Sum/prod for the operation that resolves the node.
-  enum State {SUM, PROD, RESOLVED};
+  // The operation that resolves the node.
+  enum State {SUM, PROD, ROTATE, SHIFT, TOTAL_SUM, PERMUTE, SCALE, RESOLVED};
   State state = RESOLVED;
 
+  // Slots to rotate or shift by, or constant to scale by, and the moves of a
+  // permutation.
+  long amount = 0;
+  std::shared_ptr<const SlotMoves_t> moves;
+
+  bool unary() const {
+    return this->state == ROTATE || this->state == SHIFT || this->state == TOTAL_SUM
+           || this->state == PERMUTE || this->state == SCALE;
+  }
+
+  // Set by the Evaluator when all consumers are sums, the value may then be
+  // left for them to relinearize (see ElementOps).
+  bool lazy = false;
+
+  // Set by the Evaluator to the lowest level the consumers need, the value is
+  // switched down to it once computed. 0 leaves it alone.
+  long level = 0;
+
   // Used for naming.
   static std::atomic<unsigned int> n_nodes;
 
@@ -121,6 +187,31 @@ private:
     return this->tree.new_node(node);  // Insert in tree and return the reference.
   }
 
+  ArithmeticNode<T>& get_unary_result(State state_, long amount_) {
+    std::string label_;
+    if (! this->label.empty()) {
+      if (state_ == ROTATE)
+        label_ = "rot(" + this->label + ", " + std::to_string(amount_) + ")";
+      else if (state_ == SHIFT)
+        label_ = "shift(" + this->label + ", " + std::to_string(amount_) + ")";
+      else if (state_ == TOTAL_SUM)
+        label_ = "tsum(" + this->label + ")";
+      else if (state_ == SCALE)
+        label_ = std::to_string(amount_) + " " + (this->label.size() <= 1 ? this->label
+                                                  : "(" + this->label + ")");
+      else
+        label_ = "perm(" + this->label + ")";
+    }
+
+    auto *node = new ArithmeticNode<T>(this->tree, label_);
+    node->left = *this;
+    node->right = *this;
+    node->state = state_;
+    node->amount = amount_;
+
+    return this->tree.new_node(node);
+  }
+
 };
 
 template <typename T>
@@ -0,0 +1,211 @@
+// Bit-sliced plaintext bits for validating circuits: a BitSlice holds 64 W
+// independent bits (lanes), so one sum (xor) or product (and) evaluates the
+// circuit on that many test vectors at once. Build with -mavx2 (make AVX2=1)
+// to do 256 lanes per instruction, which is also what W defaults to then.
+
+#ifndef BITSLICE_H
+#define BITSLICE_H
+
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <stdexcept>
+#include <set>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "ElementOps.h"
+#include "Worker.h"
+
+#ifdef __AVX2__
+const unsigned int BITSLICE_WORDS = 4;
+#else
+const unsigned int BITSLICE_WORDS = 1;
+#endif
+
+template <unsigned int W = BITSLICE_WORDS>
+class BitSlice {
+public:
+  static constexpr size_t n_lanes = 64 * W;
+
+  // The same bit in every lane.
+  BitSlice(bool bit = false) {
+    for (auto &word : this->words)
+      word = bit ? ~uint64_t(0) : 0;
+  }
+
+  // One bit per lane, the lanes past bits.size() hold 0.
+  BitSlice(const std::vector<bool> &bits) : BitSlice(false) {
+    if (bits.size() > n_lanes)
+      throw std::length_error(std::to_string(bits.size()) + " bits don't fit in "
+                              + std::to_string(n_lanes) + " lanes");
+    for (size_t i = 0; i < bits.size(); i++)
+      this->set(i, bits[i]);
+  }
+
+  // Lane j holds bit i of offset + j, n_bits of these cover n_lanes
+  // consecutive inputs of an exhaustive test without going through vectors.
+  static BitSlice counter(unsigned int i, uint64_t offset) {
+    BitSlice ret;
+    for (size_t j = 0; j < n_lanes; j++)
+      ret.set(j, ((offset + j) >> i) & 1);
+    return ret;
+  }
+
+  bool get(size_t lane) const {
+    return (this->words[lane / 64] >> (lane % 64)) & 1;
+  }
+
+  void set(size_t lane, bool bit) {
+    auto mask = uint64_t(1) << (lane % 64);
+    if (bit)
+      this->words[lane / 64] |= mask;
+    else
+      this->words[lane / 64] &= ~mask;
+  }
+
+  std::vector<bool> to_bits() const {
+    std::vector<bool> ret(n_lanes);
+    for (size_t j = 0; j < n_lanes; j++)
+      ret[j] = this->get(j);
+    return ret;
+  }
+
+  uint64_t word(unsigned int i) const {
+    return this->words[i];
+  }
+
+  BitSlice operator+(const BitSlice &rhs) const {
+    BitSlice ret;
+    unsigned int i = 0;
+#ifdef __AVX2__
+    for (; i + 4 <= W; i += 4)
+      store(ret.words + i, _mm256_xor_si256(load(this->words + i), load(rhs.words + i)));
+#endif
+    for (; i < W; i++)
+      ret.words[i] = this->words[i] ^ rhs.words[i];
+    return ret;
+  }
+
+  BitSlice operator*(const BitSlice &rhs) const {
+    BitSlice ret;
+    unsigned int i = 0;
+#ifdef __AVX2__
+    for (; i + 4 <= W; i += 4)
+      store(ret.words + i, _mm256_and_si256(load(this->words + i), load(rhs.words + i)));
+#endif
+    for (; i < W; i++)
+      ret.words[i] = this->words[i] & rhs.words[i];
+    return ret;
+  }
+
+  bool operator==(const BitSlice &rhs) const {
+    for (unsigned int i = 0; i < W; i++)
+      if (this->words[i] != rhs.words[i])
+        return false;
+    return true;
+  }
+
+  bool operator!=(const BitSlice &rhs) const {
+    return ! (*this == rhs);
+  }
+
+  void write(std::ostream &os) const {
+    os.write(reinterpret_cast<const char *>(this->words), sizeof(this->words));
+  }
+
+  void read(std::istream &is) {
+    if (! is.read(reinterpret_cast<char *>(this->words), sizeof(this->words)))
+      throw std::runtime_error("Truncated BitSlice");
+  }
+
+private:
+  // Not alignas(32): C++11 allocations (nodes, vectors) don't honor it, the
+  // loads are unaligned instead.
+  uint64_t words[W];
+
+#ifdef __AVX2__
+  static __m256i load(const uint64_t *p) {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+  }
+
+  static void store(uint64_t *p, __m256i v) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), v);
+  }
+#endif
+};
+
+template <unsigned int W>
+constexpr size_t BitSlice<W>::n_lanes;
+
+// Constants are bits, binary transfers.
+template <unsigned int W>
+struct ElementOps<BitSlice<W> > : DefaultElementOps<BitSlice<W> > {
+  static BitSlice<W> scale(const BitSlice<W> &value, long c) {
+    return c % 2 ? value : BitSlice<W>(false);
+  }
+
+  static void write(const BitSlice<W> &value, std::ostream &os) {
+    value.write(os);
+  }
+
+  static void read(BitSlice<W> &value, std::istream &is) {
+    value.read(is);
+  }
+};
+
+// Computes whole batches inline instead of one virtual call per operation,
+// the operations being far cheaper than the calls.
+template <unsigned int W = BITSLICE_WORDS>
+class BitSliceWorker : public Worker<BitSlice<W> > {
+public:
+  typedef BitSlice<W> T;
+  typedef typename Worker<T>::Op Op;
+
+  BitSliceWorker(Scheduler<T> &scheduler, const std::string &name_ = "Worker")
+    : Worker<T>(scheduler, name_) {}
+
+  static std::set<BitSliceWorker<W>* > create_n(Scheduler<T> &scheduler, unsigned int n) {
+    auto ret = std::set<BitSliceWorker<W>* >();
+    for (unsigned int i = 1; i <= n; i++)
+      ret.insert(new BitSliceWorker(scheduler, "BitSliceWorker_" + std::to_string(i)));
+    return ret;
+  }
+
+protected:
+  virtual std::vector<T> do_batch(const std::vector<Op> &ops) {
+    std::vector<T> results;
+    results.reserve(ops.size());
+    for (auto &op : ops)
+      switch (op.kind) {
+        case Op::SUM:
+        case Op::SUM_RELIN:
+          results.push_back(*op.left + *op.right);
+          break;
+        case Op::PROD:
+        case Op::PROD_LAZY:
+          results.push_back(*op.left * *op.right);
+          break;
+        default:
+          results.push_back(Worker<T>::do_batch({op})[0]);
+      }
+    return results;
+  }
+
+  virtual size_t max_batch() {
+    return 1024;
+  }
+
+  virtual T do_sum(const T &left, const T &right) {
+    return left + right;
+  }
+
+  virtual T do_prod(const T &left, const T &right) {
+    return left * right;
+  }
+};
+
+#endif  // BITSLICE_H
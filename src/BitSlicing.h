@@ -0,0 +1,70 @@
+// Bit-sliced integers: bit plane i is a vector holding bit i of many integers,
+// one per slot, so a single UInt circuit over slot vectors (e.g.
+// UInt<EncBitVector, N>) computes all of them at once.
+
+#ifndef BITSLICING_H
+#define BITSLICING_H
+
+#include <cstdint>
+#include <vector>
+#include <stdexcept>
+#include <string>
+
+#include "ArithmeticTree.h"
+#include "UInt.h"
+
+typedef std::vector<std::vector<bool> > BitPlanes_t;
+
+// Transposes values into n_bits planes of slots entries each, the slots past
+// values.size() hold 0.
+inline BitPlanes_t slice_bits(const std::vector<uint64_t> &values,
+                              unsigned int n_bits, size_t slots) {
+  if (values.size() > slots)
+    throw std::length_error(std::to_string(values.size()) + " values don't fit in "
+                            + std::to_string(slots) + " slots");
+
+  BitPlanes_t planes(n_bits, std::vector<bool>(slots, false));
+  for (size_t j = 0; j < values.size(); j++)
+    for (unsigned int i = 0; i < n_bits; i++)
+      planes[i][j] = (values[j] >> i) & 1;
+  return planes;
+}
+
+// Inverse of slice_bits, one value per slot.
+inline std::vector<uint64_t> unslice_bits(const BitPlanes_t &planes) {
+  std::vector<uint64_t> values(planes.empty() ? 0 : planes[0].size(), 0);
+  for (size_t i = 0; i < planes.size(); i++) {
+    if (planes[i].size() != values.size())
+      throw std::invalid_argument("Bit planes of different sizes");
+    for (size_t j = 0; j < values.size(); j++)
+      values[j] |= uint64_t(planes[i][j]) << i;
+  }
+  return values;
+}
+
+// Builds a sliced UInt out of values. encode turns a plane into a T, e.g.
+// [&] (const std::vector<bool> &plane) { return EncBitVector(ctx, plane); }.
+template <unsigned int N, typename T, typename Encode>
+UInt<T, N> encode_sliced(ArithmeticTree<T> &tree, const std::vector<uint64_t> &values,
+                         size_t slots, Encode encode) {
+  std::vector<ArithmeticNode<T>* > bits;
+  for (auto &plane : slice_bits(values, N, slots))
+    bits.push_back(&tree.new_node(encode(plane)));
+  return UInt<T, N>(tree, bits);
+}
+
+// Values of an evaluated sliced UInt, decode turns a T back into its plane.
+template <unsigned int N, typename T, typename Decode>
+std::vector<uint64_t> decode_sliced(UInt<T, N> &nr, Decode decode) {
+  BitPlanes_t planes;
+  auto bits = nr.get_bits();
+  for (unsigned int i = 0; i < N; i++) {
+    auto data = bits[i]->get_data();
+    if (! data)
+      throw std::runtime_error("Sliced value not evaluated yet");
+    planes.push_back(decode(data.get()));
+  }
+  return unslice_bits(planes);
+}
+
+#endif  // BITSLICING_H
@@ -0,0 +1,54 @@
+// Picks HElib parameters for a circuit instead of guessing them: too deep a
+// modulus chain makes every operation slower, too shallow a one makes the
+// results fail to decrypt. For user code only, the library doesn't include it.
+
+#ifndef CHOOSEPARAMS_H
+#define CHOOSEPARAMS_H
+
+#include <cmath>
+#include <algorithm>
+
+#include "HELParams.h"
+#include "Circuit.h"
+#include "Evaluator.h"
+
+// Bits of noise a level is assumed to absorb beyond its product, on the low
+// side of what the primes of HElib's chain give.
+const double HELPARAMS_LEVEL_BITS = 20;
+
+// Cheapest parameters for a circuit of these stats at key_security, with at
+// least slots slots and the outputs left at min_level (see
+// Evaluator::set_min_level()):
+//   L = mult_depth + min_level, plus a level for every full
+//       HELPARAMS_LEVEL_BITS bits of noise the circuit's sums, constants and
+//       key switching add over its products' (CircuitStats::noise_bits)
+//   c = 2, 3 once the chain is deep enough that fewer, wider key switching
+//       columns shrink the special primes (and so m)
+//   s = the slots the circuit addresses (CircuitStats::slot_span), or slots
+//       if more, e.g. for the width of packed inputs
+// plus the rotations the circuit does.
+inline HELParams choose_params(const CircuitStats &stats, long key_security = 80,
+                               long slots = 0, long min_level = 1) {
+  HELParams ret;
+  ret.key_security = key_security;
+  ret.s = std::max(slots, stats.slot_span);
+
+  long headroom = std::floor(stats.noise_bits / HELPARAMS_LEVEL_BITS);
+  ret.depth = std::max(1L, long(stats.mult_depth) + std::max(0L, min_level)
+                           + headroom);
+  ret.c = ret.depth > 12 ? 3 : 2;
+  ret.rotations.assign(stats.rotation_amounts.begin(), stats.rotation_amounts.end());
+  ret.total_sums = stats.total_sums > 0;
+  return ret;
+}
+
+// Same for the nodes requested from evaluator, call it before exec(). A
+// VectorizingEvaluator only rotates once packed, so plan() it first.
+template <typename T>
+HELParams choose_params(const Evaluator<T> &evaluator, long key_security = 80,
+                        long slots = 0) {
+  return choose_params(CircuitAnalyzer<T>::analyze(evaluator.requested()),
+                       key_security, slots, evaluator.get_min_level());
+}
+
+#endif  // CHOOSEPARAMS_H
@@ -0,0 +1,149 @@
+// Static analysis of the circuits built with ArithmeticNode: gate counts and
+// depths, mostly to compare different constructions of the same function.
+
+#ifndef CIRCUIT_H
+#define CIRCUIT_H
+
+#include <vector>
+#include <unordered_map>
+#include <set>
+#include <algorithm>
+#include <string>
+#include <cmath>
+#include <cstdlib>
+
+#include "ArithmeticNode.h"
+
+// Forward declarations.
+template <typename T>
+class ArithmeticNode;
+
+struct CircuitStats {
+  size_t sums = 0;
+  size_t prods = 0;
+  size_t rotations = 0;   // Rotations and shifts.
+  size_t total_sums = 0;
+  size_t permutes = 0;
+  size_t scales = 0;      // Products by constants.
+  unsigned int depth = 0;       // Longest path, in gates.
+  unsigned int mult_depth = 0;  // Longest path, in products and permutation
+                                // masks. Drives the HE noise.
+  // Products by their own mult depth, prods_per_level[0] being the ones on
+  // inputs. Products on the same level can run on the same modulus.
+  std::vector<size_t> prods_per_level;
+  // Distinct amounts of the rotations, shifts and permutation moves, they
+  // need key switching matrices (see HELParams).
+  std::set<long> rotation_amounts;
+  // Slots the circuit addresses: one past the largest rotation or shift
+  // amount and moved slot, 0 if it doesn't move slots.
+  long slot_span = 0;
+  // Largest estimated growth of the noise over that of a product of fresh
+  // values, in bits, see CircuitAnalyzer.
+  double noise_bits = 0;
+
+  std::string to_string() const {
+    return "sums: " + std::to_string(this->sums) + ", prods: "
+           + std::to_string(this->prods) + ", rotations: "
+           + std::to_string(this->rotations) + ", total_sums: "
+           + std::to_string(this->total_sums) + ", permutes: "
+           + std::to_string(this->permutes) + ", scales: "
+           + std::to_string(this->scales) + ", depth: " + std::to_string(this->depth)
+           + ", mult_depth: " + std::to_string(this->mult_depth) + ", slot_span: "
+           + std::to_string(this->slot_span) + ", noise_bits: "
+           + std::to_string(this->noise_bits);
+  }
+};
+
+// Slots a total sum is assumed to add up for its noise, the number of slots
+// isn't known from the circuit. HElib's are in the hundreds to low thousands.
+const double CIRCUIT_TOTAL_SUM_BITS = 10;
+
+// Only looks at the nodes that are not resolved yet, so run it before exec().
+// The noise is tracked in bits over that of a product of fresh values, which
+// a level of the modulus chain takes back down:
+//   sum: log2(2^a + 2^b), noises add up
+//   product: a + b, they multiply
+//   scaling by c: a + log2(|c|)
+//   rotation, shift, permutation: log2(2^a + 1), key switching adds about a
+//     fresh value's noise
+//   total sum: a + CIRCUIT_TOTAL_SUM_BITS
+template <typename T>
+class CircuitAnalyzer {
+public:
+  static CircuitStats analyze(const std::vector<ArithmeticNode<T>*> &outputs) {
+    CircuitAnalyzer analyzer;
+    for (auto node : outputs) {
+      auto d = analyzer.visit(node);
+      analyzer.stats.depth = std::max(analyzer.stats.depth, d.first);
+      analyzer.stats.mult_depth = std::max(analyzer.stats.mult_depth, d.second);
+    }
+    return analyzer.stats;
+  }
+
+private:
+  typedef ArithmeticNode<T> Node_t;
+  typedef std::pair<unsigned int, unsigned int> Depth_t;  // Gates, products.
+
+  CircuitStats stats;
+  std::unordered_map<Node_t*, Depth_t> depths;
+  std::unordered_map<Node_t*, double> noises;  // See above.
+
+  double noise(Node_t *node) {
+    auto it = this->noises.find(node);
+    return it == this->noises.end() ? 0 : it->second;
+  }
+
+  Depth_t visit(Node_t *node) {
+    if (node->state == Node_t::RESOLVED)
+      return Depth_t(0, 0);
+    auto it = this->depths.find(node);
+    if (it != this->depths.end())
+      return it->second;
+
+    auto left = this->visit(&*node->left);
+    auto right = this->visit(&*node->right);
+    bool prod = node->state == Node_t::PROD;
+    bool mask = node->state == Node_t::PERMUTE;
+    Depth_t ret(std::max(left.first, right.first) + 1,
+                std::max(left.second, right.second) + (prod || mask ? 1 : 0));
+    double a = this->noise(&*node->left), b = this->noise(&*node->right);
+    double noise = std::log2(std::exp2(a) + std::exp2(b));
+    if (prod) {
+      this->stats.prods++;
+      auto &levels = this->stats.prods_per_level;
+      if (levels.size() < ret.second)
+        levels.resize(ret.second, 0);
+      levels[ret.second - 1]++;
+      noise = a + b;
+    } else if (node->state == Node_t::ROTATE || node->state == Node_t::SHIFT) {
+      this->stats.rotations++;
+      this->stats.rotation_amounts.insert(node->amount);
+      this->stats.slot_span = std::max(this->stats.slot_span,
+                                       std::abs(node->amount) + 1);
+      noise = std::log2(std::exp2(a) + 1);
+    } else if (node->state == Node_t::TOTAL_SUM) {
+      this->stats.total_sums++;
+      noise = a + CIRCUIT_TOTAL_SUM_BITS;
+    } else if (node->state == Node_t::SCALE) {
+      this->stats.scales++;
+      noise = a + std::log2(std::max(1.0, std::fabs(double(node->amount))));
+    } else if (mask) {
+      this->stats.permutes++;
+      for (auto &move : *node->moves) {
+        if (move.second != move.first)
+          this->stats.rotation_amounts.insert(move.second - move.first);
+        this->stats.slot_span = std::max(this->stats.slot_span,
+                                         std::max(move.first, move.second) + 1);
+      }
+      noise = std::log2(std::exp2(a) + 1);
+    } else {
+      this->stats.sums++;
+    }
+    this->depths[node] = ret;
+    this->noises[node] = noise;
+    this->stats.noise_bits = std::max(this->stats.noise_bits, noise);
+    return ret;
+  }
+};
+
+#endif  // CIRCUIT_H
@@ -0,0 +1,124 @@
+// Customization points for the element type of arithmetic trees, for the
+// optimizations that need more than operators + and *. Specialize ElementOps
+// for a type to enable them, inheriting DefaultElementOps for the points it
+// doesn't care about.
+
+#ifndef ELEMENTOPS_H
+#define ELEMENTOPS_H
+
+#include <limits>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+#include <utility>
+
+// Moves of a slot permutation, (from, to) pairs. A slot may be the source of
+// several moves, the slots no move goes to are 0.
+typedef std::vector<std::pair<long, long> > SlotMoves_t;
+
+template <typename T>
+struct ElementOps;
+
+template <typename T>
+struct DefaultElementOps {
+  // Products can skip work (e.g. relinearization of a ciphertext) that a
+  // later relinearize() catches up on. The Evaluator only looks for sums of
+  // products to defer it to when this is set.
+  static constexpr bool deferrable = false;
+
+  // Product whose result may stay in a non canonical form. Sums must accept
+  // such operands, products don't have to.
+  static T prod_lazy(const T &left, const T &right) {
+    return left * right;
+  }
+
+  // Brings a value back to the canonical form, must be a no-op if it already is.
+  static void relinearize(T &value) {}
+
+  // Values live on a chain of moduli (levels), each product consuming one
+  // level and lower levels being cheaper to compute on. The Evaluator only
+  // plans levels when this is set.
+  static constexpr bool leveled = false;
+
+  static long level(const T &value) {
+    return 0;
+  }
+
+  // Switches down to level, no-op if the value isn't above it.
+  static void mod_switch_to(T &value, long level_) {}
+
+  // Bits of noise that can still be added before decryption fails.
+  static double noise_budget(const T &value) {
+    return std::numeric_limits<double>::infinity();
+  }
+
+  // Constant bit for circuits built out of values (e.g. UInt), like is any
+  // value of the circuit, for types that need a key or size to make one.
+  static T constant(bool bit, const T *like) {
+    return T(bit);
+  }
+
+  // Slot operations of packed types: rotate moves slot i to i + k, shift does
+  // too but fills the slots it empties with 0, total_sum leaves the sum of all
+  // slots in every slot. Other types are a single slot.
+  static T rotate(const T &value, long k) {
+    return value;
+  }
+
+  static T shift(const T &value, long k) {
+    return k == 0 ? value : ElementOps<T>::constant(false, &value);
+  }
+
+  static T total_sum(const T &value) {
+    return value;
+  }
+
+  // Product by a constant c >= 0, far cheaper than a product of two values
+  // (no relinearization, little noise). Doubles and adds by default, which
+  // works for any type with a sum.
+  static T scale(const T &value, long c) {
+    if (c < 0)
+      throw std::invalid_argument("Negative constant " + std::to_string(c));
+    T ret = ElementOps<T>::constant(false, &value);
+    T base = value;
+    for (; c > 0; c >>= 1) {
+      if (c & 1)
+        ret = ret + base;
+      if (c > 1)
+        base = base + base;
+    }
+    return ret;
+  }
+
+  // Gathers slots according to moves, see SlotMoves_t.
+  static T permute(const T &value, const SlotMoves_t &moves) {
+    for (auto &move : moves)
+      if (move.first == 0 && move.second == 0)
+        return value;
+    return ElementOps<T>::constant(false, &value);
+  }
+
+  static long slots(const T &value) {
+    return 1;
+  }
+
+  // How values travel to and from remote workers.
+  static void write(const T &value, std::ostream &os) {
+    os << value;
+  }
+
+  static void read(T &value, std::istream &is) {
+    is >> std::noskipws >> value;
+  }
+
+  // Value to read() into, under the same key as like (see constant()). The
+  // default constructor by default, types without one need like.
+  static T make(const T *like) {
+    return T();
+  }
+};
+
+template <typename T>
+struct ElementOps : DefaultElementOps<T> {};
+
+#endif  // ELEMENTOPS_H
@@ -0,0 +1,192 @@
+#include <cmath>
+
+#include "EncBit.h"
+#include "Util.h"
+
+EncBit::EncBit(std::shared_ptr<PublicCtx> context_)
+  : context(context_), data(*context_->key) {}
+
+EncBit::EncBit(std::shared_ptr<PublicCtx> context_, bool bit)
+  : context(context_), data(*context_->key) {
+  this->encrypt(bit);
+}
+
+void EncBit::encrypt(bool bit) {
+  auto &pa = this->context->scratch();
+  pa.encode(bit);
+  this->context->ea->encrypt(this->data, *this->context->key, pa);
+}
+
+bool EncBit::decrypt(const PrivateCtx& context_) const {
+  vector<long> aux;
+  return this->decrypt(context_, aux);
+}
+
+bool EncBit::decrypt(const PrivateCtx& context_, std::vector<long> &slots) const {
+  context_.ea->decrypt(this->data, *context_.key, slots);
+  bool result = slots[0];
+  return result;
+}
+
+std::vector<EncBit> EncBit::encrypt_batch(std::shared_ptr<PublicCtx> context_,
+                                          const std::vector<bool> &bits,
+                                          unsigned int n_threads) {
+  // Fresh ciphertexts are empty, copying them is cheap. encrypt() already
+  // goes through the per-thread scratch array.
+  std::vector<EncBit> ret(bits.size(), EncBit(context_));
+  parallel_for(bits.size(), [&] (size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++)
+      ret[i].encrypt(bits[i]);
+  }, n_threads);
+  return ret;
+}
+
+std::vector<bool> EncBit::decrypt_batch(const std::vector<EncBit> &bits,
+                                        const PrivateCtx& context_,
+                                        unsigned int n_threads) {
+  // Not vector<bool>, threads would race on its shared words.
+  std::vector<char> values(bits.size());
+  parallel_for(bits.size(), [&] (size_t begin, size_t end) {
+    std::vector<long> slots;
+    for (size_t i = begin; i < end; i++)
+      values[i] = bits[i].decrypt(context_, slots);
+  }, n_threads);
+  return std::vector<bool>(values.begin(), values.end());
+}
+
+EncBit& EncBit::operator=(const EncBit& rhs) {
+  this->context = rhs.context;
+  this->data = rhs.data;
+  return *this;
+}
+
+EncBit& EncBit::operator^=(const EncBit &rhs) {
+  this->data.addCtxt(rhs.data);
+  return *this;
+}
+
+EncBit& EncBit::operator&=(const EncBit &rhs) {
+  this->data.multiplyBy(rhs.data);
+  return *this;
+}
+
+// a | b = a ^ b ^ (a & b), one multiplication and no negations.
+EncBit& EncBit::operator|=(const EncBit &rhs) {
+  EncBit both = *this;
+  both &= rhs;
+  *this ^= rhs;
+  *this ^= both;
+  return *this;
+}
+
+EncBit EncBit::constant(bool bit) const {
+  EncBit ret(this->context);
+  ret.data.DummyEncrypt(NTL::ZZX(bit ? 1 : 0));
+  return ret;
+}
+
+EncBit EncBit::blank() const {
+  return EncBit(this->context);
+}
+
+void EncBit::write(std::ostream &out) const {
+#ifdef HEHELP_BINIO
+  this->data.write(out);
+#else
+  out << this->data;
+#endif
+}
+
+void EncBit::read(std::istream &in) {
+#ifdef HEHELP_BINIO
+  this->data.read(in);
+#else
+  in >> this->data;
+#endif
+}
+
+EncBit& EncBit::mul_lazy(const EncBit &rhs) {
+  this->data *= rhs.data;
+  return *this;
+}
+
+EncBit& EncBit::relinearize() {
+  this->data.reLinearize();
+  return *this;
+}
+
+long EncBit::level() const {
+  return this->data.findBaseLevel();
+}
+
+EncBit& EncBit::mod_switch_to(long level_) {
+  if (this->data.findBaseLevel() > level_)
+    this->data.modDownToLevel(level_);
+  return *this;
+}
+
+// log_of_ratio() is the natural log of noise / modulus.
+double EncBit::noise_budget() const {
+  return -this->data.log_of_ratio() / log(2.0);
+}
+
+// Adding the cached plaintext 1 is much cheaper than encrypting it.
+EncBit& EncBit::flip() {
+  this->data.addConstant(*this->context->one);
+  return *this;
+}
+
+EncBit EncBit::operator!() const {
+  EncBit result = *this;
+  result.flip();
+  return result;
+}
+
+EncBit EncBit::operator^(const EncBit &rhs) const {
+  EncBit result = *this;
+  result ^= rhs;
+  return result;
+}
+
+EncBit EncBit::operator&(const EncBit &rhs) const {
+  EncBit result = *this;
+  result &= rhs;
+  return result;
+}
+
+EncBit EncBit::operator|(const EncBit &rhs) const {
+  EncBit result = *this;
+  result |= rhs;
+  return result;
+}
+
+EncBit EncBit::operator==(const EncBit& rhs) const {
+  EncBit result = *this;
+  result ^= rhs;
+  result.flip();
+  return result;
+}
+
+EncBit EncBit::operator+(const EncBit &rhs) const {
+  return *this ^ rhs;
+}
+
+EncBit EncBit::operator*(const EncBit &rhs) const {
+  return *this & rhs;
+}
+
+EncBit EncBit::operator&&(const EncBit& rhs) const {
+  return *this & rhs;
+}
+
+EncBit EncBit::operator||(const EncBit& rhs) const {
+  return *this | rhs;
+}
+
+// this ^= condition & (rhs ^ this), one multiplication instead of three.
+void EncBit::cas(const EncBit& condition, const EncBit& rhs) {
+  EncBit diff = rhs;
+  diff ^= *this;
+  diff &= condition;
+  *this ^= diff;
+}
@@ -2,10 +2,13 @@
 #define ENCBIT_H
 
 #include <memory>
+#include <stdexcept>
+#include <vector>
 
 #include "FHE.h"
 
 #include "HELContext.h"
+#include "ElementOps.h"
 
 using namespace std;
 
@@ -13,18 +16,63 @@ using namespace std;
 class EncBit {
 
 public:
-  EncBit();
-
   EncBit(std::shared_ptr<PublicCtx> context_);
 
-  EncBit(std::shared_ptr<PublicCtx> context_, bool data);
+  EncBit(std::shared_ptr<PublicCtx> context_, bool bit);
 
-  void encrypt(bool data);
+  void encrypt(bool bit);
 
-  bool decrypt(const PrivateCtx& context_);
+  bool decrypt(const PrivateCtx& context_) const;
 
   EncBit& operator=(const EncBit& rhs);
 
+  // In place versions, they avoid copying the ciphertext.
+  EncBit& operator^=(const EncBit &rhs);
+
+  EncBit& operator&=(const EncBit &rhs);
+
+  EncBit& operator|=(const EncBit &rhs);
+
+  // Negates in place.
+  EncBit& flip();
+
+  // Batch versions of encrypt()/decrypt() running on n_threads threads (0 for
+  // one per core), each thread reusing its buffers.
+  static std::vector<EncBit> encrypt_batch(std::shared_ptr<PublicCtx> context_,
+                                           const std::vector<bool> &bits,
+                                           unsigned int n_threads = 0);
+
+  static std::vector<bool> decrypt_batch(const std::vector<EncBit> &bits,
+                                         const PrivateCtx& context_,
+                                         unsigned int n_threads = 0);
+
+  // Noiseless encryption of bit under the same key, cheap to make.
+  EncBit constant(bool bit) const;
+
+  // Empty ciphertext under the same key, to read() into.
+  EncBit blank() const;
+
+  // Binary when HElib supports it (see HEHELP_BINIO), the key and context
+  // aren't included.
+  void write(std::ostream &out) const;
+
+  void read(std::istream &in);
+
+  // Multiplies without relinearizing, the result can only be added to until
+  // relinearize() is called.
+  EncBit& mul_lazy(const EncBit &rhs);
+
+  EncBit& relinearize();
+
+  // Position in the modulus chain, each multiplication consumes about one level.
+  long level() const;
+
+  // Switches down to the given level, no-op if already at or below it.
+  EncBit& mod_switch_to(long level_);
+
+  // Bits of noise budget left, decryption fails once it reaches 0.
+  double noise_budget() const;
+
   EncBit operator!() const;
 
   EncBit operator^(const EncBit &rhs) const;
@@ -35,6 +83,11 @@ public:
 
   EncBit operator==(const EncBit &rhs) const;
 
+  // GF(2) arithmetic, so bits can be used in an ArithmeticTree.
+  EncBit operator+(const EncBit &rhs) const;
+
+  EncBit operator*(const EncBit &rhs) const;
+
   EncBit operator&&(const EncBit& rhs) const;
 
   EncBit operator||(const EncBit& rhs) const;
@@ -44,9 +97,67 @@ public:
 
 
 private:
+  std::shared_ptr<PublicCtx> context;
   Ctxt data;
-  FHEPubKey& m_key;
-  EncryptedArray& m_ea;
+
+  // decrypt() into a caller owned buffer, for reuse across calls.
+  bool decrypt(const PrivateCtx& context_, std::vector<long> &slots) const;
+};
+
+// Lets the Evaluator defer relinearization and plan levels, binary transfers
+// and scaling by bits.
+template <>
+struct ElementOps<EncBit> : DefaultElementOps<EncBit> {
+  static constexpr bool deferrable = true;
+
+  static EncBit prod_lazy(const EncBit &left, const EncBit &right) {
+    EncBit result = left;
+    result.mul_lazy(right);
+    return result;
+  }
+
+  static void relinearize(EncBit &value) {
+    value.relinearize();
+  }
+
+  static constexpr bool leveled = true;
+
+  static long level(const EncBit &value) {
+    return value.level();
+  }
+
+  static void mod_switch_to(EncBit &value, long level_) {
+    value.mod_switch_to(level_);
+  }
+
+  static double noise_budget(const EncBit &value) {
+    return value.noise_budget();
+  }
+
+  static EncBit constant(bool bit, const EncBit *like) {
+    if (like == nullptr)
+      throw std::invalid_argument("Constants need a EncBit to take the key from");
+    return like->constant(bit);
+  }
+
+  static void write(const EncBit &value, std::ostream &os) {
+    value.write(os);
+  }
+
+  static void read(EncBit &value, std::istream &is) {
+    value.read(is);
+  }
+
+  static EncBit make(const EncBit *like) {
+    if (like == nullptr)
+      throw std::invalid_argument("Reading a EncBit needs one to take the key from");
+    return like->blank();
+  }
+
+  // Constants are bits.
+  static EncBit scale(const EncBit &value, long c) {
+    return c % 2 ? value : value.constant(false);
+  }
 };
 
 #endif //ENCBIT_H
@@ -0,0 +1,225 @@
+#include <stdexcept>
+#include <cmath>
+#include <string>
+#include <map>
+#include <vector>
+
+#include "EncBitVector.h"
+#include "Util.h"
+
+EncBitVector::EncBitVector(std::shared_ptr<PublicCtx> context_)
+  : context(context_), data(*context_->key) {}
+
+EncBitVector::EncBitVector(std::shared_ptr<PublicCtx> context_,
+                           const std::vector<bool> &bits)
+  : context(context_), data(*context_->key) {
+  this->encrypt(bits);
+}
+
+EncBitVector::EncBitVector(std::shared_ptr<PublicCtx> context_, bool bit)
+  : context(context_), data(*context_->key) {
+  this->encrypt(std::vector<bool>(this->size(), bit));
+}
+
+long EncBitVector::size() const {
+  return this->context->ea->size();
+}
+
+void EncBitVector::encrypt(const std::vector<bool> &bits) {
+  std::vector<long> slots;
+  this->encrypt(bits, slots);
+}
+
+void EncBitVector::encrypt(const std::vector<bool> &bits, std::vector<long> &slots) {
+  if (long(bits.size()) > this->size())
+    throw std::length_error(std::to_string(bits.size()) + " bits don't fit in "
+                            + std::to_string(this->size()) + " slots");
+
+  slots.assign(this->size(), 0);
+  for (size_t i = 0; i < bits.size(); i++)
+    slots[i] = bits[i];
+  this->context->ea->encrypt(this->data, *this->context->key, slots);
+}
+
+std::vector<bool> EncBitVector::decrypt(const PrivateCtx& context_) const {
+  std::vector<long> slots;
+  std::vector<bool> bits;
+  this->decrypt(context_, slots, bits);
+  return bits;
+}
+
+void EncBitVector::decrypt(const PrivateCtx& context_, std::vector<long> &slots,
+                           std::vector<bool> &bits) const {
+  context_.ea->decrypt(this->data, *context_.key, slots);
+  bits.assign(slots.begin(), slots.end());
+}
+
+std::vector<EncBitVector> EncBitVector::encrypt_batch(
+    std::shared_ptr<PublicCtx> context_,
+    const std::vector<std::vector<bool> > &planes, unsigned int n_threads) {
+  std::vector<EncBitVector> ret(planes.size(), EncBitVector(context_));
+  parallel_for(planes.size(), [&] (size_t begin, size_t end) {
+    std::vector<long> slots;
+    for (size_t i = begin; i < end; i++)
+      ret[i].encrypt(planes[i], slots);
+  }, n_threads);
+  return ret;
+}
+
+std::vector<std::vector<bool> > EncBitVector::decrypt_batch(
+    const std::vector<EncBitVector> &vectors, const PrivateCtx& context_,
+    unsigned int n_threads) {
+  std::vector<std::vector<bool> > ret(vectors.size());
+  parallel_for(vectors.size(), [&] (size_t begin, size_t end) {
+    std::vector<long> slots;
+    for (size_t i = begin; i < end; i++)
+      vectors[i].decrypt(context_, slots, ret[i]);
+  }, n_threads);
+  return ret;
+}
+
+EncBitVector& EncBitVector::operator=(const EncBitVector& rhs) {
+  this->context = rhs.context;
+  this->data = rhs.data;
+  return *this;
+}
+
+EncBitVector EncBitVector::constant(bool bit) const {
+  EncBitVector ret(this->context);
+  ret.data.DummyEncrypt(NTL::ZZX(bit ? 1 : 0));
+  return ret;
+}
+
+EncBitVector EncBitVector::blank() const {
+  return EncBitVector(this->context);
+}
+
+void EncBitVector::write(std::ostream &out) const {
+#ifdef HEHELP_BINIO
+  this->data.write(out);
+#else
+  out << this->data;
+#endif
+}
+
+void EncBitVector::read(std::istream &in) {
+#ifdef HEHELP_BINIO
+  this->data.read(in);
+#else
+  in >> this->data;
+#endif
+}
+
+EncBitVector& EncBitVector::mul_lazy(const EncBitVector &rhs) {
+  this->data *= rhs.data;
+  return *this;
+}
+
+EncBitVector& EncBitVector::relinearize() {
+  this->data.reLinearize();
+  return *this;
+}
+
+long EncBitVector::level() const {
+  return this->data.findBaseLevel();
+}
+
+EncBitVector& EncBitVector::mod_switch_to(long level_) {
+  if (this->data.findBaseLevel() > level_)
+    this->data.modDownToLevel(level_);
+  return *this;
+}
+
+// log_of_ratio() is the natural log of noise / modulus.
+double EncBitVector::noise_budget() const {
+  return -this->data.log_of_ratio() / log(2.0);
+}
+
+EncBitVector EncBitVector::operator!() const {
+  EncBitVector result = *this;
+  result.data.addConstant(*this->context->one);
+  return result;
+}
+
+EncBitVector EncBitVector::operator^(const EncBitVector &rhs) const {
+  EncBitVector result = *this;
+  result.data.addCtxt(rhs.data);
+  return result;
+}
+
+EncBitVector EncBitVector::operator&(const EncBitVector &rhs) const {
+  EncBitVector result = *this;
+  result.data.multiplyBy(rhs.data);
+  return result;
+}
+
+// a | b = a ^ b ^ (a & b), saves the three negations of !(!a & !b).
+EncBitVector EncBitVector::operator|(const EncBitVector &rhs) const {
+  return *this ^ rhs ^ (*this & rhs);
+}
+
+EncBitVector EncBitVector::operator==(const EncBitVector& rhs) const {
+  return !(*this ^ rhs);
+}
+
+EncBitVector EncBitVector::operator+(const EncBitVector &rhs) const {
+  return *this ^ rhs;
+}
+
+EncBitVector EncBitVector::operator*(const EncBitVector &rhs) const {
+  return *this & rhs;
+}
+
+EncBitVector EncBitVector::operator&&(const EncBitVector& rhs) const {
+  return *this & rhs;
+}
+
+EncBitVector EncBitVector::operator||(const EncBitVector& rhs) const {
+  return *this | rhs;
+}
+
+// this ^= condition & (rhs ^ this), a single multiplication.
+void EncBitVector::cas(const EncBitVector& condition, const EncBitVector& rhs) {
+  *this = *this ^ (condition & (rhs ^ *this));
+}
+
+EncBitVector EncBitVector::rotate(long k) const {
+  EncBitVector result = *this;
+  this->context->ea->rotate(result.data, k);
+  return result;
+}
+
+EncBitVector EncBitVector::shift(long k) const {
+  EncBitVector result = *this;
+  this->context->ea->shift(result.data, k);
+  return result;
+}
+
+EncBitVector EncBitVector::permute(const SlotMoves_t &moves) const {
+  long n = this->size();
+  std::map<long, std::vector<long> > masks;  // By rotation amount.
+  for (auto &move : moves) {
+    if (move.first < 0 || move.first >= n || move.second < 0 || move.second >= n)
+      throw std::out_of_range("Slot move out of " + std::to_string(n) + " slots");
+    auto &mask = masks[(move.second - move.first + n) % n];
+    mask.resize(n, 0);
+    mask[move.first] = 1;
+  }
+
+  EncBitVector result = this->constant(false);
+  for (auto &entry : masks) {
+    Ctxt part = this->data;
+    NTL::ZZX poly;
+    this->context->ea->encode(poly, entry.second);
+    part.multByConstant(poly);
+    this->context->ea->rotate(part, entry.first);
+    result.data += part;
+  }
+  return result;
+}
+
+EncBitVector EncBitVector::total_sum() const {
+  EncBitVector result = *this;
+  totalSums(*this->context->ea, result.data);
+  return result;
+}
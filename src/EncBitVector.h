@@ -0,0 +1,197 @@
+#ifndef ENCBITVECTOR_H
+#define ENCBITVECTOR_H
+
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "FHE.h"
+#include "EncryptedArray.h"
+
+#include "HELContext.h"
+#include "ElementOps.h"
+
+// Vector of bits packed one per slot of a single HELib ciphertext, operations
+// work elementwise so each of them processes size() bits at once.
+class EncBitVector {
+
+public:
+  EncBitVector(std::shared_ptr<PublicCtx> context_);
+
+  // Slots past bits.size() are set to 0.
+  EncBitVector(std::shared_ptr<PublicCtx> context_, const std::vector<bool> &bits);
+
+  // Every slot set to bit.
+  EncBitVector(std::shared_ptr<PublicCtx> context_, bool bit);
+
+  // Number of slots, i.e. bits processed per operation.
+  long size() const;
+
+  // Throws if bits don't fit in size() slots.
+  void encrypt(const std::vector<bool> &bits);
+
+  std::vector<bool> decrypt(const PrivateCtx& context_) const;
+
+  EncBitVector& operator=(const EncBitVector& rhs);
+
+  // Batch versions of encrypt()/decrypt() running on n_threads threads (0 for
+  // one per core), each thread reusing its buffers.
+  static std::vector<EncBitVector> encrypt_batch(
+      std::shared_ptr<PublicCtx> context_,
+      const std::vector<std::vector<bool> > &planes, unsigned int n_threads = 0);
+
+  static std::vector<std::vector<bool> > decrypt_batch(
+      const std::vector<EncBitVector> &vectors, const PrivateCtx& context_,
+      unsigned int n_threads = 0);
+
+  // Noiseless encryption of bit in every slot under the same key, cheap to make.
+  EncBitVector constant(bool bit) const;
+
+  // Empty ciphertext under the same key, to read() into.
+  EncBitVector blank() const;
+
+  // Binary when HElib supports it (see HEHELP_BINIO), the key and context
+  // aren't included.
+  void write(std::ostream &out) const;
+
+  void read(std::istream &in);
+
+  // Multiplies without relinearizing, the result can only be added to until
+  // relinearize() is called.
+  EncBitVector& mul_lazy(const EncBitVector &rhs);
+
+  EncBitVector& relinearize();
+
+  // Position in the modulus chain, each multiplication consumes about one level.
+  long level() const;
+
+  // Switches down to the given level, no-op if already at or below it.
+  EncBitVector& mod_switch_to(long level_);
+
+  // Bits of noise budget left, decryption fails once it reaches 0.
+  double noise_budget() const;
+
+  EncBitVector operator!() const;
+
+  EncBitVector operator^(const EncBitVector &rhs) const;
+
+  EncBitVector operator&(const EncBitVector &rhs) const;
+
+  EncBitVector operator|(const EncBitVector &rhs) const;
+
+  EncBitVector operator==(const EncBitVector &rhs) const;
+
+  // GF(2) arithmetic, so bits can be used in an ArithmeticTree.
+  EncBitVector operator+(const EncBitVector &rhs) const;
+
+  EncBitVector operator*(const EncBitVector &rhs) const;
+
+  EncBitVector operator&&(const EncBitVector& rhs) const;
+
+  EncBitVector operator||(const EncBitVector& rhs) const;
+
+  // Compare and swap, slot by slot: stores rhs where condition is set.
+  void cas(const EncBitVector& condition, const EncBitVector& rhs);
+
+  // Cyclic rotation of the slots by k positions (towards higher indexes). The
+  // key needs its matrices, see ensure_rotations().
+  EncBitVector rotate(long k) const;
+
+  // Same, but the slots emptied are set to 0.
+  EncBitVector shift(long k) const;
+
+  // Xor of all the slots, in every slot.
+  EncBitVector total_sum() const;
+
+  // Masks the sources of each rotation amount of moves and rotates them into
+  // place, see SlotMoves_t.
+  EncBitVector permute(const SlotMoves_t &moves) const;
+
+private:
+  std::shared_ptr<PublicCtx> context;
+  Ctxt data;
+
+  // encrypt()/decrypt() through a caller owned buffer, for reuse across calls.
+  void encrypt(const std::vector<bool> &bits, std::vector<long> &slots);
+
+  void decrypt(const PrivateCtx& context_, std::vector<long> &slots,
+               std::vector<bool> &bits) const;
+};
+
+// Lets the Evaluator defer relinearization and plan levels, binary transfers
+// and slot operations, scaling by bits.
+template <>
+struct ElementOps<EncBitVector> : DefaultElementOps<EncBitVector> {
+  static constexpr bool deferrable = true;
+
+  static EncBitVector prod_lazy(const EncBitVector &left, const EncBitVector &right) {
+    EncBitVector result = left;
+    result.mul_lazy(right);
+    return result;
+  }
+
+  static void relinearize(EncBitVector &value) {
+    value.relinearize();
+  }
+
+  static constexpr bool leveled = true;
+
+  static long level(const EncBitVector &value) {
+    return value.level();
+  }
+
+  static void mod_switch_to(EncBitVector &value, long level_) {
+    value.mod_switch_to(level_);
+  }
+
+  static double noise_budget(const EncBitVector &value) {
+    return value.noise_budget();
+  }
+
+  static EncBitVector constant(bool bit, const EncBitVector *like) {
+    if (like == nullptr)
+      throw std::invalid_argument("Constants need a EncBitVector to take the key from");
+    return like->constant(bit);
+  }
+
+  static void write(const EncBitVector &value, std::ostream &os) {
+    value.write(os);
+  }
+
+  static void read(EncBitVector &value, std::istream &is) {
+    value.read(is);
+  }
+
+  static EncBitVector make(const EncBitVector *like) {
+    if (like == nullptr)
+      throw std::invalid_argument("Reading a EncBitVector needs one to take the key from");
+    return like->blank();
+  }
+
+  static EncBitVector rotate(const EncBitVector &value, long k) {
+    return value.rotate(k);
+  }
+
+  static EncBitVector shift(const EncBitVector &value, long k) {
+    return value.shift(k);
+  }
+
+  static EncBitVector total_sum(const EncBitVector &value) {
+    return value.total_sum();
+  }
+
+  static EncBitVector permute(const EncBitVector &value, const SlotMoves_t &moves) {
+    return value.permute(moves);
+  }
+
+  static long slots(const EncBitVector &value) {
+    return value.size();
+  }
+
+  // Constants are bits.
+  static EncBitVector scale(const EncBitVector &value, long c) {
+    return c % 2 ? value : value.constant(false);
+  }
+};
+
+#endif //ENCBITVECTOR_H
@@ -10,12 +10,18 @@
 #include <memory>
 #include <mutex>
 #include <unordered_map>
+#include <map>
+#include <limits>
+#include <algorithm>
+#include <functional>
 #include <condition_variable>
 
 #include "ArithmeticNode.h"
 #include "Scheduler.h"
 #include "Worker.h"
+#include "ElementOps.h"
 #include "Log.h"
+#include "Trace.h"
 
 // Forward declarations.
 template <typename T>
@@ -49,8 +55,44 @@ public:
   // Will block until all nodes have been evaluated even if the scheduler has no
   // workers assigned.
   void exec() {
-    this->prepare();
+    {
+      TraceSpan span("prepare", "evaluator");
+      this->prepare();
+      this->mark_lazy();
+      this->plan_levels();
+    }
     this->schedule();
+    if (this->noise_budget() <= 0)
+      log.err("Noise budget exhausted, results won't decrypt correctly");
+  }
+
+  // Level requested nodes are left at, and that noise_budget() checks. Raise
+  // it if they will be computed on further, 0 leaves them at their level.
+  void set_min_level(long level) {
+    this->min_level = level;
+  }
+
+  long get_min_level() const {
+    return this->min_level;
+  }
+
+  // Requested nodes that the next exec() will compute.
+  std::vector<Node_t*> requested() const {
+    std::vector<Node_t*> ret;
+    for (auto node : this->outputs)
+      if (node->state != Node_t::RESOLVED)
+        ret.push_back(node);
+    return ret;
+  }
+
+  // Lowest noise budget among the requested nodes, infinity if there's none
+  // or the type doesn't track noise.
+  double noise_budget() {
+    double ret = std::numeric_limits<double>::infinity();
+    for (auto node : this->outputs)
+      if (node->state == Node_t::RESOLVED)
+        ret = std::min(ret, node->noise_budget());
+    return ret;
   }
 
   void reset() {
@@ -60,21 +102,24 @@ public:
 
   virtual ~Evaluator() {};
 
-private:
+protected:
   typedef std::set<Node_t *> NodeSet_t;
   NodeSet_t outputs;  // Requested nodes.
 
+private:
   enum State {PENDING, IN_PROG, DONE};
   typedef std::unordered_map<Node_t *, State> NodeState_t;
   NodeState_t nodes;  // All the nodes to be evaluated.
 
   SchedPtr_t sched;
+  long min_level = 1;
 
   std::mutex mutex;  // Object-global lock.
   std::condition_variable notify_progress;  // Wait for work to be done.
 
   Log log;
 
+protected:
   // Recursively adds required nodes to be evaluated. Subclasses can implement
   // optimizations by overriding this.
   virtual void prepare() {
@@ -90,6 +135,67 @@ private:
     }
   }
 
+private:
+  // Products (and sums of them) whose consumers are all sums don't need to be
+  // relinearized, the first consumer that isn't lazy will do it once for the
+  // whole sum. Requested nodes are always relinearized.
+  void mark_lazy() {
+    if (! ElementOps<T>::deferrable)
+      return;
+
+    // Nodes resolved by a previous exec() keep their flag, it describes their value.
+    std::vector<Node_t *> pending;
+    for (const auto &n : this->nodes)
+      if (n.first->state != Node_t::RESOLVED)
+        pending.push_back(n.first);
+
+    std::map<Node_t *, bool> only_sums;  // Whether all consumers are sums.
+    for (auto node : pending)
+      for (auto operand : {&*node->left, &*node->right}) {
+        auto it = only_sums.insert({operand, true}).first;
+        it->second = it->second && node->state == Node_t::SUM;
+      }
+
+    // Slot operations need canonical operands and produce canonical values.
+    for (auto node : pending) {
+      auto it = only_sums.find(node);
+      node->lazy = ! node->unary() && it != only_sums.end() && it->second
+                   && this->outputs.find(node) == this->outputs.end();
+    }
+  }
+
+  // Each node gets the lowest level its pending consumers need: one more than
+  // a product or permutation (for its masks) consuming it, as much as other
+  // consumers. Requested nodes need min_level.
+  void plan_levels() {
+    if (! ElementOps<T>::leveled)
+      return;
+
+    std::map<Node_t *, std::vector<Node_t *> > consumers;
+    for (const auto &n : this->nodes)
+      if (n.first->state != Node_t::RESOLVED)
+        for (auto operand : {&*n.first->left, &*n.first->right})
+          consumers[operand].push_back(n.first);
+
+    std::map<Node_t *, long> need;
+    std::function<long (Node_t *)> need_of = [&] (Node_t *node) {
+      auto it = need.find(node);
+      if (it != need.end())
+        return it->second;
+      long ret = this->outputs.count(node) ? this->min_level : 0;
+      for (auto consumer : consumers[node])
+        ret = std::max(ret, need_of(consumer)
+                            + (consumer->state == Node_t::PROD
+                               || consumer->state == Node_t::PERMUTE ? 1 : 0));
+      need[node] = ret;
+      return ret;
+    };
+
+    for (const auto &n : this->nodes)
+      if (n.first->state != Node_t::RESOLVED)
+        n.first->level = need_of(n.first);
+  }
+
   // Go through the nodes vector, evaluating what is possible then waiting for
   // more results.
   void schedule() {
@@ -103,6 +209,7 @@ private:
 
     while (! all_done()) {
       log.dbg("Checking for work.");
+      TraceSpan span("scan", "evaluator");
       for (auto &node : this->nodes)
         if (node.second == PENDING && check_solvable(node.first)) {
           node.second = IN_PROG;
@@ -119,6 +226,7 @@ private:
 
       if (! all_done()){
         log.dbg("Waiting for tasks to complete");
+        span.end();
         this->notify_progress.wait(lck);
       }
     }
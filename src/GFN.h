@@ -2,22 +2,92 @@
 #define GFN_H
 
 #include <cstdint>
+#include <cstddef>
+
+// Reduction and products mod N, chosen at compile time: masks when N is a
+// power of two (so xor and and for N = 2), Barrett reduction otherwise, with
+// 128 bit products once N no longer fits in 32 bits.
+template <uint64_t N, bool Pow2 = (N & (N - 1)) == 0>
+struct GFNArith {
+  static_assert(N > 1, "GFN needs N > 1");
+
+  // floor(2^64 / N), N isn't a power of two so it's also floor((2^64 - 1) / N).
+  static constexpr uint64_t mu = ~uint64_t(0) / N;
+  // Same for 2^128.
+  static constexpr unsigned __int128 mu128 = ~(unsigned __int128)(0) / N;
+
+  // x - floor(x mu / 2^64) N is below 2N.
+  static uint64_t reduce(uint64_t x) {
+    uint64_t q = (unsigned __int128)(x) * mu >> 64;
+    uint64_t r = x - q * N;
+    return r >= N ? r - N : r;
+  }
+
+  // Same with the high 128 bits of the 256 bit x mu128, leaving out the
+  // product of the low words and the carries, so q is a few short.
+  static uint64_t reduce(unsigned __int128 x) {
+    uint64_t x_hi = x >> 64, x_lo = uint64_t(x);
+    uint64_t mu_hi = mu128 >> 64, mu_lo = uint64_t(mu128);
+    unsigned __int128 q = (unsigned __int128)(x_hi) * mu_hi
+                          + ((unsigned __int128)(x_hi) * mu_lo >> 64)
+                          + ((unsigned __int128)(x_lo) * mu_hi >> 64);
+    unsigned __int128 r = x - q * N;
+    while (r >= N)
+      r -= N;
+    return r;
+  }
+
+  // Operands below N.
+  static uint64_t add(uint64_t a, uint64_t b) {
+    uint64_t s = a + b;
+    return s < a || s >= N ? s - N : s;
+  }
+
+  static uint64_t mul(uint64_t a, uint64_t b) {
+    if (N <= (uint64_t(1) << 32))
+      return reduce(a * b);
+    return reduce((unsigned __int128)(a) * b);
+  }
+};
+
+template <uint64_t N, bool Pow2>
+constexpr uint64_t GFNArith<N, Pow2>::mu;
+template <uint64_t N, bool Pow2>
+constexpr unsigned __int128 GFNArith<N, Pow2>::mu128;
+
+template <uint64_t N>
+struct GFNArith<N, true> {
+  static uint64_t reduce(uint64_t x) {
+    return x & (N - 1);
+  }
+
+  static uint64_t add(uint64_t a, uint64_t b) {
+    return (a + b) & (N - 1);
+  }
+
+  static uint64_t mul(uint64_t a, uint64_t b) {
+    return (a * b) & (N - 1);
+  }
+};
 
 // Class that models modular arithmetic %N.
-// Useful as a test stub.
-template <unsigned int N>
+// Useful as a test stub, and with the batch functions below as a fast
+// plaintext reference.
+template <uint64_t N>
 class GFN {
 public:
+  typedef GFNArith<N> Arith;
+
   GFN(uint64_t value_ = 0) {
     this->set(value_);
   }
 
   GFN<N> operator+(const GFN<N> &rhs) const {
-    return GFN(this->value + rhs.value);
+    return from_reduced(Arith::add(this->value, rhs.value));
   }
 
   GFN<N> operator*(const GFN<N> &rhs) const {
-    return GFN(this->value * rhs.value);
+    return from_reduced(Arith::mul(this->value, rhs.value));
   }
 
   bool operator==(const GFN<N> &rhs) const {
@@ -29,28 +99,53 @@ public:
   }
 
   void set(uint64_t value_) {
-    this->value = value_ % N;
+    this->value = Arith::reduce(value_);
+  }
+
+  // Value already below N.
+  static GFN<N> from_reduced(uint64_t value_) {
+    GFN<N> ret;
+    ret.value = value_;
+    return ret;
   }
 
-  // These only make sense for N=2, should probably move to template specialization.
+  // Boolean operators, only for N = 2.
   GFN<N> operator&&(const GFN<N> &rhs) const {
-    return this->operator*(rhs);
+    static_assert(N == 2, "Boolean operators need GFN<2>");
+    return from_reduced(this->value & rhs.value);
   }
 
   GFN<N> operator!() const {
-    return (*this) + GFN<N>(1);
+    static_assert(N == 2, "Boolean operators need GFN<2>");
+    return from_reduced(this->value ^ 1);
   }
 
   GFN<N> operator||(const GFN<N> &rhs) const {
-    return ! (! (*this) && !rhs);
+    static_assert(N == 2, "Boolean operators need GFN<2>");
+    return from_reduced(this->value | rhs.value);
   }
 
   GFN<N> operator^(const GFN<N> &rhs) const {
-    return (*this) + rhs;
+    static_assert(N == 2, "Boolean operators need GFN<2>");
+    return from_reduced(this->value ^ rhs.value);
   }
 
 private:
   uint64_t value;
 };
 
-#endif  // GFN_H
\ No newline at end of file
+// out[i] = a[i] + b[i] and a[i] * b[i] for i < n, out may alias a or b. Plain
+// loops over the values, which compilers vectorize for powers of two.
+template <uint64_t N>
+void gfn_add(const GFN<N> *a, const GFN<N> *b, GFN<N> *out, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    out[i] = GFN<N>::from_reduced(GFNArith<N>::add(a[i].get(), b[i].get()));
+}
+
+template <uint64_t N>
+void gfn_mul(const GFN<N> *a, const GFN<N> *b, GFN<N> *out, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    out[i] = GFN<N>::from_reduced(GFNArith<N>::mul(a[i].get(), b[i].get()));
+}
+
+#endif  // GFN_H
@@ -1,9 +1,19 @@
 #include <iostream>
 #include <exception>
 #include <sstream>
+#include <string>
+#include <thread>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <memory>
+#include <iterator>
 
 #include "FHE.h"
 #include "EncryptedArray.h"
+#ifdef NTL_THREAD_BOOST
+#include <NTL/BasicThreadPool.h>
+#endif
 
 #include "HELContext.h"
 
@@ -12,14 +22,15 @@ HELContext<Key>::HELContext() {}
 
 template<typename K1> template<typename K2>
 HELContext<K1>::HELContext(const HELContext<K2> &other)
-  : key(other.key), context(other.context) {
-  this->init_arrays();
+  : key(other.key), context(other.context), ea(other.ea), one(other.one) {
+  if (! this->ea)
+    this->init_arrays();
 }
 
 // template <>
 // HELContext<FHEPubKey> HELContext
 template <typename Key>
-HELContext<Key>::HELContext(std::shared_ptr<FHEcontext> context_,
+HELContext<Key>::HELContext(std::shared_ptr<const FHEcontext> context_,
                             std::shared_ptr<Key> key_)
     : key(key_), context(context_) {
   this->init_arrays();
@@ -28,18 +39,138 @@ HELContext<Key>::HELContext(std::shared_ptr<FHEcontext> context_,
 template <typename Key>
 HELContext<Key>::HELContext(long key_security, long depth, long p, long r,
                             long w, long c, long d, long s) {
-    // Gen context.
-    long m = FindM(key_security, depth ,c ,p , d, s, 0);
-    this->context.reset(new FHEcontext(m, p, r));
-    buildModChain(*this->context, depth, c);
+  this->generate(HELParams(key_security, depth, p, r, w, c, d, s));
+}
+
+template <typename Key>
+HELContext<Key>::HELContext(const HELParams &params) {
+  this->generate(params);
+}
 
-    // Gen key.
-    auto key_ptr = new FHESecKey(*this->context);
-    key_ptr->GenSecKey(w);
-    addSome1DMatrices(*key_ptr);
-    this->key.reset(key_ptr);
+// Automorphisms EncryptedArray::rotate() applies for a rotation by k: the
+// coordinate of k in each dimension, one more for the carry into the next
+// dimension, and their versions minus the order in non native dimensions.
+static std::vector<long> rotation_automorphisms(const EncryptedArray &ea, long k) {
+  std::vector<long> ret;
+  long n = ea.size();
+  k = ((k % n) + n) % n;
+  if (k == 0)
+    return ret;
 
-    this->init_arrays();
+  const PAlgebra &zMStar = ea.getContext().zMStar;
+  for (long i = 0; i < ea.dimension(); i++) {
+    long ord = ea.sizeOfDimension(i);
+    long amt = ea.coordinate(i, k);
+    std::vector<long> amounts = {amt};
+    if (ea.dimension() > 1)
+      amounts.push_back((amt + 1) % ord);
+    for (auto e : amounts) {
+      if (e == 0)
+        continue;
+      ret.push_back(zMStar.genToPow(i, e));
+      if (! ea.nativeDimension(i))
+        ret.push_back(zMStar.genToPow(i, e - ord));
+    }
+  }
+  return ret;
+}
+
+// Rotations totalSums() does over n slots: it doubles the summed span e for
+// each bit of n after the top one, adding one more slot when the bit is set.
+static std::vector<long> total_sum_rotations(long n) {
+  std::vector<long> ret;
+  long e = 1;
+  for (long i = NTL::NumBits(n) - 2; i >= 0; i--) {
+    ret.push_back(e);
+    e *= 2;
+    if (NTL::bit(n, i)) {
+      ret.push_back(e);
+      e += 1;
+    }
+  }
+  return ret;
+}
+
+static bool add_rotations(FHESecKey &key, const EncryptedArray &ea,
+                          const std::vector<long> &amounts) {
+  bool added = false;
+  for (auto k : amounts)
+    for (auto g : rotation_automorphisms(ea, k))
+      if (! key.haveKeySWmatrix(1, g, 0, 0)) {
+        key.GenKeySWmatrix(1, g, 0, 0);
+        added = true;
+      }
+  if (added)
+    key.setKeySwitchMap();
+  return added;
+}
+
+template <typename Key>
+void HELContext<Key>::generate(const HELParams &params) {
+#ifdef NTL_THREAD_BOOST
+  NTL::SetNumThreads(std::max(1u, std::thread::hardware_concurrency()));
+#endif
+
+  // Gen context.
+  long m = FindM(params.key_security, params.depth, params.c, params.p,
+                 params.d, params.s, 0);
+  auto ctx = std::make_shared<FHEcontext>(m, params.p, params.r);
+  buildModChain(*ctx, params.depth, params.c);
+  this->context = ctx;
+  this->init_arrays();
+
+  // Gen key, GenSecKey() already adds the relinearization matrix. Rotation
+  // matrices are most of the keygen time and of the key size, so only the
+  // requested ones.
+  auto key_ptr = new FHESecKey(*this->context);
+  key_ptr->GenSecKey(params.w);
+  auto rotations = params.rotations;
+  if (params.total_sums)
+    for (auto k : total_sum_rotations(this->ea->size()))
+      rotations.push_back(k);
+  add_rotations(*key_ptr, *this->ea, rotations);
+  this->key.reset(key_ptr);
+}
+
+template <typename Key>
+bool HELContext<Key>::has_rotation(long k) const {
+  this->assert_init();
+  for (auto g : rotation_automorphisms(*this->ea, k))
+    if (! this->key->haveKeySWmatrix(1, g, 0, 0))
+      return false;
+  return true;
+}
+
+// Copy on write, the key in ctx may be in use by copies of the context on
+// other threads.
+bool ensure_rotations(PrivateCtx &ctx, const std::vector<long> &amounts) {
+  ctx.assert_init();
+  bool missing = false;
+  for (auto k : amounts)
+    missing = missing || ! ctx.has_rotation(k);
+  if (! missing)
+    return false;
+
+  auto key = std::make_shared<FHESecKey>(*ctx.key);
+  add_rotations(*key, *ctx.ea, amounts);
+  ctx.key = key;
+  return true;
+}
+
+bool ensure_rotations(PrivateCtx &ctx, const HELParams &params) {
+  ctx.assert_init();
+  auto rotations = params.rotations;
+  if (params.total_sums)
+    for (auto k : total_sum_rotations(ctx.ea->size()))
+      rotations.push_back(k);
+  return ensure_rotations(ctx, rotations);
+}
+
+void ensure_all_rotations(PrivateCtx &ctx) {
+  ctx.assert_init();
+  auto key = std::make_shared<FHESecKey>(*ctx.key);
+  addSome1DMatrices(*key);
+  ctx.key = key;
 }
 
 template <typename Key>
@@ -52,8 +183,33 @@ void HELContext<Key>::assert_init() const {
 
 template <typename Key>
 void HELContext<Key>::init_arrays() {
-  this->ea.reset(new EncryptedArray(*this->context));
-  this->pa.reset(new PlaintextArray(*this->ea));
+  this->ea = std::make_shared<const EncryptedArray>(*this->context);
+  this->one = std::make_shared<const DoubleCRT>(NTL::ZZX(1), *this->context);
+}
+
+// Shared by both key types, keyed by array. The weak_ptr tells apart a dead
+// array whose address got reused by a new one.
+static PlaintextArray& thread_scratch(const std::shared_ptr<const EncryptedArray> &ea) {
+  struct Entry {
+    std::weak_ptr<const EncryptedArray> ea;
+    std::unique_ptr<PlaintextArray> pa;
+  };
+  static thread_local std::map<const EncryptedArray*, Entry> arrays;
+
+  auto &entry = arrays[ea.get()];
+  if (! entry.pa || entry.ea.expired()) {
+    for (auto it = arrays.begin(); it != arrays.end(); )
+      it = it->second.ea.expired() && &it->second != &entry ? arrays.erase(it)
+                                                            : std::next(it);
+    entry.ea = ea;
+    entry.pa.reset(new PlaintextArray(*ea));
+  }
+  return *entry.pa;
+}
+
+template <typename Key>
+PlaintextArray& HELContext<Key>::scratch() const {
+  return thread_scratch(this->ea);
 }
 
 template <typename Key>
@@ -67,8 +223,9 @@ template <typename Key>
 istream& operator>> (istream &in, HELContext<Key> &ctx) {
   unsigned long m, p, r;
   readContextBase(in, m, p, r);
-  ctx.context.reset(new FHEcontext(m, p, r));
-  // in >> *ctx.context;
+  auto context = std::make_shared<FHEcontext>(m, p, r);
+  in >> *context;
+  ctx.context = context;
   ctx.key.reset(new Key(*ctx.context));
   in >> *ctx.key;
   ctx.init_arrays();
@@ -78,21 +235,126 @@ istream& operator>> (istream &in, HELContext<Key> &ctx) {
 template <typename Key>
 ostream& operator<< (ostream &out, const HELContext<Key> &ctx) {
   writeContextBase(out, *ctx.context);
-  // out << *ctx.context;
+  out << *ctx.context;
   out << *ctx.key;
   return out;
 }
 
-FHEcontext copy_helib_context(const FHEcontext &other) {
+// Tags the binary framing and which format is inside it.
+#ifdef HEHELP_BINIO
+static const char binary_magic[8] = {'H', 'E', 'H', 'B', 'I', 'N', '0', '1'};
+#else
+static const char binary_magic[8] = {'H', 'E', 'H', 'T', 'X', 'T', '0', '1'};
+#endif
+
+#ifdef HEHELP_BINIO
+static void write_key_binary(ostream &out, const FHEPubKey &key) {
+  writePubKeyBinary(out, key);
+}
+
+static void write_key_binary(ostream &out, const FHESecKey &key) {
+  writeSecKeyBinary(out, key);
+}
+
+static void read_key_binary(istream &in, FHEPubKey &key) {
+  readPubKeyBinary(in, key);
+}
+
+static void read_key_binary(istream &in, FHESecKey &key) {
+  readSecKeyBinary(in, key);
+}
+#endif
+
+template <typename Key>
+void write_binary(ostream &out, const HELContext<Key> &ctx) {
+  ctx.assert_init();
+  out.write(binary_magic, sizeof(binary_magic));
+#ifdef HEHELP_BINIO
+  writeContextBaseBinary(out, *ctx.context);
+  writeContextBinary(out, *ctx.context);
+  write_key_binary(out, *ctx.key);
+#else
+  out << ctx;
+#endif
+}
+
+template <typename Key>
+void read_binary(istream &in, HELContext<Key> &ctx) {
+  char magic[sizeof(binary_magic)];
+  if (! in.read(magic, sizeof(magic))
+      || ! std::equal(magic, magic + sizeof(magic), binary_magic)) {
+    in.setstate(std::ios::failbit);
+    return;
+  }
+#ifdef HEHELP_BINIO
   unsigned long m, p, r;
-  std::stringstream buff;
-  writeContextBase(buff, other);
-  readContextBase(buff, m, p, r);
+  std::vector<long> gens, ords;
+  readContextBaseBinary(in, m, p, r, gens, ords);
+  auto context = std::make_shared<FHEcontext>(m, p, r, gens, ords);
+  readContextBinary(in, *context);
+  ctx.context = context;
+  ctx.key.reset(new Key(*ctx.context));
+  read_key_binary(in, *ctx.key);
+  ctx.init_arrays();
+#else
+  in >> ctx;
+#endif
+}
+
+std::string cached_private_ctx_path(const std::string &cache_dir, long key_security,
+                                    long depth, long p, long r, long w, long c,
+                                    long d, long s) {
+  return cached_private_ctx_path(cache_dir, HELParams(key_security, depth, p, r,
+                                                      w, c, d, s));
+}
+
+std::string cached_private_ctx_path(const std::string &cache_dir,
+                                    const HELParams &params) {
+  // Bump the version whenever the serialized format changes.
+  std::stringstream ss;
+  ss << "PrivateCtx v3 " << std::string(binary_magic, sizeof(binary_magic))
+     << " " << params.key_security << " " << params.depth << " " << params.p
+     << " " << params.r << " " << params.w << " " << params.c << " " << params.d
+     << " " << params.s << " " << params.total_sums << " rotations";
+  for (auto k : params.rotations)
+    ss << " " << k;
+  return cache_dir + "/privctx-" + sha256(ss.str());
+}
+
+PrivateCtx cached_private_ctx(const std::string &cache_dir, long key_security,
+                              long depth, long p, long r, long w, long c,
+                              long d, long s) {
+  return cached_private_ctx(cache_dir, HELParams(key_security, depth, p, r, w,
+                                                 c, d, s));
+}
+
+PrivateCtx cached_private_ctx(const std::string &cache_dir, const HELParams &params) {
+  if (cache_dir.empty())
+    return PrivateCtx(params);
+
+  auto path = cached_private_ctx_path(cache_dir, params);
 
-  FHEcontext ret = FHEcontext(m, p, r);
-  buff << other;
-  buff >> ret;
+  // File layout: hex SHA-256 of the payload, newline, payload. Both the check
+  // and the parsing work on the mapping, the file is never copied.
+  const size_t header = 65;
+  MappedFile file(path);
+  if (file.ok() && file.size() > header && file.data()[header - 1] == '\n'
+      && sha256(file.data() + header, file.size() - header)
+         == std::string(file.data(), header - 1)) {
+    MemoryStreambuf buf(file.data() + header, file.size() - header);
+    std::istream in(&buf);
+    PrivateCtx ret;
+    read_binary(in, ret);
+    if (in)
+      return ret;
+  }
 
+  PrivateCtx ret(params);
+  std::stringstream ss;
+  write_binary(ss, ret);
+  auto payload = ss.str();
+  // The cache is best effort, failing to store the entry only costs time later.
+  write_file_atomic(path, sha256(payload) + "\n" + payload);
   return ret;
 }
 
@@ -104,3 +366,7 @@ template istream& operator>> (istream &in, HELContext<FHEPubKey> &ctx);
 template istream& operator>> (istream &in, HELContext<FHESecKey> &ctx);
 template ostream& operator<< (ostream &out, const HELContext<FHEPubKey> &ctx);
 template ostream& operator<< (ostream &out, const HELContext<FHESecKey> &ctx);
+template void write_binary(ostream &out, const HELContext<FHEPubKey> &ctx);
+template void write_binary(ostream &out, const HELContext<FHESecKey> &ctx);
+template void read_binary(istream &in, HELContext<FHEPubKey> &ctx);
+template void read_binary(istream &in, HELContext<FHESecKey> &ctx);
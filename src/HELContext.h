@@ -3,12 +3,26 @@
 
 #include <iostream>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "EncryptedArray.h"
 #include "FHE.h"
 
+#include "Util.h"
+#include "HELParams.h"
+
+// HElib builds from 2017 on have binary IO (binio.h), older ones only text.
+#if defined(__has_include)
+#if __has_include("binio.h")
+#define HEHELP_BINIO
+#endif
+#endif
+
 // Convenience class for moving around HELib data required for computation
-// (FHEContext + associated key)
+// (FHEContext + associated key). The context and the objects derived from it
+// are immutable and shared by all the copies, so copying is cheap and they
+// can be used from any thread.
 template <typename Key>
 class HELContext {
 
@@ -18,18 +32,31 @@ public:
   template <typename Key2>
   HELContext(const HELContext<Key2> &other);
 
-  HELContext(std::shared_ptr<FHEcontext> context_, std::shared_ptr<Key> key_);
+  HELContext(std::shared_ptr<const FHEcontext> context_, std::shared_ptr<Key> key_);
 
   // This constructor generates a FHEContext and secret key for you.
   // key_security: log2(nr_possible_keys) (parameter k in HELib)
   // depth: maximum depth for leveled FHE (parameter L in HELib)
+  // Uses all cores if NTL was built with NTL_THREAD_BOOST. Only the
+  // relinearization matrix is generated, see ensure_rotations().
   HELContext(long key_security, long depth, long p = 2, long r = 1,
              long w = 64, long c = 2, long d = 0, long s = 0);
 
+  // Same, with parameters from choose_params(), plus their rotations.
+  explicit HELContext(const HELParams &params);
+
   std::shared_ptr<Key> key;
-  std::shared_ptr<FHEcontext> context;
-  std::shared_ptr<EncryptedArray> ea;
-  std::shared_ptr<PlaintextArray> pa;
+  std::shared_ptr<const FHEcontext> context;
+  std::shared_ptr<const EncryptedArray> ea;
+  // Plaintext 1 in every slot, ready to be added to ciphertexts.
+  std::shared_ptr<const DoubleCRT> one;
+
+  // PlaintextArray for ea owned by the calling thread, for encoding without
+  // allocating one each time.
+  PlaintextArray& scratch() const;
+
+  // Whether the key can rotate the slots by k.
+  bool has_rotation(long k) const;
 
   // Check if both the key and context ptrs are initialized, throws if not.
   void assert_init() const;
@@ -42,12 +69,14 @@ public:
   template <typename T>
   friend ostream& operator<<(ostream &out, const HELContext<T> &ctx);
 
+  template <typename T>
+  friend void read_binary(istream &in, HELContext<T> &ctx);
+
 protected:
   void init_arrays();
-};
 
-// Helper function to help with bugged copy constructor of FHEContext.
-FHEcontext copy_helib_context(const FHEcontext& other);
+  void generate(const HELParams &params);
+};
 
 // Stream operators.
 template <typename Key>
@@ -56,8 +85,51 @@ istream& operator>> (istream &in, HELContext<Key> &ctx);
 template <typename Key>
 ostream& operator<< (ostream &out, const HELContext<Key> &ctx);
 
+// Binary serialization, much faster to load than the text of the stream
+// operators. Falls back to text inside the same framing when HElib has no
+// binary IO, read_binary() fails the stream on data from the other format.
+template <typename Key>
+void write_binary(ostream &out, const HELContext<Key> &ctx);
+
+template <typename Key>
+void read_binary(istream &in, HELContext<Key> &ctx);
+
 // Commodity.
 typedef HELContext<FHEPubKey> PublicCtx;
 typedef HELContext<FHESecKey> PrivateCtx;
 
+// Generates the key switching matrices missing for rotations by amounts into
+// a copy of the key, which replaces ctx's. Keys are never modified, so this is
+// safe while copies of the context are in use: they keep the old key, and so
+// do the values encrypted under them (HElib ties a ciphertext to its key).
+// Contexts copied from ctx afterwards (e.g. for NetWorkerListener::
+// set_context()) have the new matrices. So run it before encrypting the
+// circuit's inputs, sized on a plain copy of the circuit like choose_params().
+// Returns whether it generated any.
+bool ensure_rotations(PrivateCtx &ctx, const std::vector<long> &amounts);
+
+// Same for the rotations of params (and of total sums if it has them), e.g.
+// ensure_rotations(ctx, choose_params(plain_evaluator)) for an existing key.
+bool ensure_rotations(PrivateCtx &ctx, const HELParams &params);
+
+// Same for every rotation, i.e. HElib's addSome1DMatrices().
+void ensure_all_rotations(PrivateCtx &ctx);
+
+// Where cached_private_ctx() keeps the context for these parameters.
+std::string cached_private_ctx_path(const std::string &cache_dir, long key_security,
+                                    long depth, long p = 2, long r = 1, long w = 64,
+                                    long c = 2, long d = 0, long s = 0);
+
+// Same as the generating constructor, but keeps the result in cache_dir keyed
+// by the parameters, so later calls only load it. Corrupt entries (checked by
+// SHA-256) are regenerated. An empty cache_dir disables the cache.
+PrivateCtx cached_private_ctx(const std::string &cache_dir, long key_security,
+                              long depth, long p = 2, long r = 1, long w = 64,
+                              long c = 2, long d = 0, long s = 0);
+
+PrivateCtx cached_private_ctx(const std::string &cache_dir, const HELParams &params);
+
+std::string cached_private_ctx_path(const std::string &cache_dir,
+                                    const HELParams &params);
+
 #endif //HELCONTEXT_H
@@ -0,0 +1,44 @@
+// HElib parameters for generating a HELContext, see ChooseParams.h to pick
+// them for a circuit. No dependencies, the library's headers include it.
+
+#ifndef HELPARAMS_H
+#define HELPARAMS_H
+
+#include <string>
+#include <vector>
+
+// Arguments of the generating HELContext constructor, same names and defaults.
+struct HELParams {
+  HELParams() {}
+
+  HELParams(long key_security_, long depth_, long p_ = 2, long r_ = 1,
+            long w_ = 64, long c_ = 2, long d_ = 0, long s_ = 0)
+    : key_security(key_security_), depth(depth_), p(p_), r(r_), w(w_), c(c_),
+      d(d_), s(s_) {}
+
+  long key_security = 80;
+  long depth = 1;  // L, levels of the modulus chain.
+  long p = 2;
+  long r = 1;
+  long w = 64;
+  long c = 2;      // Columns of the key switching matrices.
+  long d = 0;
+  long s = 0;      // Minimum number of slots.
+  // Slot rotations to generate key switching matrices for, only packed
+  // circuits rotate. Others can be added later with ensure_rotations().
+  std::vector<long> rotations;
+  // Also the rotations that HElib's totalSums() goes through.
+  bool total_sums = false;
+
+  std::string to_string() const {
+    return "k: " + std::to_string(this->key_security) + ", L: "
+           + std::to_string(this->depth) + ", p: " + std::to_string(this->p)
+           + ", r: " + std::to_string(this->r) + ", w: " + std::to_string(this->w)
+           + ", c: " + std::to_string(this->c) + ", d: " + std::to_string(this->d)
+           + ", s: " + std::to_string(this->s) + ", rotations: "
+           + std::to_string(this->rotations.size()) + ", total_sums: "
+           + std::to_string(this->total_sums);
+  }
+};
+
+#endif  // HELPARAMS_H
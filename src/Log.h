@@ -26,6 +26,17 @@ public:
     return *out;
   }
 
+  // Hold the lock across fork(), otherwise another thread could own it at that
+  // moment and the child would block forever on its first message. Both the
+  // parent and the child must unlock afterwards.
+  static void lock() {
+    mtx.lock();
+  }
+
+  static void unlock() {
+    mtx.unlock();
+  }
+
   Log(const std::string &name_ = "")
     : name(name_) {}
 
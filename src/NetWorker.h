@@ -9,11 +9,20 @@
 #include <mutex>
 #include <cstdint>
 #include <exception>
+#include <functional>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <set>
+#include <condition_variable>
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
 #include <unistd.h>
+#include <sys/socket.h>
 
 #include "Scheduler.h"
+#include "ElementOps.h"
+#include "Util.h"
 #include "Log.h"
 
 using namespace boost::asio::ip;
@@ -54,29 +63,30 @@ T deserialize(std::istream &is) {
 }
 
 // Serializes the length together with the actual data, useful for safety.
-// The template parameter must implement operators << and >>.
+// Goes through ElementOps<T>::write/read, operators << and >> by default.
 template <typename T>
 std::string safe_serialize(const T &data) {
   std::stringstream ss;
-  ss << data;
+  ElementOps<T>::write(data, ss);
   return serialize(ss.str().size()) + ss.str();
 }
 
 template <typename T>
 void safe_serialize(const T &data, std::ostream &os) {
   std::stringstream ss;
-  ss << data;
+  ElementOps<T>::write(data, ss);
   serialize(ss.str().size(), os);
   os << ss.str();
 }
 
+// like is for types that need a value to make one, see ElementOps::make().
 template <typename T>
-T safe_deserialize(const std::string &data) {
+T safe_deserialize(const std::string &data, const T *like = nullptr) {
   std::stringstream ss;
-  T ret;
+  T ret = ElementOps<T>::make(like);
   auto size = deserialize<size_t>(data);
   ss.str(data.substr(size + 1, data.size()));
-  ss >> std::noskipws >> ret;
+  ElementOps<T>::read(ret, ss);
   return ret;
 }
 
@@ -92,34 +102,92 @@ void safe_deserialize(T &data, std::istream &is) {
 
   std::stringstream ss;
   ss.str(buf);
-  ss >> std::noskipws >> data;
+  ElementOps<T>::read(data, ss);
 }
 
 template <typename T>
-T safe_deserialize(std::iostream &is) {
-  T ret;
+T safe_deserialize(std::iostream &is, const T *like = nullptr) {
+  T ret = ElementOps<T>::make(like);
   safe_deserialize(ret, is);
   return ret;
 }
 
-// Used to transmit 2 variables and their operation.
+// Length-prefixed raw bytes, for payloads that aren't text friendly.
+inline void write_blob(const std::string &data, std::ostream &os) {
+  serialize((uint64_t) data.size(), os);
+  os.write(data.data(), data.size());
+}
+
+inline std::string read_blob(std::istream &is, uint64_t max_size = 1ull << 36) {
+  auto size = deserialize<uint64_t>(is);
+  std::string ret;
+  if (! is.good())
+    return ret;
+  if (size > max_size) {
+    is.setstate(std::ios::failbit);
+    return ret;
+  }
+  ret.resize(size);
+  is.read(&ret[0], size);
+  return ret;
+}
+
+// Used to transmit 2 variables and their operation. Same operations as
+// Worker::Op, in the same order. The unary operations carry an amount or
+// moves instead of the right operand.
 template <typename T>
 struct NetWorkerMsg {
-  enum OP {SUM, PROD} op;
+  enum OP {SUM, PROD, PROD_LAZY, SUM_RELIN, ROTATE, SHIFT, TOTAL_SUM, PERMUTE,
+           SCALE} op;
   T left;
   T right;
+  int64_t amount;
+  SlotMoves_t moves;
+
+  // Protects against allocating for a garbage count.
+  static const uint32_t max_moves = 1 << 20;
+
+  static bool unary(OP op_) {
+    return op_ == ROTATE || op_ == SHIFT || op_ == TOTAL_SUM || op_ == PERMUTE
+           || op_ == SCALE;
+  }
 
   std::string to_string() {
-    return std::string() + (op == SUM ? "S " : "P ") + std::to_string(left)
+    static const char *names[] = {"S ", "P ", "PL ", "SR ", "R ", "SH ", "T ", "PM ",
+                                  "SC "};
+    if (op == PERMUTE)
+      return std::string() + names[op] + std::to_string(left) + " "
+        + std::to_string(moves.size()) + " moves";
+    if (unary(op))
+      return std::string() + names[op] + std::to_string(left) + " "
+        + std::to_string(amount);
+    return std::string() + names[op] + std::to_string(left)
       + " " + std::to_string(right);
   }
 };
 
+// Writes a NetWorkerMsg straight from the operands, saves copying them into one.
+template <typename T>
+void serialize_msg(typename NetWorkerMsg<T>::OP op, const T &left, const T &right,
+                   const int64_t &amount, const SlotMoves_t *moves, std::ostream &os) {
+  serialize(op, os);
+  safe_serialize(left, os);
+  if (op == NetWorkerMsg<T>::PERMUTE) {
+    serialize((uint32_t) moves->size(), os);
+    for (auto &move : *moves) {
+      serialize((int64_t) move.first, os);
+      serialize((int64_t) move.second, os);
+    }
+  } else if (NetWorkerMsg<T>::unary(op)) {
+    serialize(amount, os);
+  } else {
+    safe_serialize(right, os);
+  }
+}
+
 template <typename T>
 std::ostream& operator<<(std::ostream& os, const NetWorkerMsg<T> &obj) {
-  serialize(obj.op, os);
-  safe_serialize(obj.left, os);
-  safe_serialize(obj.right, os);
+  serialize_msg(obj.op, obj.left, obj.right, obj.amount, &obj.moves, os);
 
   return os;
 }
@@ -128,64 +196,316 @@ template <typename T>
 std::istream& operator>>(std::istream& is, NetWorkerMsg<T> &obj) {
   deserialize(obj.op, is);
   safe_deserialize(obj.left, is);
-  safe_deserialize(obj.right, is);
+  if (obj.op == NetWorkerMsg<T>::PERMUTE) {
+    auto size = deserialize<uint32_t>(is);
+    if (! is.good())
+      return is;
+    if (size > NetWorkerMsg<T>::max_moves) {
+      is.setstate(std::ios::failbit);
+      return is;
+    }
+    obj.moves.resize(size);
+    for (auto &move : obj.moves) {
+      move.first = deserialize<int64_t>(is);
+      move.second = deserialize<int64_t>(is);
+    }
+  } else if (NetWorkerMsg<T>::unary(obj.op)) {
+    deserialize(obj.amount, is);
+  } else {
+    safe_deserialize(obj.right, is);
+  }
 
   return is;
 }
 
+// Many independent operations for one worker in a single frame, answered by a
+// NetWorkerResults frame with the results in the same order.
+// Both read their values into ElementOps<T>::make(like), set like for types
+// that need a key to make one.
+template <typename T>
+struct NetWorkerBatch {
+  std::vector<NetWorkerMsg<T> > msgs;
+  const T *like = nullptr;
+
+  // Protects against allocating for a garbage count.
+  static const uint32_t max_size = 1 << 16;
+};
+
+template <typename T>
+struct NetWorkerResults {
+  std::vector<T> results;
+  const T *like = nullptr;
+};
+
+template <typename T>
+std::ostream& operator<<(std::ostream& os, const NetWorkerBatch<T> &obj) {
+  serialize((uint32_t) obj.msgs.size(), os);
+  for (const auto &msg : obj.msgs)
+    os << msg;
+
+  return os;
+}
+
+template <typename T>
+std::istream& operator>>(std::istream& is, NetWorkerBatch<T> &obj) {
+  auto size = deserialize<uint32_t>(is);
+  if (! is.good())
+    return is;
+  if (size > NetWorkerBatch<T>::max_size) {
+    is.setstate(std::ios::failbit);
+    return is;
+  }
+
+  obj.msgs.clear();
+  if (size == 0)
+    return is;
+  NetWorkerMsg<T> blank = {NetWorkerMsg<T>::SUM, ElementOps<T>::make(obj.like),
+                           ElementOps<T>::make(obj.like), 0, SlotMoves_t()};
+  obj.msgs.assign(size, blank);
+  for (auto &msg : obj.msgs)
+    is >> msg;
+
+  return is;
+}
+
+template <typename T>
+std::ostream& operator<<(std::ostream& os, const NetWorkerResults<T> &obj) {
+  serialize((uint32_t) obj.results.size(), os);
+  for (const auto &result : obj.results)
+    safe_serialize(result, os);
+
+  return os;
+}
+
+template <typename T>
+std::istream& operator>>(std::istream& is, NetWorkerResults<T> &obj) {
+  auto size = deserialize<uint32_t>(is);
+  if (! is.good())
+    return is;
+  if (size > NetWorkerBatch<T>::max_size) {
+    is.setstate(std::ios::failbit);
+    return is;
+  }
+
+  obj.results.clear();
+  if (size == 0)
+    return is;
+  obj.results.assign(size, ElementOps<T>::make(obj.like));
+  for (auto &result : obj.results)
+    safe_deserialize(result, is);
+
+  return is;
+}
+
+// Picks how many operations go in a frame from the observed bytes per
+// operation: cheap element types amortize the framing and syscalls over many
+// operations, ciphertexts still go one at a time.
+// Never fewer than min_ops though, one per core of the remote end, which runs
+// the operations of a frame in parallel.
+struct BatchSizer {
+  static constexpr double target_bytes = 1 << 16;
+  static const size_t max_ops = 256;
+
+  double op_bytes = 0;  // Moving average, 0 if unknown.
+  size_t min_ops = 1;
+
+  size_t size() const {
+    if (this->op_bytes == 0)
+      return this->min_ops;
+    auto n = static_cast<size_t>(target_bytes / this->op_bytes);
+    return std::max<size_t>(this->min_ops, std::min(n, size_t(max_ops)));
+  }
+
+  void observe(size_t frame_bytes, size_t n_ops) {
+    double bytes = static_cast<double>(frame_bytes) / n_ops;
+    this->op_bytes = this->op_bytes == 0 ? bytes : 0.8 * this->op_bytes + 0.2 * bytes;
+  }
+};
+
+// Writes the operations of a Worker batch as one NetWorkerBatch frame.
+template <typename T, typename Op>
+void send_batch(const std::vector<Op> &ops, BatchSizer &sizer, std::ostream &os) {
+  std::stringstream frame;
+  serialize((uint32_t) ops.size(), frame);
+  for (const auto &op : ops)
+    serialize_msg(static_cast<typename NetWorkerMsg<T>::OP>(op.kind),
+                  *op.left, *op.right, op.amount, op.moves, frame);
+
+  auto buf = frame.str();
+  sizer.observe(buf.size(), ops.size());
+  os.write(buf.data(), buf.size());
+  os.flush();
+}
+
+// Handshake sent by the NetWorkerRemote right after connecting, so the
+// scheduler knows what it is dealing with. Latencies are in seconds.
+struct NetWorkerHello {
+  uint32_t cores = 1;
+  double sum_latency = 0;
+  double prod_latency = 0;
+};
+
+inline std::ostream& operator<<(std::ostream& os, const NetWorkerHello &obj) {
+  serialize(obj.cores, os);
+  serialize(obj.sum_latency, os);
+  serialize(obj.prod_latency, os);
+
+  return os;
+}
+
+inline std::istream& operator>>(std::istream& is, NetWorkerHello &obj) {
+  deserialize(obj.cores, is);
+  deserialize(obj.sum_latency, is);
+  deserialize(obj.prod_latency, is);
+
+  return is;
+}
+
+// Performs the operation requested by msg, for the remote ends.
+template <typename T>
+T apply_msg(const NetWorkerMsg<T> &msg) {
+  switch (msg.op) {
+    case NetWorkerMsg<T>::SUM: return msg.left + msg.right;
+    case NetWorkerMsg<T>::PROD: return msg.left * msg.right;
+    case NetWorkerMsg<T>::PROD_LAZY: return ElementOps<T>::prod_lazy(msg.left, msg.right);
+    case NetWorkerMsg<T>::SUM_RELIN: {
+      T result = msg.left + msg.right;
+      ElementOps<T>::relinearize(result);
+      return result;
+    }
+    case NetWorkerMsg<T>::ROTATE: return ElementOps<T>::rotate(msg.left, msg.amount);
+    case NetWorkerMsg<T>::SHIFT: return ElementOps<T>::shift(msg.left, msg.amount);
+    case NetWorkerMsg<T>::TOTAL_SUM: return ElementOps<T>::total_sum(msg.left);
+    case NetWorkerMsg<T>::PERMUTE: return ElementOps<T>::permute(msg.left, msg.moves);
+    case NetWorkerMsg<T>::SCALE: return ElementOps<T>::scale(msg.left, msg.amount);
+    default: throw std::runtime_error("Unknown operation " + std::to_string(msg.op));
+  }
+}
+
+// Average time of op(), repeated until the time budget or repetition cap is hit.
+inline double time_op(std::function<void ()> op, double budget = 0.01,
+                      unsigned int max_reps = 1000) {
+  auto start = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed(0);
+  unsigned int reps = 0;
+  while (reps < max_reps && elapsed.count() < budget) {
+    op();
+    reps++;
+    elapsed = std::chrono::steady_clock::now() - start;
+  }
+  return elapsed.count() / reps;
+}
+
+// Performs all the operations of a batch on up to n_threads threads, for the
+// remote ends.
+template <typename T>
+NetWorkerResults<T> apply_batch(const NetWorkerBatch<T> &batch,
+                                unsigned int n_threads = 1) {
+  NetWorkerResults<T> ret;
+  if (batch.msgs.empty())
+    return ret;
+  ret.results.assign(batch.msgs.size(), ElementOps<T>::make(&batch.msgs[0].left));
+  parallel_for(batch.msgs.size(), [&] (size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++)
+      ret.results[i] = apply_msg(batch.msgs[i]);
+  }, n_threads);
+  return ret;
+}
+
+// Builds the handshake for a worker process: core count and the time SUM and
+// PROD take on operands produced by sample().
+template <typename T>
+NetWorkerHello benchmark_worker(std::function<T ()> sample) {
+  NetWorkerHello hello;
+  hello.cores = std::max(1u, std::thread::hardware_concurrency());
+
+  T left = sample(), right = sample();
+  T result = left;
+  hello.sum_latency = time_op([&] () { result = left + right; });
+  hello.prod_latency = time_op([&] () { result = left * right; });
+  return hello;
+}
+
+// Threads worth running n_ops operations on for a worker that reported hello:
+// starting one costs tens of microseconds, so cheap operations (plain
+// integers, GFN) stay on the calling thread.
+inline unsigned int batch_threads(const NetWorkerHello &hello, size_t n_ops) {
+  const double thread_cost = 5e-5;
+  double seconds = n_ops * hello.sum_latency;
+  auto n = std::min(static_cast<size_t>(seconds / thread_cost), n_ops);
+  return std::max<size_t>(1, std::min<size_t>(n, hello.cores));
+}
+
 // Local stub, real execution should take place in NetWorkerRemote.
 template <typename T>
 class NetWorker : public Worker<T> {
 public:
   NetWorker(Scheduler<T> &scheduler, const std::string &name_,
-              std::shared_ptr<tcp::iostream> socket)
-    : Worker<T>(scheduler, name_), ssock(socket) {}
+              std::shared_ptr<tcp::iostream> socket,
+              const WorkerCaps &caps_ = WorkerCaps())
+    : Worker<T>(scheduler, name_), ssock(socket) {
+    this->sizer.min_ops = caps_.cores;
+    this->set_caps(caps_);
+  }
 
   virtual ~NetWorker() {
     this->ssock->close();
   }
 
 private:
+  typedef typename Worker<T>::Op Op;
+
   std::shared_ptr<tcp::iostream> ssock;
+  BatchSizer sizer;
+
+  virtual size_t max_batch() {
+    return this->sizer.size();
+  }
 
   virtual T do_sum(const T &left, const T &right) {
-    return this->get_result(NetWorkerMsg<T>::SUM, left, right);
+    return this->do_batch({{Op::SUM, &left, &right}}).at(0);
   }
 
   virtual T do_prod(const T &left, const T &right) {
-    return this->get_result(NetWorkerMsg<T>::PROD, left, right);
+    return this->do_batch({{Op::PROD, &left, &right}}).at(0);
   }
 
-  T get_result(const typename NetWorkerMsg<T>::OP &op, const T &left, const T &right) {
+  virtual std::vector<T> do_batch(const std::vector<Op> &ops) {
     auto check_conn = [this] () { if (! *this->ssock) {
                                       auto err = this->ssock->error();
-                                      if (err == boost::asio::error::eof) {
+                                      if (err == boost::asio::error::eof)
                                         this->log.info("Connection terminated, exiting.");
-                                        this->sched.unregister_worker(this);
-                                        delete this;
-                                      }
                                       throw std::runtime_error(err.message());} };
     // Send request
-    NetWorkerMsg<T> msg;
-    msg.op = op;
-    msg.left = left;
-    msg.right = right;
-
-    this->log.dbg("Sending request");
-    *this->ssock << msg;
+    this->log.dbg("Sending " + std::to_string(ops.size()) + " requests");
+    TraceSpan send_span("send", "net");
+    if (send_span.active())
+      send_span.set_detail(std::to_string(ops.size()) + " ops");
+    send_batch<T>(ops, this->sizer, *this->ssock);
+    send_span.end();
     check_conn();
 
     // Get reply;
-    T reply;
+    NetWorkerResults<T> reply;
+    reply.like = ops.at(0).left;
 
     this->log.dbg("Waiting for reply");
-    safe_deserialize(reply, *this->ssock);
+    TraceSpan recv_span("recv", "net");
+    *this->ssock >> reply;
+    recv_span.end();
     check_conn();
 
-    return reply;
+    return reply.results;
   }
 };
 
+// Each operation is a small frame answered before the next, so don't let
+// Nagle's algorithm hold them back waiting for the delayed ACK of the last.
+inline void set_no_delay(tcp::iostream &ssock) {
+  boost::system::error_code err;
+  ssock.socket().set_option(tcp::no_delay(true), err);
+}
+
 // Listens for new worker connections and creates an Worker for the given
 // scheduler.
 template <typename T>
@@ -201,9 +521,40 @@ public:
     log.info("Stopping");
     this->io_service.stop();
     this->thrd.join();
+
+    // Cut the handshakes still going, they end as soon as their reads fail.
+    std::unique_lock<std::mutex> lck(this->mtx);
+    this->stopping = true;
+    for (auto ssock : this->joining)
+      ::shutdown(ssock->rdbuf()->native_handle(), SHUT_RDWR);
+    this->notify_joined.wait(lck, [this] () { return this->joining.empty(); });
     log.dbg("Stopped");
   }
 
+  // Seconds a new worker gets to complete the handshake, context transfer
+  // included, before it's dropped.
+  void set_handshake_timeout(double seconds) {
+    std::lock_guard<std::mutex> lck(this->mtx);
+    this->handshake_timeout = seconds;
+  }
+
+  // Context every new worker needs before it can operate on T, typically a
+  // serialized PublicCtx. Workers are told its hash when they connect and only
+  // fetch it when they don't have it in their cache.
+  void set_context(const std::string &context_) {
+    auto ptr = std::make_shared<const std::string>(context_);
+    auto hash = sha256(context_);
+    std::lock_guard<std::mutex> lck(this->mtx);
+    this->context = ptr;
+    this->context_hash = hash;
+  }
+
+  // Number of times the context was actually transferred.
+  unsigned int get_context_sends() {
+    std::lock_guard<std::mutex> lck(this->mtx);
+    return this->context_sends;
+  }
+
 private:
   Scheduler<T> &sched;  // Scheduler that receives the Workers.
   Log log;
@@ -211,6 +562,16 @@ private:
   std::thread thrd;  // The thread that runs this->run().
   std::mutex mtx;
 
+  // Protected by mtx.
+  std::shared_ptr<const std::string> context;
+  std::string context_hash;  // Empty if there's no context.
+  unsigned int context_sends = 0;
+  double handshake_timeout = 600;
+  // Connections still in their handshake, each on its own thread.
+  std::set<std::shared_ptr<tcp::iostream> > joining;
+  std::condition_variable notify_joined;
+  bool stopping = false;
+
   // Boost socket.
   boost::asio::io_service io_service;
   tcp::acceptor listen_sock;
@@ -221,17 +582,103 @@ private:
     this->io_service.run();
   }
 
-  // New connection handler, Boost ASIO flavor.
+  // New connection handler, Boost ASIO flavor. The handshake runs on its own
+  // thread, so a slow or hung worker doesn't hold up the ones joining after it.
   void accept_handle(std::shared_ptr<tcp::iostream> ssock) {
-    std::string worker_name = ssock->rdbuf()->remote_endpoint().address().to_string();
-    worker_name += ":" + std::to_string(ssock->rdbuf()->remote_endpoint().port());
-    log.info("New connection from " + worker_name);
+    {
+      std::lock_guard<std::mutex> lck(this->mtx);
+      this->joining.insert(ssock);
+    }
+    std::thread(&NetWorkerListener::join, this, ssock).detach();
+    this->accept();
+  }
 
+  // Registers the worker once the handshake completes, unless we're stopping.
+  void join(std::shared_ptr<tcp::iostream> ssock) {
+    std::string worker_name;
+    WorkerCaps caps;
+    bool ok = false;
+    try {
+      ok = this->handshake(*ssock, worker_name, caps);
+    } catch (std::exception &e) {
+      log.err(std::string("Handshake failed: ") + e.what());
+    }
+
+    std::lock_guard<std::mutex> lck(this->mtx);
     // Create the worker, it will register itself with the scheduler.
-    worker_name = "NetWorker_" + worker_name;
-    new NetWorker<T>(this->sched, worker_name, ssock);
+    if (ok && ! this->stopping)
+      new NetWorker<T>(this->sched, "NetWorker_" + worker_name, ssock, caps);
+    else
+      ssock->close();
+    this->joining.erase(ssock);
+    this->notify_joined.notify_all();
+  }
 
-    this->accept();
+  // Context and capabilities, within the handshake timeout. Returns false if
+  // the worker failed to complete it.
+  bool handshake(tcp::iostream &ssock, std::string &worker_name, WorkerCaps &caps) {
+    worker_name = ssock.rdbuf()->remote_endpoint().address().to_string();
+    worker_name += ":" + std::to_string(ssock.rdbuf()->remote_endpoint().port());
+    log.info("New connection from " + worker_name);
+    set_no_delay(ssock);
+
+    double timeout;
+    {
+      std::lock_guard<std::mutex> lck(this->mtx);
+      timeout = this->handshake_timeout;
+    }
+    ssock.expires_after(std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                          std::chrono::duration<double>(timeout)));
+
+    if (! this->offer_context(ssock)) {
+      log.err("Sending the context to " + worker_name + " failed: "
+              + ssock.error().message());
+      return false;
+    }
+
+    NetWorkerHello hello;
+    ssock >> hello;
+    if (! ssock) {
+      log.err("Handshake with " + worker_name + " failed: " + ssock.error().message());
+      return false;
+    }
+    log.info(worker_name + " has " + std::to_string(hello.cores) + " cores, sum "
+             + std::to_string(hello.sum_latency) + "s, prod "
+             + std::to_string(hello.prod_latency) + "s");
+    ssock.expires_at(tcp::iostream::time_point::max());
+
+    caps.cores = hello.cores;
+    caps.sum_latency = hello.sum_latency;
+    caps.prod_latency = hello.prod_latency;
+    return true;
+  }
+
+  // Advertises the context by its hash, then sends it if the worker asks.
+  bool offer_context(tcp::iostream &ssock) {
+    std::shared_ptr<const std::string> ctx;
+    std::string hash;
+    {
+      std::lock_guard<std::mutex> lck(this->mtx);
+      ctx = this->context;
+      hash = this->context_hash;
+    }
+
+    write_blob(hash, ssock);
+    ssock.flush();
+    if (hash.empty())
+      return ssock.good();
+
+    auto need = deserialize<uint8_t>(ssock);
+    if (! ssock)
+      return false;
+    if (need) {
+      log.info("Sending context " + hash.substr(0, 16));
+      write_blob(*ctx, ssock);
+      ssock.flush();
+      std::lock_guard<std::mutex> lck(this->mtx);
+      this->context_sends++;
+    }
+    return ssock.good();
   }
 
   // Sets up a non-blocking listen socket.
@@ -243,38 +690,119 @@ private:
 
 };
 
-// Counterpart to NetWorker that actually performs the tasks.
+// Counterpart to NetWorker that actually performs the tasks, returns once the
+// connection is closed.
+// The sample function provides the operand used to benchmark SUM and PROD for
+// the handshake, it should be representative of the real workload.
+// The context function installs the context advertised by the listener (see
+// NetWorkerListener::set_context), which is kept in cache_dir by its hash.
+// Requests are read under the key of a sample taken after it (see
+// ElementOps::make()), so for ciphertexts the sample should use that context.
 template <typename T>
 class NetWorkerRemote {
 public:
-  NetWorkerRemote(const std::string &host, const std::string &port)
-    : log("NetWorkerRemote") {
+  typedef std::function<T ()> SampleFn_t;
+  typedef std::function<void (std::istream &)> ContextFn_t;
+
+  NetWorkerRemote(const std::string &host, const std::string &port,
+                  SampleFn_t sample_ = [] () { return T(); },
+                  ContextFn_t load_context_ = nullptr,
+                  const std::string &cache_dir_ = default_cache_dir())
+    : log("NetWorkerRemote"), sample(sample_), load_context(load_context_),
+      cache_dir(cache_dir_) {
     this->connect(host, port);
+    this->handshake();
     this->run();
   }
 
-  NetWorkerRemote(const std::string &addr)
-    : log("NetWorkerRemote") {
+  NetWorkerRemote(const std::string &addr,
+                  SampleFn_t sample_ = [] () { return T(); },
+                  ContextFn_t load_context_ = nullptr,
+                  const std::string &cache_dir_ = default_cache_dir())
+    : log("NetWorkerRemote"), sample(sample_), load_context(load_context_),
+      cache_dir(cache_dir_) {
     auto tok = addr.find(":");
     auto host = addr.substr(0, tok);
     auto port = addr.substr(++tok, addr.size());
     this->connect(host, port);
+    this->handshake();
     this->run();
   }
 
 private:
   tcp::iostream ssock;  // Streaming socket.
   Log log;
+  SampleFn_t sample;
+  ContextFn_t load_context;
+  std::string cache_dir;
+  NetWorkerHello hello;  // What we told the listener.
 
   void connect(const std::string &host, const std::string &port) {
     log.info("Connecting to " + host + ":" + port);
     this->ssock.connect(host, port);
-    if (this->ssock)
+    if (this->ssock) {
+      set_no_delay(this->ssock);
       log.info("Connected");
+    }
     else
       throw std::runtime_error(this->ssock.error().message());
   }
 
+  // Get the context from the cache or the listener, then report our core count
+  // and how fast we are on the active T.
+  void handshake() {
+    this->fetch_context();
+
+    this->hello = benchmark_worker<T>(this->sample);
+
+    log.info("Sending handshake");
+    this->ssock << this->hello;
+    this->ssock.flush();
+    if (! this->ssock)
+      throw std::runtime_error(this->ssock.error().message());
+  }
+
+  void fetch_context() {
+    auto check_conn = [this] () { if (! this->ssock)
+                                    throw std::runtime_error(this->ssock.error().message()); };
+
+    auto hash = read_blob(this->ssock, 64);
+    check_conn();
+    if (hash.empty())
+      return;
+    // It names a file in the cache, anything but a SHA-256 is refused.
+    if (hash.size() != 64 || hash.find_first_not_of("0123456789abcdef") != std::string::npos)
+      throw std::runtime_error("Invalid context hash");
+
+    std::string ctx;
+    auto path = this->cache_dir + "/context-" + hash;
+    bool cached = read_file(path, ctx) && sha256(ctx) == hash;
+    bool need = this->load_context && ! cached;
+    serialize((uint8_t) need, this->ssock);
+    this->ssock.flush();
+    check_conn();
+
+    if (! this->load_context) {
+      log.info("No way to load context " + hash.substr(0, 16) + ", ignoring it");
+      return;
+    }
+
+    if (need) {
+      log.info("Fetching context " + hash.substr(0, 16));
+      ctx = read_blob(this->ssock);
+      check_conn();
+      if (sha256(ctx) != hash)
+        throw std::runtime_error("Received context doesn't match its hash");
+      if (! write_file_atomic(path, ctx))
+        log.err("Can't write " + path);
+    } else {
+      log.info("Context " + hash.substr(0, 16) + " found in cache");
+    }
+
+    std::stringstream ss(ctx);
+    this->load_context(ss);
+  }
+
   // Checks if the out stream is valid. Returns false for the conditions that should
   // result in graceful termination (i.e. socket was closed), throws on the others.
   bool check_valid() {
@@ -298,33 +826,36 @@ private:
   }
 
   void loop() {
+    const T like = this->sample();
     while(true) {
+      // False when the connection was closed.
       auto check_conn = [this] () { if (! this->ssock) {
                                       auto err = this->ssock.error();
                                       if (err == boost::asio::error::eof) {
                                         this->log.info("Connection terminated, exiting");
-                                        exit(0);
+                                        return false;
                                       }
-                                      throw std::runtime_error(err.message());} };
+                                      throw std::runtime_error(err.message());}
+                                    return true; };
 
       // Get a request.
       log.dbg("Waiting for request");
-      auto msg = NetWorkerMsg<T>();
-      this->ssock >> msg;
-      check_conn();
+      auto batch = NetWorkerBatch<T>();
+      batch.like = &like;
+      this->ssock >> batch;
+      if (! check_conn())
+        return;
 
       // Process it.
-      log.dbg("Got request, processing");
-      T reply;
-      switch (msg.op) {
-        case NetWorkerMsg<T>::SUM: reply = msg.left + msg.right; break;
-        case NetWorkerMsg<T>::PROD: reply = msg.left * msg.right; break;
-      }
+      log.dbg("Got " + std::to_string(batch.msgs.size()) + " requests, processing");
+      auto reply = apply_batch(batch, batch_threads(this->hello, batch.msgs.size()));
 
       // Send back the reply;
       log.dbg("Sending reply");
-      this->ssock << safe_serialize(reply);
-      check_conn();
+      this->ssock << reply;
+      this->ssock.flush();
+      if (! check_conn())
+        return;
     }
   }
 };
@@ -332,12 +863,23 @@ private:
 // The NetWorkerRemote is single-threaded, this forks and connects after 0.5s.
 // This is only a convenience for testing, doesn't close the proper sockets, etc.
 template <typename T>
-pid_t fork_remote_worker(const std::string &addr) {
+pid_t fork_remote_worker(
+    const std::string &addr,
+    typename NetWorkerRemote<T>::SampleFn_t sample = [] () { return T(); },
+    typename NetWorkerRemote<T>::ContextFn_t load_context = nullptr,
+    const std::string &cache_dir = default_cache_dir()) {
+  Log::lock();
   pid_t pid = fork();
+  Log::unlock();
   if (pid == 0) {
     usleep(500000);
-    new NetWorkerRemote<T>(addr);
-    exit(0);
+    try {
+      NetWorkerRemote<T>(addr, sample, load_context, cache_dir);
+    } catch (std::exception &e) {
+      Log("NetWorkerRemote").err(std::string("Terminating on exception: ") + e.what());
+    }
+    // Skip the destructors, they belong to the parent's threads and workers.
+    _exit(0);
   }
   return pid;
 }
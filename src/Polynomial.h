@@ -0,0 +1,182 @@
+// Polynomials and lookup tables on nodes, built with few products of two
+// values (constants are applied with ArithmeticNode::scale()) and low
+// multiplicative depth.
+
+#ifndef POLYNOMIAL_H
+#define POLYNOMIAL_H
+
+#include <cstdint>
+#include <vector>
+#include <map>
+#include <memory>
+#include <string>
+#include <stdexcept>
+
+#include "ArithmeticTree.h"
+#include "ElementOps.h"
+
+// Powers and monomials are cached per input node, so polynomials and tables on
+// the same input share them. like is passed to ElementOps<T>::constant() for
+// the constant terms, as in UInt.
+template <typename T>
+class PolyBuilder {
+public:
+  typedef ArithmeticNode<T> Node_t;
+
+  PolyBuilder(ArithmeticTree<T> &tree_, std::shared_ptr<const T> like_ = nullptr)
+    : tree(tree_), like(like_) {}
+
+  // sum coeffs[i] x^i, coefficients >= 0, by Paterson-Stockmeyer: the baby
+  // steps x, ..., x^(k-1) and the giant steps x^k, x^2k, x^4k... are balanced
+  // powers, the polynomial is split recursively at the giant steps. About
+  // 2 sqrt(d) products for degree d instead of d, depth about log2(d) + 1.
+  Node_t& poly(Node_t &x, const std::vector<long> &coeffs) {
+    this->take_like(x);
+    size_t n = coeffs.size();
+    while (n > 0 && coeffs[n - 1] == 0)
+      n--;
+    if (n <= 1)
+      return this->constant(n == 0 ? 0 : coeffs[0]);
+
+    auto k = baby_steps(n - 1);
+    return this->split(x, coeffs, 0, n, k);
+  }
+
+  // Baby step count minimizing the products for degree d: k - 1 baby steps,
+  // the giant steps and one product per split.
+  static size_t baby_steps(size_t d) {
+    size_t best = 1, best_cost = SIZE_MAX;
+    for (size_t k = 1; k <= d + 1; k++) {
+      size_t chunks = (d + k) / k;  // ceil((d + 1) / k)
+      size_t giants = 0;
+      for (size_t span = 1; span < chunks; span *= 2)
+        giants++;
+      size_t cost = (k - 1) + giants + (chunks - 1);
+      if (cost < best_cost) {
+        best = k;
+        best_cost = cost;
+      }
+    }
+    return best;
+  }
+
+  // x^e, each power the product of the two halves of its exponent so its depth
+  // is ceil(log2 e).
+  Node_t& power(Node_t &x, size_t e) {
+    if (e == 0)
+      return this->constant(1);
+    if (e == 1)
+      return x;
+    auto &cached = this->powers[&x][e];
+    if (! cached)
+      cached = &(this->power(x, e - e / 2) * this->power(x, e / 2));
+    return *cached;
+  }
+
+  // Output bits of table (table[v] for input value v) on input bits, least
+  // significant first. T must be GF(2)-like: each output bit is the xor of the
+  // monomials of its algebraic normal form, and all outputs of all tables on
+  // the same bits share the monomials.
+  std::vector<Node_t*> lut(const std::vector<Node_t*> &bits,
+                           const std::vector<uint64_t> &table, unsigned int out_bits) {
+    if (bits.size() >= 8 * sizeof(size_t) || table.size() != size_t(1) << bits.size())
+      throw std::invalid_argument("Table for " + std::to_string(bits.size())
+                                  + " bits needs 2^" + std::to_string(bits.size())
+                                  + " entries, got " + std::to_string(table.size()));
+    for (auto bit : bits)
+      this->take_like(*bit);
+
+    std::vector<Node_t*> ret;
+    for (unsigned int j = 0; j < out_bits; j++) {
+      // Moebius transform of the truth table gives the monomial coefficients.
+      std::vector<bool> anf(table.size());
+      for (size_t v = 0; v < table.size(); v++)
+        anf[v] = (table[v] >> j) & 1;
+      for (size_t i = 1; i < table.size(); i *= 2)
+        for (size_t v = 0; v < table.size(); v++)
+          if (v & i)
+            anf[v] = anf[v] != anf[v ^ i];
+
+      Node_t *out = nullptr;
+      for (size_t v = 0; v < table.size(); v++)
+        if (anf[v]) {
+          auto &term = this->monomial(bits, v);
+          out = out ? &(*out + term) : &term;
+        }
+      ret.push_back(out ? out : &this->constant(0));
+    }
+    return ret;
+  }
+
+private:
+  ArithmeticTree<T> &tree;
+  std::shared_ptr<const T> like;
+
+  std::map<Node_t*, std::map<size_t, Node_t*> > powers;
+  std::map<std::vector<Node_t*>, std::map<size_t, Node_t*> > monomials;
+  std::map<long, Node_t*> constants;
+
+  void take_like(Node_t &node) {
+    if (! this->like && node.get_data())
+      this->like = std::make_shared<const T>(node.get_data().get());
+  }
+
+  Node_t& constant(long c) {
+    auto &cached = this->constants[c];
+    if (! cached) {
+      auto &one = this->tree.new_node(ElementOps<T>::constant(true, this->like.get()));
+      cached = c == 1 ? &one : &one.scale(c);
+    }
+    return *cached;
+  }
+
+  // coeffs[lo, hi) as a polynomial in x, i.e. divided by x^lo. Chunks of k
+  // coefficients are combinations of the baby steps, larger ranges split at
+  // the largest giant step x^(k 2^i) inside them.
+  Node_t& split(Node_t &x, const std::vector<long> &coeffs, size_t lo, size_t hi,
+                size_t k) {
+    if (hi - lo <= k) {
+      Node_t *ret = nullptr;
+      for (size_t i = lo; i < hi; i++) {
+        if (coeffs[i] == 0)
+          continue;
+        auto &term = i == lo ? this->constant(coeffs[i])
+                             : this->power(x, i - lo).scale(coeffs[i]);
+        ret = ret ? &(*ret + term) : &term;
+      }
+      return ret ? *ret : this->constant(0);
+    }
+
+    size_t step = k;
+    while (2 * step < hi - lo)
+      step *= 2;
+    auto &low = this->split(x, coeffs, lo, lo + step, k);
+    auto &high = this->split(x, coeffs, lo + step, hi, k);
+    return low + high * this->power(x, step);
+  }
+
+  // Product of the bits set in mask, from the products of its two halves.
+  Node_t& monomial(const std::vector<Node_t*> &bits, size_t mask) {
+    if (mask == 0)
+      return this->constant(1);
+    auto &cached = this->monomials[bits][mask];
+    if (cached)
+      return *cached;
+
+    std::vector<size_t> set;
+    for (size_t i = 0; i < bits.size(); i++)
+      if (mask & (size_t(1) << i))
+        set.push_back(i);
+    if (set.size() == 1) {
+      cached = bits[set[0]];
+    } else {
+      size_t low = 0;
+      for (size_t i = 0; i < set.size() / 2; i++)
+        low |= size_t(1) << set[i];
+      cached = &(this->monomial(bits, low) * this->monomial(bits, mask ^ low));
+    }
+    return *cached;
+  }
+};
+
+#endif  // POLYNOMIAL_H
@@ -0,0 +1,166 @@
+// Grows and shrinks the set of workers of a Scheduler with the load. Every
+// interval it looks at the queue depth and at how long tasks wait in the queue,
+// spawns workers through a factory when they pile up and retires the ones it
+// spawned once they have been idle for a while.
+
+#ifndef POOLCONTROLLER_H
+#define POOLCONTROLLER_H
+
+#include <set>
+#include <string>
+#include <iterator>
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+#include <atomic>
+
+#include "Scheduler.h"
+#include "Worker.h"
+#include "Log.h"
+
+struct PoolConfig {
+  // Bounds for the total number of workers of the scheduler.
+  unsigned int min_workers = 1;
+  unsigned int max_workers = std::max(1u, std::thread::hardware_concurrency());
+  // Grow when there are more queued tasks than this per worker...
+  double max_depth = 2;
+  // ... or when tasks wait in the queue longer than this many seconds.
+  double max_wait = 0.05;
+  // Retire our workers after they have been idle this many seconds.
+  double idle_timeout = 1;
+  // Seconds between checks.
+  double interval = 0.02;
+};
+
+template <typename T>
+class PoolController {
+public:
+  // Creates a worker registered with the scheduler. Defaults to WorkerStub
+  // threads, wrap fork_shm_worker for worker processes.
+  typedef std::function<Worker<T>* (Scheduler<T> &, const std::string &)> Factory_t;
+
+  PoolController(Scheduler<T> &scheduler, const PoolConfig &config_ = PoolConfig(),
+                 Factory_t factory_ = [] (Scheduler<T> &s, const std::string &name_) {
+                   return new WorkerStub<T>(s, name_); })
+    : sched(scheduler), config(config_), factory(factory_), log("PoolController") {
+    this->thrd = std::thread([&] (PoolController *ctl) { ctl->run(); }, this);
+  }
+
+  // The workers stay with the scheduler.
+  virtual ~PoolController() {
+    {
+      std::lock_guard<std::mutex> lck(this->mtx);
+      this->end = true;
+      this->notify_end.notify_one();
+    }
+    this->thrd.join();
+  }
+
+  // Workers currently managed by this controller.
+  size_t size() {
+    std::lock_guard<std::mutex> lck(this->mtx);
+    return this->owned.size();
+  }
+
+private:
+  Scheduler<T> &sched;
+  PoolConfig config;
+  Factory_t factory;
+  Log log;
+
+  std::thread thrd;
+  std::mutex mtx;
+  std::condition_variable notify_end;
+  bool end = false;
+
+  // Names of the workers we spawned, unique unlike their addresses, which a
+  // worker the scheduler deleted may pass on to a new one. Protected by mtx.
+  std::set<std::string> owned;
+
+  void run() {
+    std::unique_lock<std::mutex> lck(this->mtx);
+    auto interval = std::chrono::duration<double>(this->config.interval);
+    while (! this->notify_end.wait_for(lck, interval, [this] () { return this->end; })) {
+      lck.unlock();
+      try {
+        this->tick();
+      } catch (std::exception &e) {
+        log.err(std::string("Failed to resize the pool: ") + e.what());
+      }
+      lck.lock();
+    }
+  }
+
+  void tick() {
+    this->sched.reap();
+
+    // Forget the workers the scheduler dropped because they failed.
+    auto names = this->sched.get_worker_names();
+    {
+      std::lock_guard<std::mutex> lck(this->mtx);
+      for (auto it = this->owned.begin(); it != this->owned.end(); )
+        it = names.count(*it) ? std::next(it) : this->owned.erase(it);
+    }
+
+    size_t n = names.size();
+    size_t depth = this->sched.queue_depth();
+    bool busy = depth > this->config.max_depth * n
+                || (depth > 0 && this->sched.queue_wait() > this->config.max_wait);
+
+    size_t target = n;
+    if (n < this->config.min_workers)
+      target = this->config.min_workers;
+    else if (busy)
+      target = std::max<size_t>(n + 1, depth / this->config.max_depth);
+    target = std::min<size_t>(target, this->config.max_workers);
+
+    for (; n < target; n++)
+      this->spawn();
+
+    if (! busy && n > this->config.min_workers)
+      this->retire_idle();
+  }
+
+  void spawn() {
+    // Numbered across controllers, so names stay unique in a shared scheduler.
+    static std::atomic<unsigned int> n_spawned(0);
+    auto name = "PoolWorker_" + std::to_string(++n_spawned);
+    auto *worker = this->factory(this->sched, name);
+    if (worker == nullptr)
+      throw std::runtime_error("factory didn't produce " + name);
+
+    log.info("Spawned " + name);
+    std::lock_guard<std::mutex> lck(this->mtx);
+    this->owned.insert(name);
+  }
+
+  // Retires one of our workers if it has been idle for long enough. The
+  // scheduler picks it, so it's still alive when we look at it.
+  void retire_idle() {
+    std::set<std::string> ours;
+    {
+      std::lock_guard<std::mutex> lck(this->mtx);
+      ours = this->owned;
+    }
+
+    std::string name;
+    auto retired = this->sched.retire_if_idle(this->config.idle_timeout,
+                                              [&] (Worker<T> *worker) {
+      if (! ours.count(worker->get_name()))
+        return false;
+      name = worker->get_name();
+      return true;
+    });
+    if (! retired)
+      return;
+
+    std::lock_guard<std::mutex> lck(this->mtx);
+    this->owned.erase(name);
+  }
+};
+
+#endif  // POOLCONTROLLER_H
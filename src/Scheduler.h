@@ -1,6 +1,9 @@
 // A naive scheduler. Assumes CPU-bound workloads so it only attempts to keep all
 // workers busy. Producer-consumer model, (1) Evaluator -> (1) Scheduler
 // -> (n) Workers. Owns all workers assigned to it.
+// Dispatch is weighted by the workers' measured latencies and core counts: when
+// the faster idle workers have cores for all the tasks the slower ones leave
+// them the tasks, and workers with more cores take larger batches.
 
 #ifndef SCHEDULER_H
 #define SCHEDULER_H
@@ -10,9 +13,15 @@
 #include <memory>
 #include <set>
 #include <queue>
+#include <algorithm>
+#include <vector>
+#include <chrono>
 #include <exception>
+#include <functional>
+#include <string>
 
 #include "Worker.h"
+#include "Trace.h"
 
 template <typename T>
 struct Task {
@@ -20,6 +29,7 @@ struct Task {
     std::function<void ()> pre_exec;
     std::function<void ()> post_exec;
     std::function<void ()> on_fail;
+    std::chrono::steady_clock::time_point enqueued;
 };
 
 template <typename T>
@@ -32,35 +42,126 @@ public:
 
   void add_task(ArithmeticNode<T> &node, std::function<void ()> pre_exec,
                 std::function<void ()> post_exec, std::function<void ()> on_fail) {
+    if (Trace::enabled())
+      Trace::instant("enqueue", "scheduler", node.get_label());
     std::lock_guard<std::mutex> lock(this->mutex);
 
-    this->tasks.push({node, pre_exec, post_exec, on_fail});
+    this->tasks.push({node, pre_exec, post_exec, on_fail,
+                      std::chrono::steady_clock::now()});
     log.dbg("Added task " + node.get_label());
-    if (this->tasks.size() == 1)
-      for (auto exec : this->workers)
-        exec->notify_work.notify_one();
+    this->notify_idle();
   }
 
   std::set<Worker<T>* > get_workers() {
+    std::lock_guard<std::mutex> lck(this->mutex);
     return this->workers;
   }
 
+  std::set<std::string> get_worker_names() {
+    std::lock_guard<std::mutex> lck(this->mutex);
+    std::set<std::string> ret;
+    for (auto exec : this->workers)
+      ret.insert(exec->name);
+    return ret;
+  }
+
+  // Number of tasks waiting for a worker.
+  size_t queue_depth() {
+    std::lock_guard<std::mutex> lck(this->mutex);
+    return this->tasks.size();
+  }
+
+  // Cost class of the operation resolving node, for the latency estimates.
+  static WorkerCaps::OpClass op_class(const ArithmeticNode<T> &node) {
+    switch (node.state) {
+      case ArithmeticNode<T>::PROD: return WorkerCaps::PROD;
+      case ArithmeticNode<T>::ROTATE:
+      case ArithmeticNode<T>::SHIFT:
+      case ArithmeticNode<T>::PERMUTE: return WorkerCaps::ROTATE;
+      case ArithmeticNode<T>::TOTAL_SUM: return WorkerCaps::TOTAL_SUM;
+      default: return WorkerCaps::SUM;  // Sums and scaling.
+    }
+  }
+
+  // Moving average of the seconds tasks spend queued.
+  double queue_wait() {
+    std::lock_guard<std::mutex> lck(this->mutex);
+    return this->wait;
+  }
+
   virtual ~Scheduler() {
     log.info("Cleaning up workers...");
 
-    for (auto exec : this->workers)
+    this->reap();
+    for (auto exec : this->get_workers()) {
+      exec->stop();
       delete exec;
+    }
 
     log.info("Done cleaning");
   }
 
   // Note: will own the worker after registering.
   void register_worker(Worker<T> *worker) {
+    this->reap();
     std::lock_guard<std::mutex> lck(this->mutex);
     this->workers.insert(worker);
     log.info("Registered worker " + worker->name);
   }
 
+  // Gracefully removes a worker: it gets no more tasks, finishes the ones it
+  // has and is deleted. Returns false, leaving it alone, if the worker isn't
+  // registered (e.g. it failed and is waiting for reap()).
+  bool retire_worker(Worker<T> *worker) {
+    {
+      std::lock_guard<std::mutex> lck(this->mutex);
+      if (! this->workers.count(worker))
+        return false;
+      this->withdraw(worker);
+    }
+    worker->stop();
+    delete worker;
+    return true;
+  }
+
+  // Retires one of the workers that have been idle for more than idle_timeout
+  // seconds and for which pick() holds. Chosen and withdrawn under the mutex,
+  // so it can't fail and be discarded in between. pick() is called with the
+  // mutex held. Returns whether there was one.
+  bool retire_if_idle(double idle_timeout, std::function<bool (Worker<T> *)> pick) {
+    Worker<T> *victim = nullptr;
+    {
+      std::lock_guard<std::mutex> lck(this->mutex);
+      auto now = std::chrono::steady_clock::now();
+      for (auto exec : this->workers) {
+        std::chrono::duration<double> idle_for = now - exec->idle_since;
+        if (exec->idle && idle_for.count() > idle_timeout && pick(exec)) {
+          victim = exec;
+          break;
+        }
+      }
+      if (victim == nullptr)
+        return false;
+      this->withdraw(victim);
+    }
+    victim->stop();
+    delete victim;
+    return true;
+  }
+
+  // Deletes the workers that failed, see discard_worker().
+  void reap() {
+    std::vector<Worker<T>* > dead;
+    {
+      std::lock_guard<std::mutex> lck(this->mutex);
+      dead.swap(this->discarded);
+    }
+    for (auto exec : dead) {
+      exec->stop();
+      delete exec;
+    }
+  }
+
   void unregister_worker(Worker<T> *worker) {
     std::lock_guard<std::mutex> lck(this->mutex);
     this->workers.erase(worker);
@@ -71,6 +172,71 @@ private:
 
   std::set<Worker<T>* > workers;
 
+  // Failed workers, their threads have exited or are about to.
+  std::vector<Worker<T>* > discarded;
+
+  double wait = 0;  // See queue_wait().
+
+  // Called from a worker's own thread when it can't go on, it can't delete
+  // itself so it's deleted by the next reap().
+  void discard_worker(Worker<T> *worker) {
+    std::lock_guard<std::mutex> lck(this->mutex);
+    this->workers.erase(worker);
+    this->discarded.push_back(worker);
+    log.info("Discarded worker " + worker->name);
+  }
+
+  // Unregisters the worker and tells it to stop, so it can't take (and fail)
+  // another task before it's deleted. Must be called with the mutex held.
+  void withdraw(Worker<T> *worker) {
+    this->workers.erase(worker);
+    worker->end = true;
+    worker->notify_work.notify_one();
+    log.info("Retiring worker " + worker->name);
+  }
+
+  // Must be called with the mutex held.
+  void observe_wait(std::chrono::steady_clock::duration waited) {
+    double seconds = std::chrono::duration<double>(waited).count();
+    this->wait = this->wait == 0 ? seconds : 0.8 * this->wait + 0.2 * seconds;
+  }
+
+  // Wake up the idle workers so they can decide who takes the queued tasks.
+  // Must be called with the mutex held.
+  void notify_idle() {
+    for (auto exec : this->workers)
+      if (exec->idle)
+        exec->notify_work.notify_one();
+  }
+
+  // Whether the worker should take the front task, or leave it to the idle
+  // workers that are expected to finish it sooner. Must be called with the
+  // mutex held and a non-empty queue.
+  bool should_take(Worker<T> *worker) {
+    auto op = op_class(this->tasks.front().node);
+    double latency = worker->caps.latency(op);
+
+    size_t faster = 0;  // Cores of the faster idle workers.
+    for (auto exec : this->workers)
+      if (exec != worker && exec->idle && exec->caps.latency(op) < latency)
+        faster += exec->caps.cores;
+    return this->tasks.size() > faster;
+  }
+
+  // How many tasks the worker should take at once: its share of the queue by
+  // its cores among those of the idle workers, capped by what the worker can
+  // batch. Must be called with the mutex held.
+  size_t batch_size(Worker<T> *worker) {
+    size_t cores = std::max(1u, worker->caps.cores);
+    size_t idle_cores = cores;
+    for (auto exec : this->workers)
+      if (exec != worker && exec->idle)
+        idle_cores += std::max(1u, exec->caps.cores);
+
+    size_t share = (this->tasks.size() * cores + idle_cores - 1) / idle_cores;
+    return std::max<size_t>(1, std::min(share, worker->max_batch()));
+  }
+
   // Object-global lock.
   std::mutex mutex;
 
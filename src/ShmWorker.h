@@ -0,0 +1,407 @@
+// Support for worker processes on the same host. Requests and replies go through
+// a pair of shared-memory rings instead of loopback TCP, the peers only make a
+// syscall (eventfd) when the other side is blocked waiting.
+
+#ifndef SHMWORKER_H
+#define SHMWORKER_H
+
+#include <iostream>
+#include <string>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <stdexcept>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+
+#include "Scheduler.h"
+#include "NetWorker.h"
+#include "Log.h"
+
+// Single-producer single-consumer byte ring, lives at the start of a shared
+// mapping and is followed by its data. Positions only grow, the data offset is
+// position % capacity.
+struct ShmRing {
+  std::atomic<uint64_t> head;  // Bytes written.
+  std::atomic<uint64_t> tail;  // Bytes read.
+  std::atomic<uint32_t> reader_waiting;
+  std::atomic<uint32_t> writer_waiting;
+  std::atomic<bool> closed;
+  int data_fd;   // Wakes up the reader. Inherited by fork, so the same number.
+  int space_fd;  // Wakes up the writer.
+  uint64_t capacity;
+
+  char* data() {
+    return reinterpret_cast<char*>(this + 1);
+  }
+
+  static size_t size(uint64_t capacity_) {
+    return sizeof(ShmRing) + capacity_;
+  }
+
+  void init(uint64_t capacity_) {
+    this->head = 0;
+    this->tail = 0;
+    this->reader_waiting = 0;
+    this->writer_waiting = 0;
+    this->closed = false;
+    this->capacity = capacity_;
+    this->data_fd = eventfd(0, 0);
+    this->space_fd = eventfd(0, 0);
+    if (this->data_fd < 0 || this->space_fd < 0)
+      throw std::runtime_error(std::string("eventfd: ") + strerror(errno));
+  }
+
+  void close() {
+    this->closed = true;
+    signal(this->data_fd);
+    signal(this->space_fd);
+  }
+
+  static void signal(int fd) {
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) < 0)
+      return;  // Counter overflow, the peer is awake anyway.
+  }
+
+  // Wake up the peer if it's blocked.
+  static void notify(std::atomic<uint32_t> &waiting, int fd) {
+    if (waiting.exchange(0))
+      signal(fd);
+  }
+
+  // Blocks until ready() or the ring is closed, spins a little first since the
+  // peer is usually quick to answer. alive() is polled so a dead peer can't
+  // block us forever. Returns false if the ring was closed.
+  bool wait(std::atomic<uint32_t> &waiting, int fd, std::function<bool ()> ready,
+            std::function<bool ()> alive) {
+    for (int i = 0; i < spin_iterations; i++)
+      if (ready())
+        return true;
+
+    while (! ready()) {
+      if (this->closed)
+        return false;
+
+      waiting = 1;
+      if (ready() || this->closed) {
+        waiting = 0;
+        continue;
+      }
+
+      pollfd pfd = {fd, POLLIN, 0};
+      int ret = poll(&pfd, 1, poll_ms);
+      if (ret > 0) {
+        uint64_t count;
+        if (read(fd, &count, sizeof(count)) < 0)
+          throw std::runtime_error(std::string("eventfd: ") + strerror(errno));
+      } else if (ret == 0 && ! alive()) {
+        return false;
+      }
+      waiting = 0;
+    }
+    return true;
+  }
+
+  static const int spin_iterations = 4096;
+  static const int poll_ms = 100;
+};
+
+// Streambuf that writes straight into one ring and reads straight from another,
+// without intermediate buffers.
+class ShmStreambuf : public std::streambuf {
+public:
+  ShmStreambuf(ShmRing *in_, ShmRing *out_, pid_t peer_)
+    : in(in_), out(out_), peer(peer_) {}
+
+  virtual ~ShmStreambuf() {
+    this->publish();
+    this->release();
+  }
+
+  // Tells the peer that no more data is coming, in both directions.
+  void close() {
+    this->sync();
+    this->in->close();
+    this->out->close();
+  }
+
+protected:
+  virtual int_type underflow() {
+    this->release();
+
+    ShmRing *ring = this->in;
+    bool ok = ring->wait(ring->reader_waiting, ring->data_fd,
+                         [ring] () { return ring->head.load() > ring->tail.load(); },
+                         [this] () { return this->peer_alive(); });
+    if (! ok && ring->head.load() == ring->tail.load())
+      return traits_type::eof();
+
+    uint64_t tail = ring->tail.load();
+    uint64_t pos = tail % ring->capacity;
+    uint64_t n = std::min(ring->head.load() - tail, ring->capacity - pos);
+    char *begin = ring->data() + pos;
+    this->setg(begin, begin, begin + n);
+    return traits_type::to_int_type(*begin);
+  }
+
+  virtual int_type overflow(int_type c) {
+    this->publish();
+
+    ShmRing *ring = this->out;
+    bool ok = ring->wait(ring->writer_waiting, ring->space_fd,
+                         [ring] () { return ring->head.load() - ring->tail.load()
+                                            < ring->capacity; },
+                         [this] () { return this->peer_alive(); });
+    if (! ok)
+      return traits_type::eof();
+
+    uint64_t head = ring->head.load();
+    uint64_t pos = head % ring->capacity;
+    uint64_t n = std::min(ring->capacity - (head - ring->tail.load()),
+                          ring->capacity - pos);
+    char *begin = ring->data() + pos;
+    this->setp(begin, begin + n);
+
+    if (! traits_type::eq_int_type(c, traits_type::eof())) {
+      *this->pptr() = traits_type::to_char_type(c);
+      this->pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+  virtual int sync() {
+    this->publish();
+    return 0;
+  }
+
+private:
+  ShmRing *in, *out;
+  pid_t peer;
+
+  // Make what was written visible to the reader.
+  void publish() {
+    if (this->pptr() == this->pbase())
+      return;
+    this->out->head += this->pptr() - this->pbase();
+    ShmRing::notify(this->out->reader_waiting, this->out->data_fd);
+    this->setp(this->pptr(), this->epptr());
+  }
+
+  // Give back the space we have finished reading.
+  void release() {
+    if (this->gptr() == this->eback())
+      return;
+    this->in->tail += this->gptr() - this->eback();
+    ShmRing::notify(this->in->writer_waiting, this->in->space_fd);
+    this->setg(this->gptr(), this->gptr(), this->gptr());
+  }
+
+  bool peer_alive() {
+    return kill(this->peer, 0) == 0;
+  }
+};
+
+// Stream over a shared-memory pipe, see ShmPipe.
+class ShmStream : public std::iostream {
+public:
+  ShmStream(ShmRing *in_, ShmRing *out_, pid_t peer)
+    : std::iostream(nullptr), buf(in_, out_, peer) {
+    this->rdbuf(&this->buf);
+  }
+
+  void close() {
+    this->buf.close();
+  }
+
+private:
+  ShmStreambuf buf;
+};
+
+// Anonymous shared mapping with one ring per direction. Create it before
+// fork(), then each process picks its end.
+class ShmPipe {
+public:
+  ShmPipe(uint64_t capacity = 1 << 22)
+    : ring_size(ShmRing::size(capacity)) {
+    this->region = mmap(nullptr, 2 * this->ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (this->region == MAP_FAILED)
+      throw std::runtime_error(std::string("mmap: ") + strerror(errno));
+    this->down()->init(capacity);
+    this->up()->init(capacity);
+  }
+
+  virtual ~ShmPipe() {
+    munmap(this->region, 2 * this->ring_size);
+  }
+
+  // End used by the process that forked.
+  std::shared_ptr<ShmStream> parent_end(pid_t child) {
+    return std::make_shared<ShmStream>(this->up(), this->down(), child);
+  }
+
+  // End used by the forked process.
+  std::shared_ptr<ShmStream> child_end() {
+    return std::make_shared<ShmStream>(this->down(), this->up(), getppid());
+  }
+
+private:
+  void *region;
+  size_t ring_size;
+
+  // Parent -> child.
+  ShmRing* down() {
+    return reinterpret_cast<ShmRing*>(this->region);
+  }
+
+  // Child -> parent.
+  ShmRing* up() {
+    return reinterpret_cast<ShmRing*>(static_cast<char*>(this->region)
+                                      + this->ring_size);
+  }
+};
+
+// Local stub for a worker process reached through a ShmPipe, real execution
+// takes place in ShmWorkerRemote.
+template <typename T>
+class ShmWorker : public Worker<T> {
+public:
+  ShmWorker(Scheduler<T> &scheduler, const std::string &name_,
+            std::shared_ptr<ShmPipe> pipe_, std::shared_ptr<ShmStream> stream_,
+            pid_t pid_, const WorkerCaps &caps_ = WorkerCaps())
+    : Worker<T>(scheduler, name_), pipe(pipe_), stream(stream_), pid(pid_) {
+    this->sizer.min_ops = caps_.cores;
+    this->set_caps(caps_);
+  }
+
+  // The thread reads and writes the mapping, so it's joined before the pipe
+  // goes away with the members.
+  virtual ~ShmWorker() {
+    this->stop();
+    this->stream->close();
+    waitpid(this->pid, nullptr, 0);
+  }
+
+private:
+  std::shared_ptr<ShmPipe> pipe;
+  std::shared_ptr<ShmStream> stream;
+  pid_t pid;
+
+  typedef typename Worker<T>::Op Op;
+
+  BatchSizer sizer;
+
+  virtual size_t max_batch() {
+    return this->sizer.size();
+  }
+
+  virtual T do_sum(const T &left, const T &right) {
+    return this->do_batch({{Op::SUM, &left, &right}}).at(0);
+  }
+
+  virtual T do_prod(const T &left, const T &right) {
+    return this->do_batch({{Op::PROD, &left, &right}}).at(0);
+  }
+
+  virtual std::vector<T> do_batch(const std::vector<Op> &ops) {
+    this->log.dbg("Sending " + std::to_string(ops.size()) + " requests");
+    send_batch<T>(ops, this->sizer, *this->stream);
+
+    NetWorkerResults<T> reply;
+    reply.like = ops.at(0).left;
+    this->log.dbg("Waiting for reply");
+    *this->stream >> reply;
+    if (! *this->stream)
+      throw std::runtime_error("Worker process " + std::to_string(this->pid)
+                               + " is gone");
+
+    return reply.results;
+  }
+};
+
+// Counterpart to ShmWorker, serves requests until the pipe is closed.
+template <typename T>
+class ShmWorkerRemote {
+public:
+  typedef typename NetWorkerRemote<T>::SampleFn_t SampleFn_t;
+
+  ShmWorkerRemote(std::shared_ptr<ShmStream> stream_,
+                  SampleFn_t sample = [] () { return T(); })
+    : stream(stream_), log("ShmWorkerRemote"), hello(benchmark_worker<T>(sample)) {
+    *this->stream << this->hello;
+    this->stream->flush();
+    this->loop(sample());
+  }
+
+private:
+  std::shared_ptr<ShmStream> stream;
+  Log log;
+  NetWorkerHello hello;  // What we told the ShmWorker.
+
+  // Requests are read under the key of like, see ElementOps::make().
+  void loop(const T &like) {
+    while (true) {
+      log.dbg("Waiting for request");
+      auto batch = NetWorkerBatch<T>();
+      batch.like = &like;
+      *this->stream >> batch;
+      if (! *this->stream) {
+        log.info("Pipe closed, exiting");
+        return;
+      }
+
+      log.dbg("Got " + std::to_string(batch.msgs.size()) + " requests, processing");
+      *this->stream << apply_batch(batch, batch_threads(this->hello, batch.msgs.size()));
+      this->stream->flush();
+    }
+  }
+};
+
+// Forks a worker process connected through shared memory and registers its
+// ShmWorker with the scheduler. The child never returns from this call.
+template <typename T>
+ShmWorker<T>* fork_shm_worker(
+    Scheduler<T> &scheduler,
+    typename ShmWorkerRemote<T>::SampleFn_t sample = [] () { return T(); }) {
+  auto pipe = std::make_shared<ShmPipe>();
+
+  Log::lock();
+  pid_t pid = fork();
+  Log::unlock();
+  if (pid < 0)
+    throw std::runtime_error(std::string("fork: ") + strerror(errno));
+
+  if (pid == 0) {
+    try {
+      ShmWorkerRemote<T>(pipe->child_end(), sample);
+    } catch (std::exception &e) {
+      Log("ShmWorkerRemote").err(std::string("Terminating on exception: ") + e.what());
+    }
+    // Skip the destructors, they belong to the parent's threads and workers.
+    _exit(0);
+  }
+
+  auto stream = pipe->parent_end(pid);
+  NetWorkerHello hello;
+  *stream >> hello;
+  if (! *stream)
+    throw std::runtime_error("Handshake with worker process "
+                             + std::to_string(pid) + " failed");
+
+  WorkerCaps caps;
+  caps.cores = hello.cores;
+  caps.sum_latency = hello.sum_latency;
+  caps.prod_latency = hello.prod_latency;
+  return new ShmWorker<T>(scheduler, "ShmWorker_" + std::to_string(pid), pipe,
+                          stream, pid, caps);
+}
+
+#endif  // SHMWORKER_H
@@ -0,0 +1,502 @@
+// Simulated ciphertexts, to predict what an HE evaluation of a circuit will
+// cost before running it: a SimValue carries the modeled level, noise budget,
+// size and time of the value it stands for instead of the value itself. The
+// circuit runs through the real Evaluator and Scheduler, with SimWorkers
+// keeping a modeled clock each, so the prediction accounts for the number of
+// workers and the scheduling.
+
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <sstream>
+#include <functional>
+#include <stdexcept>
+#include <algorithm>
+#include <limits>
+#include <iostream>
+
+#include "ArithmeticNode.h"
+#include "ElementOps.h"
+#include "ArithmeticTree.h"
+#include "Evaluator.h"
+#include "Worker.h"
+
+class SimValue;
+
+// Cost model, latencies in seconds for a value at the top level. Lower
+// levels have fewer primes, operations on them cost proportionally less.
+struct SimCosts {
+  double sum = 1e-5;
+  double prod = 5e-3;       // Including relinearization.
+  double relin = 4e-3;
+  double rotate = 5e-3;
+  double total_sum = 5e-2;
+  double scale = 1e-5;
+
+  long top_level = 10;      // Level of fresh values.
+  long prod_levels = 1;     // Levels a product consumes.
+  double fresh_budget = 100;  // Noise budget of fresh values, in bits.
+  double sum_bits = 1;      // Budget a sum consumes.
+  double prod_bits = 10;    // Budget a product consumes.
+  double bytes = 1 << 20;   // Size of a value at the top level.
+  long slots = 1;
+
+  // Cost of an operation taking top level time, at level.
+  double at_level(double seconds, long level) const {
+    return seconds * (std::max(level, 0L) + 1) / (std::max(this->top_level, 0L) + 1);
+  }
+
+  std::string to_string() const {
+    return "sum: " + std::to_string(this->sum) + "s, prod: " + std::to_string(this->prod)
+           + "s, relin: " + std::to_string(this->relin) + "s, rotate: "
+           + std::to_string(this->rotate) + "s, total_sum: "
+           + std::to_string(this->total_sum) + "s, scale: " + std::to_string(this->scale)
+           + "s, top_level: " + std::to_string(this->top_level) + ", fresh_budget: "
+           + std::to_string(this->fresh_budget) + ", prod_bits: "
+           + std::to_string(this->prod_bits) + ", bytes: " + std::to_string(this->bytes);
+  }
+};
+
+// What a simulated run predicts.
+struct SimReport {
+  double makespan = 0;     // Modeled seconds until the last output is ready.
+  double work = 0;         // Modeled seconds of all operations.
+  size_t ops = 0;
+  double peak_bytes = 0;   // Most memory held by values at once.
+  double noise_budget = std::numeric_limits<double>::infinity();  // Lowest output's.
+  long level = std::numeric_limits<long>::max();                  // Lowest output's.
+
+  // Whether the outputs would decrypt.
+  bool decrypts() const {
+    return this->noise_budget > 0 && this->level >= 0;
+  }
+
+  std::string to_string() const {
+    return "makespan: " + std::to_string(this->makespan) + "s, work: "
+           + std::to_string(this->work) + "s, ops: " + std::to_string(this->ops)
+           + ", peak: " + std::to_string(this->peak_bytes / (1 << 20)) + "MiB, budget: "
+           + std::to_string(this->noise_budget) + ", level: " + std::to_string(this->level);
+  }
+};
+
+// Costs and totals shared by the values of a simulation. Memory is counted
+// per live SimValue, so copies the evaluation keeps around count as the
+// ciphertext copies a real run would keep.
+class SimModel {
+public:
+  SimModel(const SimCosts &costs_ = SimCosts()) : costs(costs_) {}
+
+  const SimCosts costs;
+
+  // Totals since creation (or reset()), peak_bytes doesn't go down with
+  // the live bytes. ops counts relinearizations separately.
+  SimReport totals() {
+    std::lock_guard<std::mutex> lck(this->mutex);
+    SimReport ret;
+    ret.work = this->work;
+    ret.ops = this->ops;
+    ret.peak_bytes = this->peak_bytes;
+    return ret;
+  }
+
+  // Starts counting again, peak from the values alive now.
+  void reset() {
+    std::lock_guard<std::mutex> lck(this->mutex);
+    this->work = 0;
+    this->ops = 0;
+    this->peak_bytes = this->live_bytes;
+  }
+
+  // Totals plus the makespan, noise and level of the evaluated outputs.
+  SimReport report(const std::vector<ArithmeticNode<SimValue>*> &outputs);
+
+private:
+  friend class SimValue;
+
+  std::mutex mutex;
+  double work = 0;
+  size_t ops = 0;
+  double live_bytes = 0;
+  double peak_bytes = 0;
+
+  void account(double seconds) {
+    std::lock_guard<std::mutex> lck(this->mutex);
+    this->work += seconds;
+    this->ops++;
+  }
+
+  void allocate(double bytes) {
+    std::lock_guard<std::mutex> lck(this->mutex);
+    this->live_bytes += bytes;
+    this->peak_bytes = std::max(this->peak_bytes, this->live_bytes);
+  }
+};
+
+class SimValue {
+public:
+  // Placeholder, e.g. for read().
+  SimValue() {}
+
+  // Fresh value, e.g. an input, ready at time 0.
+  explicit SimValue(std::shared_ptr<SimModel> model_) : model(model_) {
+    this->cur_level = this->model->costs.top_level;
+    this->budget = this->model->costs.fresh_budget;
+    this->allocate();
+  }
+
+  SimValue(const SimValue &other)
+    : model(other.model), cur_level(other.cur_level), budget(other.budget),
+      lazy(other.lazy), ready_time(other.ready_time), op_time(other.op_time) {
+    this->allocate();
+  }
+
+  SimValue& operator=(const SimValue &other) {
+    if (this != &other) {
+      this->release();
+      this->model = other.model;
+      this->cur_level = other.cur_level;
+      this->budget = other.budget;
+      this->lazy = other.lazy;
+      this->ready_time = other.ready_time;
+      this->op_time = other.op_time;
+      this->allocate();
+    }
+    return *this;
+  }
+
+  ~SimValue() {
+    this->release();
+  }
+
+  long level() const {
+    return this->cur_level;
+  }
+
+  double noise_budget() const {
+    return this->budget;
+  }
+
+  // Modeled time the value is ready at, and time of the operation computing
+  // it. Without SimWorkers ready is the critical path, as with unlimited
+  // workers.
+  double ready() const {
+    return this->ready_time;
+  }
+
+  double work() const {
+    return this->op_time;
+  }
+
+  // Size, a product not relinearized yet has 3 parts instead of 2.
+  double bytes() const {
+    if (! this->model)
+      return 0;
+    return this->model->costs.at_level(this->model->costs.bytes, this->cur_level)
+           * (this->lazy ? 1.5 : 1);
+  }
+
+  SimValue operator+(const SimValue &rhs) const {
+    return this->result(rhs, this->costs().sum, 0, this->costs().sum_bits,
+                        this->lazy || rhs.lazy);
+  }
+
+  SimValue operator*(const SimValue &rhs) const {
+    return this->result(rhs, this->costs().prod, this->costs().prod_levels,
+                        this->costs().prod_bits, false);
+  }
+
+  SimValue prod_lazy(const SimValue &rhs) const {
+    return this->result(rhs, this->costs().prod - this->costs().relin,
+                        this->costs().prod_levels, this->costs().prod_bits, true);
+  }
+
+  void relinearize() {
+    if (! this->lazy)
+      return;
+    this->release();
+    this->lazy = false;
+    this->allocate();
+    this->add_work(this->costs().at_level(this->costs().relin, this->cur_level));
+  }
+
+  void mod_switch_to(long level_) {
+    if (this->cur_level <= level_)
+      return;
+    this->release();
+    this->cur_level = level_;
+    this->allocate();
+  }
+
+  // Key switching operations, rotations of any kind. levels is 1 for
+  // permutations, which multiply by masks.
+  SimValue rotated(double seconds, long levels = 0) const {
+    return this->result(*this, seconds, levels, levels ? this->costs().prod_bits : 0,
+                        false);
+  }
+
+  SimValue scaled() const {
+    return this->result(*this, this->costs().scale, 0, this->costs().sum_bits, this->lazy);
+  }
+
+  void write(std::ostream &os) const {
+    os << this->cur_level << " " << this->budget << " " << this->lazy << " "
+       << this->ready_time << " " << this->op_time << " ";
+  }
+
+  // Keeps this value's model.
+  void read(std::istream &is) {
+    this->release();
+    is >> std::skipws >> this->cur_level >> this->budget >> this->lazy >> this->ready_time
+       >> this->op_time;
+    this->allocate();
+  }
+
+  // Fresh value of the same model.
+  SimValue fresh() const {
+    this->costs();
+    return SimValue(this->model);
+  }
+
+  const SimCosts& costs() const {
+    if (! this->model)
+      throw std::logic_error("SimValue without a SimModel");
+    return this->model->costs;
+  }
+
+private:
+  friend class SimWorker;
+
+  std::shared_ptr<SimModel> model;
+  long cur_level = 0;
+  double budget = std::numeric_limits<double>::infinity();
+  bool lazy = false;
+  double ready_time = 0;
+  double op_time = 0;
+
+  SimValue result(const SimValue &rhs, double seconds, long levels, double bits,
+                  bool lazy_) const {
+    SimValue ret(*this);
+    ret.release();
+    ret.cur_level = std::min(this->cur_level, rhs.cur_level) - levels;
+    ret.budget = std::min(this->budget, rhs.budget) - bits;
+    ret.lazy = lazy_;
+    ret.allocate();
+    ret.ready_time = std::max(this->ready_time, rhs.ready_time);
+    ret.op_time = 0;
+    ret.add_work(this->costs().at_level(seconds, std::min(this->cur_level, rhs.cur_level)));
+    return ret;
+  }
+
+  void add_work(double seconds) {
+    this->op_time += seconds;
+    this->ready_time += seconds;
+    this->model->account(seconds);
+  }
+
+  void allocate() {
+    if (this->model)
+      this->model->allocate(this->bytes());
+  }
+
+  void release() {
+    if (this->model)
+      this->model->allocate(-this->bytes());
+  }
+};
+
+// Everything the Evaluator optimizes for HElib values applies.
+template <>
+struct ElementOps<SimValue> : DefaultElementOps<SimValue> {
+  static constexpr bool deferrable = true;
+
+  static SimValue prod_lazy(const SimValue &left, const SimValue &right) {
+    return left.prod_lazy(right);
+  }
+
+  static void relinearize(SimValue &value) {
+    value.relinearize();
+  }
+
+  static constexpr bool leveled = true;
+
+  static long level(const SimValue &value) {
+    return value.level();
+  }
+
+  static void mod_switch_to(SimValue &value, long level_) {
+    value.mod_switch_to(level_);
+  }
+
+  static double noise_budget(const SimValue &value) {
+    return value.noise_budget();
+  }
+
+  // Encrypted constants, as EncBit's.
+  static SimValue constant(bool bit, const SimValue *like) {
+    if (like == nullptr)
+      throw std::invalid_argument("Constants need a SimValue to take the model from");
+    return like->fresh();
+  }
+
+  static SimValue rotate(const SimValue &value, long k) {
+    return k == 0 ? value : value.rotated(value.costs().rotate);
+  }
+
+  static SimValue shift(const SimValue &value, long k) {
+    return k == 0 ? value : value.rotated(value.costs().rotate);
+  }
+
+  static SimValue total_sum(const SimValue &value) {
+    return value.rotated(value.costs().total_sum);
+  }
+
+  // The masks take a level, see Evaluator::plan_levels().
+  static SimValue permute(const SimValue &value, const SlotMoves_t &moves) {
+    return value.rotated(value.costs().rotate, 1);
+  }
+
+  static SimValue scale(const SimValue &value, long c) {
+    return value.scaled();
+  }
+
+  static long slots(const SimValue &value) {
+    return value.costs().slots;
+  }
+
+  static void write(const SimValue &value, std::ostream &os) {
+    value.write(os);
+  }
+
+  static void read(SimValue &value, std::istream &is) {
+    value.read(is);
+  }
+};
+
+inline SimReport SimModel::report(const std::vector<ArithmeticNode<SimValue>*> &outputs) {
+  auto ret = this->totals();
+  for (auto node : outputs) {
+    auto data = node->get_data();
+    if (! data)
+      throw std::runtime_error("Simulated output not evaluated yet");
+    ret.makespan = std::max(ret.makespan, data->ready());
+    ret.noise_budget = std::min(ret.noise_budget, data->noise_budget());
+    ret.level = std::min(ret.level, data->level());
+  }
+  return ret;
+}
+
+// Worker with a modeled clock: an operation starts once the worker is done
+// with its previous ones and its operands are ready, and takes its modeled
+// time. With time_scale > 0 it also sleeps that time scaled, so the
+// Scheduler's latency measurements and dispatch follow the model instead of
+// the instant simulation.
+class SimWorker : public Worker<SimValue> {
+public:
+  SimWorker(Scheduler<SimValue> &scheduler, double time_scale_ = 0,
+            const std::string &name_ = "Worker")
+    : Worker<SimValue>(scheduler, name_), time_scale(time_scale_) {}
+
+  static std::set<SimWorker*> create_n(Scheduler<SimValue> &scheduler, unsigned int n,
+                                       double time_scale_ = 0) {
+    auto ret = std::set<SimWorker*>();
+    for (unsigned int i = 1; i <= n; i++)
+      ret.insert(new SimWorker(scheduler, time_scale_, "SimWorker_" + std::to_string(i)));
+    return ret;
+  }
+
+protected:
+  virtual std::vector<SimValue> do_batch(const std::vector<Op> &ops) {
+    auto results = Worker<SimValue>::do_batch(ops);
+    double busy = 0;
+    for (size_t i = 0; i < ops.size(); i++) {
+      auto start = std::max(this->clock, std::max(ops[i].left->ready_time,
+                                                  ops[i].right->ready_time));
+      results[i].ready_time = start + results[i].op_time;
+      this->clock = results[i].ready_time;
+      busy += results[i].op_time;
+    }
+    if (this->time_scale > 0)
+      std::this_thread::sleep_for(std::chrono::duration<double>(busy * this->time_scale));
+    return results;
+  }
+
+  virtual SimValue do_sum(const SimValue &left, const SimValue &right) {
+    return left + right;
+  }
+
+  virtual SimValue do_prod(const SimValue &left, const SimValue &right) {
+    return left * right;
+  }
+
+private:
+  double time_scale;
+  double clock = 0;  // Only used from the worker's thread.
+};
+
+// Costs measured on real values, e.g. two fresh EncBits: the average of reps
+// runs of each operation, the levels and noise a product and a sum consume.
+// Types without noise (infinite budget) get a model without noise.
+template <typename T>
+SimCosts calibrate(const T &a, const T &b, unsigned int reps = 10) {
+  SimCosts ret;
+  T sink = a;
+  auto time = [&] (const std::function<T ()> &op) {
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < reps; i++)
+      sink = op();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / std::max(reps, 1u);
+  };
+  ret.sum = time([&] { return a + b; });
+  ret.prod = time([&] { return a * b; });
+  ret.relin = std::max(0.0, ret.prod - time([&] {
+                                         return ElementOps<T>::prod_lazy(a, b); }));
+  ret.rotate = time([&] { return ElementOps<T>::rotate(a, 1); });
+  ret.total_sum = time([&] { return ElementOps<T>::total_sum(a); });
+  ret.scale = time([&] { return ElementOps<T>::scale(a, 3); });
+
+  T prod = a * b, sum = a + b;
+  ret.top_level = ElementOps<T>::level(a);
+  // HElib may only switch down before the next product, the Evaluator plans
+  // one level per product anyway.
+  ret.prod_levels = std::max(1L, ret.top_level - ElementOps<T>::level(prod));
+  ret.fresh_budget = ElementOps<T>::noise_budget(a);
+  if (std::isinf(ret.fresh_budget)) {
+    ret.sum_bits = ret.prod_bits = 0;
+  } else {
+    ret.sum_bits = std::max(0.0, ret.fresh_budget - ElementOps<T>::noise_budget(sum));
+    ret.prod_bits = std::max(0.0, ret.fresh_budget - ElementOps<T>::noise_budget(prod));
+  }
+
+  std::stringstream ss;
+  ElementOps<T>::write(a, ss);
+  ret.bytes = ss.str().size();
+  ret.slots = ElementOps<T>::slots(a);
+  return ret;
+}
+
+// Predicts the evaluation of the outputs build(tree, model) returns on
+// n_workers workers. Inputs are fresh values, SimValue(model).
+template <typename Build>
+SimReport simulate(const SimCosts &costs, unsigned int n_workers, Build build,
+                   double time_scale = 0) {
+  auto model = std::make_shared<SimModel>(costs);
+  std::shared_ptr<Evaluator<SimValue> > ev(new Evaluator<SimValue>());
+  SimWorker::create_n(*ev->get_scheduler(), n_workers, time_scale);
+  ArithmeticTree<SimValue> tree(ev);
+  std::vector<ArithmeticNode<SimValue>*> outputs = build(tree, model);
+  for (auto node : outputs)
+    tree.eval(*node);
+  ev->exec();
+  return model->report(outputs);
+}
+
+#endif  // SIMULATION_H
@@ -0,0 +1,248 @@
+// Tracing of evaluations, exported as Chrome trace JSON (chrome://tracing or
+// ui.perfetto.dev) to see idle workers, coordinator rescans and network waits
+// on a timeline. Off by default, which costs a relaxed atomic load per event
+// site. When on, each thread appends to its own buffer, the buffers are only
+// merged when exporting.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+class Trace {
+public:
+  typedef std::chrono::steady_clock Clock_t;
+
+  static void enable(bool on = true) {
+    epoch();  // Starts the clock.
+    flag().store(on, std::memory_order_relaxed);
+  }
+
+  static bool enabled() {
+    return flag().load(std::memory_order_relaxed);
+  }
+
+  // Name of the calling thread in the trace, e.g. its worker's.
+  static void set_thread_name(const std::string &name) {
+    thread_name() = name;
+    auto &buf = local_buffer();
+    if (buf) {
+      std::lock_guard<std::mutex> lck(buf->mutex);
+      buf->name = name;
+    }
+  }
+
+  // Span of the calling thread from start until now, and a point in time.
+  // name and cat must be literals, detail is shown with the event (e.g. the
+  // task's labels).
+  static void span(const char *name, const char *cat, Clock_t::time_point start,
+                   const std::string &detail = "") {
+    auto now = Clock_t::now();
+    record({name, cat, 'X', micros(start), micros(now) - micros(start), detail});
+  }
+
+  static void instant(const char *name, const char *cat, const std::string &detail = "") {
+    record({name, cat, 'i', micros(Clock_t::now()), 0, detail});
+  }
+
+  // Events recorded so far, of all threads.
+  static size_t size() {
+    size_t ret = 0;
+    for (auto &buf : all_buffers()) {
+      std::lock_guard<std::mutex> lck(buf->mutex);
+      ret += buf->events.size();
+    }
+    return ret;
+  }
+
+  static void clear() {
+    for (auto &buf : all_buffers()) {
+      std::lock_guard<std::mutex> lck(buf->mutex);
+      buf->events.clear();
+    }
+  }
+
+  static void write_chrome(std::ostream &os) {
+    auto pid = getpid();
+    os << "{\"traceEvents\": [";
+    bool first = true;
+    for (auto &buf : all_buffers()) {
+      std::lock_guard<std::mutex> lck(buf->mutex);
+      os << (first ? "\n" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid
+         << ",\"tid\":" << buf->tid << ",\"args\":{\"name\":"
+         << quoted(buf->name.empty() ? "thread " + std::to_string(buf->tid) : buf->name)
+         << "}}";
+      first = false;
+      for (auto &e : buf->events) {
+        os << ",\n{\"name\":" << quoted(e.name) << ",\"cat\":" << quoted(e.cat)
+           << ",\"ph\":\"" << e.phase << "\",\"ts\":" << fixed(e.ts);
+        if (e.phase == 'X')
+          os << ",\"dur\":" << fixed(e.dur);
+        else
+          os << ",\"s\":\"t\"";
+        os << ",\"pid\":" << pid << ",\"tid\":" << buf->tid;
+        if (! e.detail.empty())
+          os << ",\"args\":{\"detail\":" << quoted(e.detail) << "}";
+        os << "}";
+      }
+    }
+    os << "],\n\"displayTimeUnit\": \"ms\"}\n";
+  }
+
+  // Same into a file, false if it can't be written.
+  static bool write_chrome(const std::string &path) {
+    std::ofstream out(path);
+    write_chrome(out);
+    return bool(out);
+  }
+
+private:
+  struct Event {
+    const char *name;
+    const char *cat;
+    char phase;     // X: span, i: instant.
+    double ts;      // Microseconds since the epoch.
+    double dur;
+    std::string detail;
+  };
+
+  // The mutex only meets contention while exporting.
+  struct Buffer {
+    std::mutex mutex;
+    unsigned int tid;
+    std::string name;
+    std::vector<Event> events;
+  };
+
+  // Function-local statics, so that including this header from several
+  // translation units doesn't define them more than once.
+  static std::atomic<bool>& flag() {
+    static std::atomic<bool> f(false);
+    return f;
+  }
+
+  static std::mutex& buffers_mutex() {
+    static std::mutex m;
+    return m;
+  }
+
+  static std::vector<std::shared_ptr<Buffer> >& buffers() {
+    static std::vector<std::shared_ptr<Buffer> > b;
+    return b;
+  }
+
+  static Clock_t::time_point epoch() {
+    static const Clock_t::time_point t = Clock_t::now();
+    return t;
+  }
+
+  static std::string& thread_name() {
+    thread_local std::string name;
+    return name;
+  }
+
+  static std::shared_ptr<Buffer>& local_buffer() {
+    thread_local std::shared_ptr<Buffer> buf;
+    return buf;
+  }
+
+  // Made on the thread's first event, so threads that are never traced don't
+  // leave one behind. Kept past the thread's end, for exporting.
+  static Buffer& local() {
+    auto &buf = local_buffer();
+    if (! buf) {
+      buf = std::make_shared<Buffer>();
+      buf->name = thread_name();
+      std::lock_guard<std::mutex> lck(buffers_mutex());
+      buf->tid = buffers().size() + 1;
+      buffers().push_back(buf);
+    }
+    return *buf;
+  }
+
+  static std::vector<std::shared_ptr<Buffer> > all_buffers() {
+    std::lock_guard<std::mutex> lck(buffers_mutex());
+    return buffers();
+  }
+
+  static void record(Event &&e) {
+    auto &buf = local();
+    std::lock_guard<std::mutex> lck(buf.mutex);
+    buf.events.push_back(std::move(e));
+  }
+
+  static double micros(Clock_t::time_point t) {
+    return std::chrono::duration<double, std::micro>(t - epoch()).count();
+  }
+
+  static std::string fixed(double v) {
+    char s[32];
+    snprintf(s, sizeof(s), "%.3f", v);
+    return s;
+  }
+
+  static std::string quoted(const std::string &s) {
+    std::string ret = "\"";
+    for (auto c : s) {
+      if (c == '"' || c == '\\') {
+        ret += '\\';
+        ret += c;
+      } else if ((unsigned char)(c) < 0x20) {
+        char esc[8];
+        snprintf(esc, sizeof(esc), "\\u%04x", c);
+        ret += esc;
+      } else {
+        ret += c;
+      }
+    }
+    return ret + "\"";
+  }
+};
+
+// Records its lifetime as a span of the calling thread, if tracing was on when
+// it started. Set the detail only when active(), to skip building it otherwise.
+class TraceSpan {
+public:
+  TraceSpan(const char *name_, const char *cat_)
+    : name(name_), cat(cat_), recording(Trace::enabled()) {
+    if (this->recording)
+      this->start = Trace::Clock_t::now();
+  }
+
+  ~TraceSpan() {
+    this->end();
+  }
+
+  // Ends the span before the scope does.
+  void end() {
+    if (this->recording)
+      Trace::span(this->name, this->cat, this->start, this->detail);
+    this->recording = false;
+  }
+
+  bool active() const {
+    return this->recording;
+  }
+
+  void set_detail(const std::string &detail_) {
+    this->detail = detail_;
+  }
+
+private:
+  const char *name;
+  const char *cat;
+  bool recording;
+  Trace::Clock_t::time_point start;
+  std::string detail;
+};
+
+#endif  // TRACE_H
@@ -4,14 +4,29 @@
 #include <cstdint>
 #include <string>
 #include <atomic>
+#include <vector>
+#include <stdexcept>
+#include <memory>
 
 #include "ArithmeticTree.h"
+#include "Circuit.h"
+#include "ElementOps.h"
 
-// Unsiged int arithmetic class.
+// Unsiged int arithmetic class, modulo 2^N.
 // T is a class with GF2-like behavior, N is the bit-width.
+// Operators build circuits of low multiplicative depth, which is what limits
+// HE evaluation (d = ceil(log2 N)):
+//   +, -        parallel prefix (Kogge-Stone) adder, depth 1 + d
+//   <, >, <=, >= borrow of a subtraction, depth 1 + d
+//   ==          product tree of bit equalities, depth d
+//   *           Wallace tree of partial products plus a final adder
+//   <<, >>      by constants, no gates
+// Use stats() to get the actual counts for a given N.
 template <typename T, unsigned int N=8>
 class UInt {
 public:
+  typedef ArithmeticNode<T> Node_t;
+
   UInt(ArithmeticTree<T> &tree_, uint64_t value, const std::string &label_ = "")
    : tree(tree_) {
     if (label_.empty())
@@ -19,17 +34,151 @@ public:
     else
       this->label = label_;
 
-    for (auto i = 0; i < N; i++) {
+    for (unsigned int i = 0; i < N; i++) {
       this->bits[i] = &this->tree.new_node(value % 2, this->label + "b" +
                                           std::to_string(i));
       value /= 2;
     }
   }
 
+  // From existing nodes, least significant bit first. like is passed to
+  // ElementOps<T>::constant(), it defaults to the value of a resolved bit.
+  UInt(ArithmeticTree<T> &tree_, const std::vector<Node_t*> &bits_,
+       std::shared_ptr<const T> like_ = nullptr)
+   : tree(tree_), label("I" + std::to_string(this->n_nodes++)), like(like_) {
+    if (bits_.size() != N)
+      throw std::invalid_argument("UInt<" + std::to_string(N) + "> needs "
+                                  + std::to_string(N) + " bits, got "
+                                  + std::to_string(bits_.size()));
+    for (unsigned int i = 0; i < N; i++) {
+      this->bits[i] = bits_[i];
+      if (! this->like && this->bits[i]->get_data())
+        this->like = std::make_shared<const T>(this->bits[i]->get_data().get());
+    }
+  }
+
   ArithmeticNode<T>** get_bits() {
     return this->bits;
   }
 
+  // Marks all bits to be evaluated.
+  void eval() {
+    for (auto bit : this->bits)
+      this->tree.eval(*bit);
+  }
+
+  // Gates and depth of the circuit computing this value, before exec().
+  CircuitStats stats() const {
+    return CircuitAnalyzer<T>::analyze(std::vector<Node_t*>(this->bits, this->bits + N));
+  }
+
+  UInt operator+(const UInt &rhs) const {
+    std::vector<Node_t*> sum;
+    this->add(rhs, false, sum);
+    return UInt(this->tree, sum, this->like);
+  }
+
+  // a - b = a + ~b + 1.
+  UInt operator-(const UInt &rhs) const {
+    std::vector<Node_t*> sum;
+    this->add(rhs.negated(), true, sum);
+    return UInt(this->tree, sum, this->like);
+  }
+
+  // a < b iff a - b borrows, i.e. a + ~b + 1 doesn't carry out.
+  Node_t& operator<(const UInt &rhs) const {
+    std::vector<Node_t*> sum;
+    return this->lnot(this->add(rhs.negated(), true, sum));
+  }
+
+  Node_t& operator>(const UInt &rhs) const {
+    return rhs < *this;
+  }
+
+  Node_t& operator<=(const UInt &rhs) const {
+    return this->lnot(rhs < *this);
+  }
+
+  Node_t& operator>=(const UInt &rhs) const {
+    return this->lnot(*this < rhs);
+  }
+
+  Node_t& operator==(const UInt &rhs) const {
+    std::vector<Node_t*> equal;
+    for (unsigned int i = 0; i < N; i++)
+      equal.push_back(&this->lnot(*this->bits[i] + *rhs.bits[i]));
+    return this->product(equal);
+  }
+
+  // Wallace tree: the partial products of each column are reduced with full
+  // adders (3 bits -> sum and carry) in parallel layers until every column
+  // has at most 2 bits left, then one final adder.
+  UInt operator*(const UInt &rhs) const {
+    std::vector<std::vector<Node_t*> > columns(N);
+    for (unsigned int i = 0; i < N; i++)
+      for (unsigned int j = 0; i + j < N; j++)
+        columns[i + j].push_back(&(*this->bits[j] * *rhs.bits[i]));
+
+    auto needs_reduction = [&columns] () {
+      for (auto &col : columns)
+        if (col.size() > 2)
+          return true;
+      return false;
+    };
+    while (needs_reduction()) {
+      std::vector<std::vector<Node_t*> > next(N);
+      for (unsigned int i = 0; i < N; i++) {
+        auto &col = columns[i];
+        size_t k = 0;
+        for (; k + 3 <= col.size(); k += 3) {
+          auto &x = *col[k], &y = *col[k + 1], &z = *col[k + 2];
+          auto &xy = x + y;
+          next[i].push_back(&(xy + z));
+          // maj(x, y, z) = x ^ (x ^ y)(x ^ z), a single product.
+          if (i + 1 < N)
+            next[i + 1].push_back(&(x + xy * (x + z)));
+        }
+        // A leftover pair goes through a half adder if carries already
+        // arrived in this column, a pair on its own is fine as is.
+        if (col.size() - k == 2 && ! next[i].empty() && i + 1 < N) {
+          auto &x = *col[k], &y = *col[k + 1];
+          next[i].push_back(&(x + y));
+          next[i + 1].push_back(&(x * y));
+          k += 2;
+        }
+        for (; k < col.size(); k++)
+          next[i].push_back(col[k]);
+      }
+      columns = next;
+    }
+
+    std::vector<Node_t*> first, second;
+    for (auto &col : columns) {
+      first.push_back(col.size() > 0 ? col[0] : &this->zero());
+      second.push_back(col.size() > 1 ? col[1] : &this->zero());
+    }
+    return UInt(this->tree, first, this->like) + UInt(this->tree, second, this->like);
+  }
+
+  UInt operator<<(unsigned int shift) const {
+    std::vector<Node_t*> ret;
+    for (unsigned int i = 0; i < N; i++)
+      ret.push_back(i >= shift ? this->bits[i - shift] : &this->zero());
+    return UInt(this->tree, ret, this->like);
+  }
+
+  UInt operator>>(unsigned int shift) const {
+    std::vector<Node_t*> ret;
+    for (unsigned int i = 0; i < N; i++)
+      ret.push_back(i + shift < N ? this->bits[i + shift] : &this->zero());
+    return UInt(this->tree, ret, this->like);
+  }
+
+  // Bitwise not.
+  UInt operator~() const {
+    return this->negated();
+  }
+
 private:
   ArithmeticTree<T> &tree;
 
@@ -38,6 +187,83 @@ private:
   static std::atomic<unsigned int> n_nodes;
 
   ArithmeticNode<T>* bits[N];
+
+  // A value of the circuit for making constants, see ElementOps<T>::constant().
+  std::shared_ptr<const T> like;
+  mutable Node_t *zero_node = nullptr, *one_node = nullptr;
+
+  Node_t& zero() const {
+    if (! this->zero_node)
+      this->zero_node = &this->tree.new_node(ElementOps<T>::constant(false, this->like.get()));
+    return *this->zero_node;
+  }
+
+  Node_t& one() const {
+    if (! this->one_node)
+      this->one_node = &this->tree.new_node(ElementOps<T>::constant(true, this->like.get()));
+    return *this->one_node;
+  }
+
+  Node_t& lnot(Node_t &bit) const {
+    return bit + this->one();
+  }
+
+  UInt negated() const {
+    std::vector<Node_t*> ret;
+    for (auto bit : this->bits)
+      ret.push_back(&this->lnot(*bit));
+    return UInt(this->tree, ret, this->like);
+  }
+
+  // Balanced product of all the nodes, depth ceil(log2 n).
+  Node_t& product(std::vector<Node_t*> nodes) const {
+    while (nodes.size() > 1) {
+      std::vector<Node_t*> next;
+      for (size_t i = 0; i + 1 < nodes.size(); i += 2)
+        next.push_back(&(*nodes[i] * *nodes[i + 1]));
+      if (nodes.size() % 2)
+        next.push_back(nodes.back());
+      nodes = next;
+    }
+    return *nodes[0];
+  }
+
+  // Kogge-Stone addition of this and rhs plus a carry in of 0 or 1, sets the
+  // sum bits and returns the carry out.
+  //   g_i = a_i b_i, p_i = a_i ^ b_i
+  //   (G, P)_i = (G_i ^ P_i G_{i-d}, P_i P_{i-d}) for d = 1, 2, 4...
+  // The xor works as an or because G_i and P_i can't both be set. Unused
+  // nodes (e.g. the carry out) are never evaluated, so they cost nothing.
+  Node_t& add(const UInt &rhs, bool carry_in, std::vector<Node_t*> &sum) const {
+    std::vector<Node_t*> g(N), p(N);
+    for (unsigned int i = 0; i < N; i++) {
+      p[i] = &(*this->bits[i] + *rhs.bits[i]);
+      g[i] = &(*this->bits[i] * *rhs.bits[i]);
+    }
+    // The carry in merges into position 0: G_0 = g_0 | p_0 = g_0 ^ p_0.
+    auto generate = g;
+    if (carry_in)
+      generate[0] = &(*g[0] + *p[0]);
+
+    auto propagate = p;
+    for (unsigned int d = 1; d < N; d *= 2) {
+      auto next_g = generate, next_p = propagate;
+      for (unsigned int i = d; i < N; i++) {
+        next_g[i] = &(*generate[i] + *propagate[i] * *generate[i - d]);
+        // Only needed while there are further levels reaching back past 0.
+        if (i >= 2 * d)
+          next_p[i] = &(*propagate[i] * *propagate[i - d]);
+      }
+      generate = next_g;
+      propagate = next_p;
+    }
+
+    sum.clear();
+    sum.push_back(carry_in ? &this->lnot(*p[0]) : p[0]);
+    for (unsigned int i = 1; i < N; i++)
+      sum.push_back(&(*p[i] + *generate[i - 1]));
+    return *generate[N - 1];
+  }
 };
 
 template <typename T, unsigned int N>
@@ -0,0 +1,267 @@
+// Small helpers shared across the library: hashing, the on-disk cache, memory
+// mapped files and a parallel loop.
+
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <streambuf>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <exception>
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// SHA-256 of size bytes at data as a lowercase hex string. Used to name and
+// check content in the cache, not meant to be fast.
+inline std::string sha256(const char *data, size_t size) {
+  static const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+  uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  auto rotr = [] (uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+
+  auto compress = [&] (const unsigned char *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+      w[i] = (uint32_t(p[4 * i]) << 24) | (uint32_t(p[4 * i + 1]) << 16) |
+             (uint32_t(p[4 * i + 2]) << 8) | uint32_t(p[4 * i + 3]);
+    for (int i = 16; i < 64; i++) {
+      uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+    uint32_t e = h[4], f = h[5], g = h[6], hh = h[7];
+    for (int i = 0; i < 64; i++) {
+      uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+      uint32_t ch = (e & f) ^ (~e & g);
+      uint32_t t1 = hh + s1 + ch + k[i] + w[i];
+      uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+      uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+      uint32_t t2 = s0 + maj;
+      hh = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+  };
+
+  // Whole chunks straight from data, then the padded tail: 0x80, zeros, and
+  // the length in bits as a big endian uint64.
+  size_t whole = size - size % 64;
+  for (size_t chunk = 0; chunk < whole; chunk += 64)
+    compress(reinterpret_cast<const unsigned char*>(data + chunk));
+
+  std::string tail(data + whole, size - whole);
+  uint64_t bits = static_cast<uint64_t>(size) * 8;
+  tail += static_cast<char>(0x80);
+  while (tail.size() % 64 != 56)
+    tail += static_cast<char>(0);
+  for (int i = 7; i >= 0; i--)
+    tail += static_cast<char>((bits >> (8 * i)) & 0xff);
+  for (size_t chunk = 0; chunk < tail.size(); chunk += 64)
+    compress(reinterpret_cast<const unsigned char*>(&tail[chunk]));
+
+  static const char *hex = "0123456789abcdef";
+  std::string ret;
+  for (auto word : h)
+    for (int i = 28; i >= 0; i -= 4)
+      ret += hex[(word >> i) & 0xf];
+  return ret;
+}
+
+inline std::string sha256(const std::string &data) {
+  return sha256(data.data(), data.size());
+}
+
+// Directory for cached contexts and keys: $HEHELP_CACHE, or ~/.cache/hehelp.
+inline std::string default_cache_dir() {
+  if (const char *dir = getenv("HEHELP_CACHE"))
+    return dir;
+  if (const char *home = getenv("HOME"))
+    return std::string(home) + "/.cache/hehelp";
+  return "/tmp/hehelp";
+}
+
+// Creates dir and its parents, returns false if it can't.
+inline bool make_dirs(const std::string &dir) {
+  struct stat st;
+  if (dir.empty() || stat(dir.c_str(), &st) == 0)
+    return true;
+  auto pos = dir.find_last_of('/');
+  if (pos != std::string::npos && pos > 0 && ! make_dirs(dir.substr(0, pos)))
+    return false;
+  return mkdir(dir.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+// Whole file into data, returns false if it can't be read.
+inline bool read_file(const std::string &path, std::string &data) {
+  std::ifstream in(path, std::ios::binary);
+  if (! in)
+    return false;
+  std::stringstream ss;
+  ss << in.rdbuf();
+  data = ss.str();
+  return ! in.bad();
+}
+
+// Writes to a temporary file then renames it, so concurrent readers (other
+// processes sharing the cache) never see a partial file.
+inline bool write_file_atomic(const std::string &path, const std::string &data) {
+  auto pos = path.find_last_of('/');
+  if (pos != std::string::npos && ! make_dirs(path.substr(0, pos)))
+    return false;
+
+  auto tmp = path + ".tmp" + std::to_string(getpid());
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    out.write(data.data(), data.size());
+    if (! out.flush()) {
+      std::remove(tmp.c_str());
+      return false;
+    }
+  }
+  return std::rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+// Removes dir and the files in it (a cache has no subdirectories), returns
+// false if it can't.
+inline bool remove_dir(const std::string &dir) {
+  DIR *d = opendir(dir.c_str());
+  if (d == nullptr)
+    return errno == ENOENT;
+  while (dirent *entry = readdir(d)) {
+    std::string name = entry->d_name;
+    if (name != "." && name != "..")
+      std::remove((dir + "/" + name).c_str());
+  }
+  closedir(d);
+  return rmdir(dir.c_str()) == 0;
+}
+
+// Runs fn(begin, end) over contiguous chunks of [0, n) on up to n_threads
+// threads (0 for one per core), the caller's thread takes the first chunk.
+// Rethrows the first exception once all chunks are done.
+inline void parallel_for(size_t n, std::function<void (size_t, size_t)> fn,
+                         unsigned int n_threads = 0) {
+  if (n_threads == 0)
+    n_threads = std::max(1u, std::thread::hardware_concurrency());
+  size_t chunks = std::min<size_t>(n_threads, n);
+  if (chunks <= 1) {
+    if (n > 0)
+      fn(0, n);
+    return;
+  }
+
+  std::vector<std::exception_ptr> errors(chunks);
+  auto run = [&] (size_t chunk) {
+    try {
+      fn(n * chunk / chunks, n * (chunk + 1) / chunks);
+    } catch (...) {
+      errors[chunk] = std::current_exception();
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t chunk = 1; chunk < chunks; chunk++)
+    threads.emplace_back(run, chunk);
+  run(0);
+  for (auto &thrd : threads)
+    thrd.join();
+  for (auto &error : errors)
+    if (error)
+      std::rethrow_exception(error);
+}
+
+// Streambuf reading from memory that it doesn't own, without copying it.
+class MemoryStreambuf : public std::streambuf {
+public:
+  MemoryStreambuf(const char *data, size_t size) {
+    char *begin = const_cast<char*>(data);
+    this->setg(begin, begin, begin + size);
+  }
+
+protected:
+  virtual pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                           std::ios_base::openmode which = std::ios_base::in) {
+    char *base = dir == std::ios_base::beg ? this->eback()
+                 : dir == std::ios_base::cur ? this->gptr() : this->egptr();
+    return this->seekpos(base + off - this->eback(), which);
+  }
+
+  virtual pos_type seekpos(pos_type pos,
+                           std::ios_base::openmode which = std::ios_base::in) {
+    if (! (which & std::ios_base::in) || pos < 0 || pos > this->egptr() - this->eback())
+      return pos_type(off_type(-1));
+    this->setg(this->eback(), this->eback() + pos, this->egptr());
+    return pos;
+  }
+};
+
+// Read-only mapping of a whole file, parsing from it skips reading the file
+// into a buffer first. ok() is false if the file couldn't be mapped.
+class MappedFile {
+public:
+  MappedFile(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapping != MAP_FAILED) {
+        this->addr = static_cast<const char*>(mapping);
+        this->length = st.st_size;
+      }
+    }
+    close(fd);
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  virtual ~MappedFile() {
+    if (this->addr != nullptr)
+      munmap(const_cast<char*>(this->addr), this->length);
+  }
+
+  bool ok() const {
+    return this->addr != nullptr;
+  }
+
+  const char* data() const {
+    return this->addr;
+  }
+
+  size_t size() const {
+    return this->length;
+  }
+
+private:
+  const char *addr = nullptr;
+  size_t length = 0;
+};
+
+#endif  // UTIL_H
@@ -0,0 +1,265 @@
+// Evaluator that packs isomorphic independent operations into the slots of
+// shared values, so circuits written with one value per node (e.g. UInt over
+// EncBitVector with the bits in slot 0) run one operation per layer and kind
+// instead of one per node.
+
+#ifndef VECTORIZINGEVALUATOR_H
+#define VECTORIZINGEVALUATOR_H
+
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <utility>
+#include <string>
+#include <functional>
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+
+#include "ArithmeticNode.h"
+#include "Evaluator.h"
+#include "ElementOps.h"
+
+// Before the usual scheduling, nodes with the same operation and depth (so
+// independent of each other) are grouped, and groups of at least min_group
+// nodes become packed operations, one slot per node. Operands are gathered
+// into their slots with rotations when they all come from the same value at
+// the same offset, and with permutations otherwise. Each grouped node is then
+// rewritten into a permutation extracting its slot into slot 0, so it keeps
+// its value for any consumer.
+//
+// Only slot 0 of the values is meaningful: inputs are assumed to hold their
+// value there, the other slots of the results are unspecified. The number of
+// slots is taken from the inputs with ElementOps<T>::slots(), or set_slots().
+//
+// The rotations and permutations only exist once the circuit is packed, so
+// for HE the key needs matrices that an analysis of the circuit as written
+// doesn't see. plan() packs it ahead of exec(): plan a plain copy of the
+// circuit with set_slots(), size the context on it (choose_params()), and run
+// the real one with the same set_slots(), which packs it the same way. The
+// plain copy is only for planning, exec() refuses a circuit packed into more
+// slots than its inputs have.
+template <typename T>
+class VectorizingEvaluator : public Evaluator<T> {
+public:
+  typedef ArithmeticNode<T> Node_t;
+  typedef typename Evaluator<T>::SchedPtr_t SchedPtr_t;
+
+  VectorizingEvaluator(SchedPtr_t sched_ = SchedPtr_t(new Scheduler<T>()),
+                       size_t min_group_ = 4)
+    : Evaluator<T>(sched_), min_group(min_group_) {}
+
+  // Nodes moved into slots and packed operations replacing them, by the last
+  // exec().
+  size_t get_vectorized() const {
+    return this->vectorized;
+  }
+
+  size_t get_packed() const {
+    return this->packed;
+  }
+
+  // Slots to pack into, instead of the inputs' (a plain copy has one). More
+  // than the inputs have can only be plan()ned. 0 goes back to the inputs'.
+  void set_slots(long slots_) {
+    this->slots = slots_;
+  }
+
+  // Packs the requested nodes now instead of at the next exec(), so analyzing
+  // requested() sees the circuit that will run: its rotations, permutations
+  // and the product levels of their masks. Nodes requested afterwards are left
+  // as written. Returns get_vectorized().
+  size_t plan() {
+    this->vectorize();
+    this->planned = true;
+    return this->vectorized;
+  }
+
+protected:
+  virtual void prepare() {
+    if (! this->planned)
+      this->vectorize();
+    this->planned = false;
+    // Single slot types would rotate and gather into wrong results.
+    if (this->vectorized > 0 && this->slots > this->input_slots)
+      throw std::invalid_argument(
+          "Circuit packed into " + std::to_string(this->slots) + " slots, its inputs have "
+          + std::to_string(this->input_slots) + ": it can only be planned");
+    Evaluator<T>::prepare();
+  }
+
+private:
+  size_t min_group;
+  size_t vectorized = 0;
+  size_t packed = 0;
+  long slots = 0;
+  long input_slots = 0;  // Seen by the last vectorize().
+  bool planned = false;  // By plan(), for the next exec().
+
+  // Slot of a grouped node in its packed operation.
+  struct Place {
+    Node_t *node;
+    size_t chunk;
+    long slot;
+  };
+  std::unordered_map<Node_t *, Place> places;
+
+  void vectorize() {
+    this->vectorized = 0;
+    this->packed = 0;
+    this->places.clear();
+
+    // Pending nodes in post order, so operands come before their consumers.
+    std::vector<Node_t *> order;
+    std::unordered_map<Node_t *, unsigned int> depths;
+    long n_slots = 0;
+    std::function<unsigned int (Node_t *)> visit = [&] (Node_t *node) {
+      if (node->state == Node_t::RESOLVED) {
+        if (n_slots == 0 && *node->data)
+          n_slots = ElementOps<T>::slots(node->data->get());
+        return 0u;
+      }
+      auto it = depths.find(node);
+      if (it != depths.end())
+        return it->second;
+      auto depth = std::max(visit(&*node->left), visit(&*node->right)) + 1;
+      depths[node] = depth;
+      order.push_back(node);
+      return depth;
+    };
+    for (auto node : this->outputs)
+      visit(node);
+    this->input_slots = n_slots;
+    if (this->slots > 0)
+      n_slots = this->slots;
+    if (n_slots <= 1)
+      return;
+
+    std::map<std::pair<unsigned int, int>, std::vector<Node_t *> > groups;
+    for (auto node : order)
+      if (node->state == Node_t::SUM || node->state == Node_t::PROD)
+        groups[{depths[node], node->state}].push_back(node);
+
+    std::vector<Node_t *> grouped;
+    for (auto &group : groups) {
+      if (group.second.size() < this->min_group)
+        continue;
+      auto chunks = this->assign_slots(group.second, n_slots);
+      for (size_t c = 0; c < chunks.size(); c++)
+        this->pack(chunks[c], c, group.first.second == Node_t::PROD);
+      grouped.insert(grouped.end(), group.second.begin(), group.second.end());
+    }
+
+    // Only now, the gathers above read the operands' places, not their nodes.
+    for (auto node : grouped) {
+      auto &place = this->places.at(node);
+      node->state = Node_t::PERMUTE;
+      node->left = *place.node;
+      node->right = *place.node;
+      node->moves = std::make_shared<const SlotMoves_t>(
+          SlotMoves_t{{place.slot, 0}});
+    }
+    this->vectorized = grouped.size();
+  }
+
+  // Splits a group into chunks of n_slots, a node preferring the slot (and
+  // chunk) its operands are in, so the gathers become plain rotations or
+  // nothing at all.
+  std::vector<std::vector<Node_t *> > assign_slots(const std::vector<Node_t *> &group,
+                                                   long n_slots) {
+    std::vector<std::vector<Node_t *> > chunks;
+    for (auto node : group) {
+      long slot = -1;
+      size_t chunk = 0;
+      for (auto operand : {&*node->left, &*node->right}) {
+        auto it = this->places.find(operand);
+        if (it != this->places.end()) {
+          slot = it->second.slot;
+          chunk = it->second.chunk;
+          break;
+        }
+      }
+      auto where = free_slot(chunks, chunk, slot, n_slots);
+      chunks[where.first][where.second] = node;
+    }
+    return chunks;
+  }
+
+  // The preferred slot if free (any chunk), else the first free one, adding
+  // a chunk when they are full.
+  static std::pair<size_t, long> free_slot(std::vector<std::vector<Node_t *> > &chunks,
+                                           size_t chunk, long slot, long n_slots) {
+    auto is_free = [&chunks] (size_t c, long s) {
+      return c < chunks.size() && chunks[c][s] == nullptr;
+    };
+    if (slot >= 0) {
+      if (is_free(chunk, slot))
+        return {chunk, slot};
+      for (size_t c = 0; c < chunks.size(); c++)
+        if (is_free(c, slot))
+          return {c, slot};
+    }
+    for (size_t c = 0; c < chunks.size(); c++)
+      for (long s = 0; s < n_slots; s++)
+        if (is_free(c, s))
+          return {c, s};
+    chunks.push_back(std::vector<Node_t *>(n_slots, nullptr));
+    return {chunks.size() - 1, slot >= 0 ? slot : 0};
+  }
+
+  // Packed operation of the nodes of a chunk, each in its slot.
+  void pack(const std::vector<Node_t *> &chunk, size_t index, bool prod) {
+    std::vector<std::pair<Node_t *, long> > lefts, rights;
+    for (long slot = 0; slot < long(chunk.size()); slot++)
+      if (chunk[slot]) {
+        lefts.push_back({&*chunk[slot]->left, slot});
+        rights.push_back({&*chunk[slot]->right, slot});
+      }
+
+    auto &left = this->gather(lefts);
+    auto &right = this->gather(rights);
+    auto &node = prod ? left * right : left + right;
+    node.label = "V" + std::to_string(this->packed++);
+    for (long slot = 0; slot < long(chunk.size()); slot++)
+      if (chunk[slot])
+        this->places[chunk[slot]] = {&node, index, slot};
+  }
+
+  // Value with each operand in its slot: the operand's packed value moved to
+  // it, inputs and nodes that weren't grouped come from slot 0.
+  Node_t& gather(const std::vector<std::pair<Node_t *, long> > &wanted) {
+    std::vector<Node_t *> sources;
+    std::map<Node_t *, SlotMoves_t> moves;
+    for (auto &want : wanted) {
+      Node_t *source = want.first;
+      long from = 0;
+      auto it = this->places.find(source);
+      if (it != this->places.end()) {
+        source = it->second.node;
+        from = it->second.slot;
+      }
+      if (moves.find(source) == moves.end())
+        sources.push_back(source);
+      moves[source].push_back({from, want.second});
+    }
+
+    if (sources.size() == 1) {
+      auto &source_moves = moves[sources[0]];
+      long offset = source_moves[0].second - source_moves[0].first;
+      bool uniform = true;
+      for (auto &move : source_moves)
+        uniform = uniform && move.second - move.first == offset;
+      if (uniform)
+        return offset == 0 ? *sources[0] : sources[0]->rotate(offset);
+    }
+
+    Node_t *ret = nullptr;
+    for (auto source : sources) {
+      auto &part = source->permute(moves[source]);
+      ret = ret ? &(*ret + part) : &part;
+    }
+    return *ret;
+  }
+};
+
+#endif  // VECTORIZINGEVALUATOR_H
@@ -6,6 +6,7 @@
 #ifndef WORKER_H
 #define WORKER_H
 
+#include <algorithm>
 #include <functional>
 #include <thread>
 #include <mutex>
@@ -14,17 +15,95 @@
 #include <string>
 #include <set>
 #include <memory>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <stdexcept>
 
 #include "ArithmeticNode.h"
 #include "Scheduler.h"
+#include "ElementOps.h"
 #include "Log.h"
+#include "Trace.h"
 
 // Forward declarations.
 template <typename T>
 class Scheduler;
 template <typename T>
 class ArithmeticNode;
+template <typename T>
+struct Task;
+
+
+// What the Scheduler knows about a worker's performance. Latencies are in
+// seconds, 0 meaning not measured yet.
+struct WorkerCaps {
+  unsigned int cores = 1;  // Operations of a batch it runs at once.
+  double sum_latency = 0;
+  double prod_latency = 0;
+  double rotate_latency = 0;     // Rotations and shifts, key switching bound.
+  double total_sum_latency = 0;  // log2(slots) rotations and sums.
+
+  // Operations with different costs.
+  enum OpClass {SUM, PROD, ROTATE, TOTAL_SUM};
+
+  // Weight of a new observation in the moving averages.
+  static constexpr double alpha = 0.2;
+
+  // Until measured, a rotation is estimated as a product (both are dominated
+  // by key switching) and a total sum as a rotation.
+  double latency(OpClass op) const {
+    switch (op) {
+      case SUM: return this->sum_latency;
+      case PROD: return this->prod_latency;
+      case ROTATE:
+        return this->rotate_latency != 0 ? this->rotate_latency : this->prod_latency;
+      case TOTAL_SUM:
+        return this->total_sum_latency != 0 ? this->total_sum_latency
+                                             : this->latency(ROTATE);
+    }
+    return 0;
+  }
+
+  // Fold an observed latency into the estimate.
+  void observe(OpClass op, double seconds) {
+    double *lats[] = {&this->sum_latency, &this->prod_latency,
+                      &this->rotate_latency, &this->total_sum_latency};
+    double &lat = *lats[op];
+    lat = lat == 0 ? seconds : (1 - alpha) * lat + alpha * seconds;
+  }
 
+  // Fold the time of a batch of counts[c] operations of each class, run cores
+  // at a time. A mixed batch doesn't tell its classes apart, so its time is
+  // split in proportion to their estimates (evenly while there are none):
+  // mixed batches follow the worker's speed, single class ones also correct
+  // the classes' relative costs. Classes not measured yet are only learned
+  // from single class batches then.
+  void observe_batch(const size_t (&counts)[4], double seconds) {
+    const double lats[] = {this->sum_latency, this->prod_latency,
+                           this->rotate_latency, this->total_sum_latency};
+    size_t n = 0;
+    double estimate = 0;
+    for (int c = 0; c < 4; c++) {
+      n += counts[c];
+      estimate += counts[c] * lats[c];
+    }
+    if (n == 0)
+      return;
+    size_t n_cores = std::max(1u, this->cores);
+    size_t rounds = (n + n_cores - 1) / n_cores;
+    // Its operations ran n / rounds at a time.
+    double core_seconds = seconds * n / rounds;
+    for (int c = 0; c < 4; c++) {
+      if (counts[c] == 0)
+        continue;
+      if (estimate == 0)
+        this->observe(OpClass(c), core_seconds / n);
+      else if (lats[c] != 0)
+        this->observe(OpClass(c), lats[c] * core_seconds / estimate);
+    }
+  }
+};
 
 template <typename T>
 class Worker {
@@ -39,26 +118,63 @@ public:
     this->thrd = std::thread([&] (Worker *exec) {exec->run(); }, this);
   }
 
+  const std::string& get_name() const {
+    return this->name;
+  }
+
+  WorkerCaps get_caps() {
+    std::lock_guard<std::mutex> lck(this->sched.mutex);
+    return this->caps;
+  }
+
   virtual ~Worker() {
     log.dbg("Terminating...");
+    this->stop();
+    log.dbg("Terminated");
+  }
+
+  // Lets the current batch finish, then stops taking tasks and joins the
+  // thread. Subclasses' destructors should not tear down anything the thread
+  // uses before this, so the owner calls it ahead of deleting the worker.
+  void stop() {
     {
         std::lock_guard<std::mutex> lck(this->sched.mutex);
         this->end = true;
         this->notify_work.notify_one();
     }
-    this->thrd.join();
-    log.dbg("Terminated");
+    if (this->thrd.joinable())
+      this->thrd.join();
+  }
+
+  // Seconds since the worker ran out of work, 0 if it's busy.
+  double idle_seconds() {
+    std::lock_guard<std::mutex> lck(this->sched.mutex);
+    if (! this->idle)
+      return 0;
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now()
+                                            - this->idle_since;
+    return elapsed.count();
   }
 
 protected:
   Scheduler<T> &sched;  // Scheduler responsible for this Worker.
   Log log;
 
+  // Used by subclasses that learn their capabilities up front (e.g. from a
+  // handshake), later observations keep refining them.
+  void set_caps(const WorkerCaps &caps_) {
+    std::lock_guard<std::mutex> lck(this->sched.mutex);
+    this->caps = caps_;
+  }
+
 private:
   std::thread thrd;  // Thread this->loop runs on.
   // CV used to wake up this Worker when work is available.
   std::condition_variable notify_work;
   bool end = false;  // End looping so thread can be joined.
+  bool idle = true;  // Waiting for work, protected by the scheduler's mutex.
+  std::chrono::steady_clock::time_point idle_since = std::chrono::steady_clock::now();
+  WorkerCaps caps;   // Protected by the scheduler's mutex.
 
   std::string name;
 
@@ -67,42 +183,79 @@ private:
   }
 
   void loop() {
+    Trace::set_thread_name(this->name);
     while (true) {
       std::unique_lock<std::mutex> lck(this->sched.mutex);
 
-      if (this->sched.tasks.empty()) {
+      auto ready = [this] () { return (! this->sched.tasks.empty()
+                                        && this->sched.should_take(this))
+                                      || this->end; };
+      if (! ready()) {
         log.dbg("Waiting for work");
-        this->notify_work.wait(lck,
-                               [this] () { return ! this->sched.tasks.empty()
-                                           || this->end; });
+        if (! this->idle)
+          this->idle_since = std::chrono::steady_clock::now();
+        this->idle = true;
+        this->notify_work.wait(lck, ready);
       }
       if (this->end)
         break;
 
-      auto tsk = this->sched.tasks.front();
-      this->sched.tasks.pop();
+      auto n = this->sched.batch_size(this);
+      std::vector<Task<T> > batch;
+      auto now = std::chrono::steady_clock::now();
+      while (batch.size() < n && ! this->sched.tasks.empty()) {
+        batch.push_back(this->sched.tasks.front());
+        this->sched.tasks.pop();
+        this->sched.observe_wait(now - batch.back().enqueued);
+      }
+      this->idle = false;
+      // Slower workers may have deferred to us, let them reconsider.
+      if (! this->sched.tasks.empty())
+        this->sched.notify_idle();
 
       lck.unlock();
 
+      // The nodes may be freed as soon as post_exec() runs, don't touch them after.
+      std::vector<ArithmeticNode<T>*> nodes;
+      std::string label;
+      size_t counts[4] = {0, 0, 0, 0};  // By WorkerCaps::OpClass.
+      for (auto &tsk : batch) {
+        nodes.push_back(&tsk.node);
+        label += (label.empty() ? "" : ", ") + tsk.node.get_label();
+        counts[Scheduler<T>::op_class(tsk.node)]++;
+      }
       try {
-        log.dbg("Starting task " + tsk.node.get_label());
-        tsk.pre_exec();
-        this->solve_node(tsk.node);
-        tsk.post_exec();
-        log.dbg("Finished task " + tsk.node.get_label());
+        log.dbg("Starting task " + label);
+        for (auto &tsk : batch)
+          tsk.pre_exec();
+        auto start = std::chrono::steady_clock::now();
+        {
+          TraceSpan span("task", "worker");
+          if (span.active())
+            span.set_detail(label);
+          this->solve_nodes(nodes);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        {
+          std::lock_guard<std::mutex> l(this->sched.mutex);
+          this->caps.observe_batch(counts, elapsed.count());
+        }
+        for (auto &tsk : batch)
+          tsk.post_exec();
+        log.dbg("Finished task " + label);
 
       } catch (std::exception &e) {
-        log.err("Failure on task " + tsk.node.get_label() + ": " + e.what());
-        tsk.on_fail();
-        this->sched.unregister_worker(this);
-        delete this;
+        log.err("Failure on task " + label + ": " + e.what());
+        for (auto &tsk : batch)
+          tsk.on_fail();
+        this->sched.discard_worker(this);
         break;
 
       } catch(...) {
-        log.err("Unrecognized exception on task " + tsk.node.get_label());
-        tsk.on_fail();
-        this->sched.unregister_worker(this);
-        delete this;
+        log.err("Unrecognized exception on task " + label);
+        for (auto &tsk : batch)
+          tsk.on_fail();
+        this->sched.discard_worker(this);
         break;
       }
     }
@@ -123,29 +276,139 @@ private:
   //   return tsk;
   // }
 
-  // Actually calculates the value of the node.
-  void solve_node(ArithmeticNode<T> &node) {
-    T result;
-    switch(node.state) {
-      case ArithmeticNode<T>::RESOLVED: break;
-      case ArithmeticNode<T>::SUM:
-        result = do_sum(node.left->data->get(), node.right->data->get());
-        break;
-      case ArithmeticNode<T>::PROD:
-        result = do_prod(node.left->data->get(), node.right->data->get());
-        break;
+  // Actually calculates the value of the nodes, which must be independent.
+  void solve_nodes(const std::vector<ArithmeticNode<T>*> &nodes) {
+    typedef ArithmeticNode<T> Node_t;
+    std::vector<Op> ops;
+    std::deque<T> relinearized;  // Canonical copies of lazy operands of products.
+    for (auto node : nodes) {
+      Op op;
+      bool lazy_operand = node->left->lazy || node->right->lazy;
+      switch (node->state) {
+        case Node_t::PROD: op.kind = node->lazy ? Op::PROD_LAZY : Op::PROD; break;
+        case Node_t::ROTATE: op.kind = Op::ROTATE; break;
+        case Node_t::SHIFT: op.kind = Op::SHIFT; break;
+        case Node_t::TOTAL_SUM: op.kind = Op::TOTAL_SUM; break;
+        case Node_t::PERMUTE: op.kind = Op::PERMUTE; break;
+        case Node_t::SCALE: op.kind = Op::SCALE; break;
+        default: op.kind = lazy_operand && ! node->lazy ? Op::SUM_RELIN : Op::SUM;
+      }
+      op.left = &node->left->data->get();
+      op.right = &node->right->data->get();
+      op.amount = node->amount;
+      op.moves = node->moves.get();
+
+      // Only happens if a later evaluation multiplies or rotates an
+      // intermediate value.
+      if (node->state != Node_t::SUM && lazy_operand) {
+        for (auto operand : {&op.left, &op.right}) {
+          relinearized.push_back(**operand);
+          ElementOps<T>::relinearize(relinearized.back());
+          *operand = &relinearized.back();
+        }
+      }
+      ops.push_back(op);
+    }
+
+    // It's ok to not synchronize the above reads because we're the only writer.
+    auto results = this->do_batch(ops);
+    if (results.size() != nodes.size())
+      throw std::runtime_error("Got " + std::to_string(results.size())
+                               + " results for " + std::to_string(nodes.size())
+                               + " operations");
+
+    for (size_t i = 0; i < nodes.size(); i++) {
+      if (nodes[i]->level > 0)
+        ElementOps<T>::mod_switch_to(results[i], nodes[i]->level);
+      std::unique_lock<std::mutex> lck(nodes[i]->tree.get_evaluator()->mutex);
+      *nodes[i]->data = results[i];
+      nodes[i]->state = ArithmeticNode<T>::RESOLVED;
     }
+  }
+
+protected:
+  // One operation of a batch, the operands point into the nodes' data.
+  // PROD_LAZY may leave the result for a later SUM_RELIN to relinearize, see
+  // ElementOps. The unary operations (slots and scaling) only use left (right
+  // points to the same value) and amount or moves.
+  struct Op {
+    enum Kind {SUM, PROD, PROD_LAZY, SUM_RELIN, ROTATE, SHIFT, TOTAL_SUM,
+               PERMUTE, SCALE} kind;
+    const T *left;
+    const T *right;
+    long amount;
+    const SlotMoves_t *moves;
+  };
+
+  // Computes independent operations, results in the same order. Subclasses
+  // that can amortize per-call costs (e.g. a network round trip) should
+  // override this together with max_batch().
+  virtual std::vector<T> do_batch(const std::vector<Op> &ops) {
+    std::vector<T> results;
+    results.reserve(ops.size());
+    for (auto &op : ops)
+      switch (op.kind) {
+        case Op::SUM: results.push_back(this->do_sum(*op.left, *op.right)); break;
+        case Op::PROD: results.push_back(this->do_prod(*op.left, *op.right)); break;
+        case Op::PROD_LAZY:
+          results.push_back(this->do_prod_lazy(*op.left, *op.right));
+          break;
+        case Op::SUM_RELIN:
+          results.push_back(this->do_sum_relin(*op.left, *op.right));
+          break;
+        case Op::ROTATE:
+          results.push_back(this->do_rotate(*op.left, op.amount));
+          break;
+        case Op::SHIFT: results.push_back(this->do_shift(*op.left, op.amount)); break;
+        case Op::TOTAL_SUM: results.push_back(this->do_total_sum(*op.left)); break;
+        case Op::PERMUTE:
+          results.push_back(this->do_permute(*op.left, *op.moves));
+          break;
+        case Op::SCALE: results.push_back(this->do_scale(*op.left, op.amount)); break;
+      }
+    return results;
+  }
 
-    // It's ok to noy synchronize the above reads because we're the only writer.
-    std::unique_lock<std::mutex> lck(node.tree.get_evaluator()->mutex);
-    *node.data = result;
-    node.state = ArithmeticNode<T>::RESOLVED;
+  // Upper bound for the number of tasks given to do_batch() at once. Called
+  // from this worker's thread with the scheduler's mutex held.
+  virtual size_t max_batch() {
+    return 1;
   }
 
   // Ideally subclasses only need to override these.
   virtual T do_sum(const T &left, const T &right) = 0;
 
   virtual T do_prod(const T &left, const T &right) = 0;
+
+  virtual T do_prod_lazy(const T &left, const T &right) {
+    return ElementOps<T>::prod_lazy(left, right);
+  }
+
+  virtual T do_sum_relin(const T &left, const T &right) {
+    T result = this->do_sum(left, right);
+    ElementOps<T>::relinearize(result);
+    return result;
+  }
+
+  virtual T do_rotate(const T &value, long k) {
+    return ElementOps<T>::rotate(value, k);
+  }
+
+  virtual T do_shift(const T &value, long k) {
+    return ElementOps<T>::shift(value, k);
+  }
+
+  virtual T do_total_sum(const T &value) {
+    return ElementOps<T>::total_sum(value);
+  }
+
+  virtual T do_permute(const T &value, const SlotMoves_t &moves) {
+    return ElementOps<T>::permute(value, moves);
+  }
+
+  virtual T do_scale(const T &value, long c) {
+    return ElementOps<T>::scale(value, c);
+  }
 };
 
 // Simplest possible implementation, computes the operations inside the local thread.
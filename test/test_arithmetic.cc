@@ -1,14 +1,29 @@
 #include <iostream>
 #include <cassert>
 #include <cstdint>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <set>
+#include <sstream>
 
 #include "ArithmeticTree.h"
 #include "Evaluator.h"
 #include "Scheduler.h"
 #include "Worker.h"
+#include "PoolController.h"
+#include "ElementOps.h"
 #include "Log.h"
 #include "UInt.h"
+#include "BitSlicing.h"
 #include "GFN.h"
+#include "ChooseParams.h"
+#include "VectorizingEvaluator.h"
+#include "Polynomial.h"
+#include "BitSlice.h"
+#include "Simulation.h"
+#include "Trace.h"
+#include "Util.h"
 
 using namespace std;
 
@@ -153,6 +168,874 @@ void test9() {
   assert(get_value(n2) == 20);
 }
 
+// Worker slow enough for tasks to queue up.
+class SlowWorker : public Worker<int> {
+public:
+  SlowWorker(Scheduler<int> &scheduler, const std::string &name_)
+    : Worker<int>(scheduler, name_) {}
+
+private:
+  virtual int do_sum(const int &left, const int &right) {
+    this_thread::sleep_for(chrono::milliseconds(2));
+    return left + right;
+  }
+
+  virtual int do_prod(const int &left, const int &right) {
+    this_thread::sleep_for(chrono::milliseconds(2));
+    return left * right;
+  }
+};
+
+// PoolController grows under load and shrinks back when idle.
+void test10() {
+  ArithmeticTree<int>::EvaluatorPtr_t ev(new Evaluator<int>());
+  auto &sched = *ev->get_scheduler();
+  PoolConfig config;
+  config.min_workers = 1;
+  config.max_workers = 4;
+  config.idle_timeout = 0.1;
+  config.interval = 0.01;
+  unsigned int spawned = 0;
+  PoolController<int> pool(sched, config,
+                           [&] (Scheduler<int> &s, const std::string &name) {
+                             spawned++;
+                             return new SlowWorker(s, name);
+                           });
+
+  auto t = ArithmeticTree<int>(ev);
+  auto &one = t.new_node(1);
+  std::vector<ArithmeticNode<int>* > sums;
+  for (int i = 0; i < 200; i++) {
+    auto &sum = one + one;
+    t.eval(sum);
+    sums.push_back(&sum);
+  }
+  ev->exec();
+  for (auto sum : sums)
+    assert(*sum->get_data() == 2);
+  assert(spawned > 1);
+  assert(sched.get_workers().size() <= 4);
+
+  auto deadline = chrono::steady_clock::now() + chrono::seconds(10);
+  while (sched.get_workers().size() > 1 && chrono::steady_clock::now() < deadline)
+    this_thread::sleep_for(chrono::milliseconds(10));
+  assert(sched.get_workers().size() == 1);
+  assert(pool.size() == 1);
+
+  // Idle workers are picked and retired under the scheduler's lock.
+  Scheduler<int> stubs;
+  WorkerStub<int>::create_n(stubs, 2);
+  this_thread::sleep_for(chrono::milliseconds(20));
+  auto second = [] (Worker<int> *w) { return w->get_name() == "WorkerStub_2"; };
+  assert(! stubs.retire_if_idle(10, second));
+  assert(stubs.retire_if_idle(0.01, second));
+  assert(! stubs.retire_if_idle(0.01, second));
+  assert((stubs.get_worker_names() == set<string>{"WorkerStub_1"}));
+}
+
+// Integer that tracks its "degree" like a ciphertext: lazy products give
+// degree 2, products only accept degree 1 operands.
+struct Lazy {
+  int value = 0;
+  int degree = 1;
+
+  Lazy() {}
+  Lazy(int value_, int degree_ = 1) : value(value_), degree(degree_) {}
+
+  Lazy operator+(const Lazy &rhs) const {
+    return Lazy(value + rhs.value, max(degree, rhs.degree));
+  }
+
+  Lazy operator*(const Lazy &rhs) const {
+    assert(degree == 1 && rhs.degree == 1);
+    return Lazy(value * rhs.value);
+  }
+};
+
+atomic<int> n_relins(0);
+
+template <>
+struct ElementOps<Lazy> : DefaultElementOps<Lazy> {
+  static constexpr bool deferrable = true;
+
+  static Lazy prod_lazy(const Lazy &left, const Lazy &right) {
+    assert(left.degree == 1 && right.degree == 1);
+    return Lazy(left.value * right.value, 2);
+  }
+
+  static void relinearize(Lazy &lazy) {
+    if (lazy.degree != 1)
+      n_relins++;
+    lazy.degree = 1;
+  }
+};
+
+// Sums of products are relinearized once, at the sum.
+void test11() {
+  ArithmeticTree<Lazy>::EvaluatorPtr_t ev(new Evaluator<Lazy>());
+  WorkerStub<Lazy>::create_n(*ev->get_scheduler(), 3);
+  auto t = ArithmeticTree<Lazy>(ev);
+
+  // Inner product of (1, 2, 3, 4) and (5, 6, 7, 8).
+  std::vector<ArithmeticNode<Lazy>* > prods;
+  for (int i = 1; i <= 4; i++)
+    prods.push_back(&(t.new_node(Lazy(i)) * t.new_node(Lazy(i + 4))));
+  auto &sum = (*prods[0] + *prods[1]) + (*prods[2] + *prods[3]);
+  // Used by a product, so it has to be relinearized.
+  auto &sq = *prods[0] * t.new_node(Lazy(2));
+  t.eval(sum);
+  t.eval(sq);
+  ev->exec();
+
+  assert(sum.get_data()->value == 70);
+  assert(sum.get_data()->degree == 1);
+  assert(sq.get_data()->value == 10);
+  assert(n_relins == 1);
+
+  // A later product of an intermediate lazy value still gets a canonical one.
+  auto &again = *prods[1] * *prods[2];
+  t.eval(again);
+  ev->exec();
+  assert(again.get_data()->value == 12 * 21);
+  assert(again.get_data()->degree == 1);
+}
+
+// Integer on a modulus chain: products consume a level, operands are brought
+// down to the lower level like HElib does.
+struct Leveled {
+  int value = 0;
+  long level = 5;
+
+  Leveled() {}
+  Leveled(int value_, long level_ = 5) : value(value_), level(level_) {}
+
+  Leveled operator+(const Leveled &rhs) const {
+    return Leveled(value + rhs.value, min(level, rhs.level));
+  }
+
+  Leveled operator*(const Leveled &rhs) const {
+    assert(min(level, rhs.level) > 0);
+    return Leveled(value * rhs.value, min(level, rhs.level) - 1);
+  }
+};
+
+template <>
+struct ElementOps<Leveled> : DefaultElementOps<Leveled> {
+  static constexpr bool leveled = true;
+
+  static long level(const Leveled &leveled) {
+    return leveled.level;
+  }
+
+  static void mod_switch_to(Leveled &leveled, long level_) {
+    leveled.level = min(leveled.level, level_);
+  }
+
+  static double noise_budget(const Leveled &leveled) {
+    return 10 * leveled.level;
+  }
+};
+
+// Values are switched down to the level their consumers need.
+void test12() {
+  ArithmeticTree<Leveled>::EvaluatorPtr_t ev(new Evaluator<Leveled>());
+  WorkerStub<Leveled>::create_n(*ev->get_scheduler(), 2);
+  auto t = ArithmeticTree<Leveled>(ev);
+
+  auto &a = t.new_node(Leveled(2));
+  auto &b = t.new_node(Leveled(3));
+  auto &p = a * b;
+  auto &q = p * t.new_node(Leveled(4));
+  auto &s1 = q + t.new_node(Leveled(1));
+  auto &s2 = a + b;
+  t.eval(s1);
+  t.eval(s2);
+  ev->exec();
+
+  assert(s1.get_data()->value == 25);
+  assert(s2.get_data()->value == 5);
+  // q feeds a sum that must end at level 1, so p only needs to be at 2.
+  assert(p.get_data()->level == 2);
+  assert(q.get_data()->level == 1);
+  assert(s1.get_data()->level == 1);
+  assert(s2.get_data()->level == 1);
+  assert(ev->noise_budget() == 10);
+  assert(p.noise_budget() == 20);
+
+  // Keeping results at a higher level for later use.
+  ev->set_min_level(3);
+  auto &s3 = a + b;
+  t.eval(s3);
+  ev->exec();
+  assert(s3.get_data()->level == 3);
+}
+
+// UInt arithmetic against plain integers, plus the depth of the circuits.
+void test13() {
+  typedef GFN<2> Bit;
+  ArithmeticTree<Bit>::EvaluatorPtr_t ev(new Evaluator<Bit>());
+  WorkerStub<Bit>::create_n(*ev->get_scheduler(), 4);
+
+  uint64_t pairs[][2] = {{0, 0}, {255, 1}, {1, 255}, {200, 100}, {37, 37},
+                         {128, 127}, {15, 240}, {99, 3}, {254, 255}, {7, 0}};
+  for (auto &pair : pairs) {
+    auto t = ArithmeticTree<Bit>(ev);
+    uint64_t x = pair[0], y = pair[1];
+    UInt<Bit> a(t, x), b(t, y);
+
+    auto sum = a + b, diff = a - b, prod = a * b;
+    auto shl = a << 3, shr = a >> 2, inv = ~a;
+    std::vector<ArithmeticNode<Bit>* > cmps = {&(a < b), &(a > b), &(a <= b),
+                                                &(a >= b), &(a == b)};
+
+    auto add_stats = sum.stats();
+    assert(add_stats.mult_depth <= 1 + 3);
+    assert(diff.stats().mult_depth <= 1 + 3);
+    assert(prod.stats().mult_depth < 8);
+    assert(shl.stats().prods == 0 && shr.stats().prods == 0);
+    assert(CircuitAnalyzer<Bit>::analyze({cmps[4]}).mult_depth == 3);
+
+    for (auto v : {&sum, &diff, &prod, &shl, &shr, &inv})
+      v->eval();
+    for (auto c : cmps)
+      t.eval(*c);
+    ev->exec();
+
+    assert(get_value(sum) == ((x + y) & 0xff));
+    assert(get_value(diff) == ((x - y) & 0xff));
+    assert(get_value(prod) == ((x * y) & 0xff));
+    assert(get_value(shl) == ((x << 3) & 0xff));
+    assert(get_value(shr) == (x >> 2));
+    assert(get_value(inv) == (~x & 0xff));
+    uint64_t expected[] = {x < y, x > y, x <= y, x >= y, x == y};
+    for (int i = 0; i < 5; i++)
+      assert(cmps[i]->get_data()->get() == expected[i]);
+    ev->reset();
+  }
+}
+
+atomic<int> n_lane_prods(0);
+
+// Plain stand-in for EncBitVector: GF(2) operations slot by slot.
+struct Lanes {
+  std::vector<bool> slots;
+
+  Lanes() {}
+  Lanes(const std::vector<bool> &slots_) : slots(slots_) {}
+
+  Lanes operator+(const Lanes &rhs) const {
+    Lanes ret(slots);
+    for (size_t i = 0; i < slots.size(); i++)
+      ret.slots[i] = slots[i] != rhs.slots[i];
+    return ret;
+  }
+
+  Lanes operator*(const Lanes &rhs) const {
+    n_lane_prods++;
+    Lanes ret(slots);
+    for (size_t i = 0; i < slots.size(); i++)
+      ret.slots[i] = slots[i] && rhs.slots[i];
+    return ret;
+  }
+};
+
+template <>
+struct ElementOps<Lanes> : DefaultElementOps<Lanes> {
+  static Lanes constant(bool bit, const Lanes *like) {
+    assert(like != nullptr);
+    return Lanes(std::vector<bool>(like->slots.size(), bit));
+  }
+
+  static Lanes rotate(const Lanes &value, long k) {
+    long n = value.slots.size();
+    Lanes ret(value.slots);
+    for (long i = 0; i < n; i++)
+      ret.slots[(((i + k) % n) + n) % n] = value.slots[i];
+    return ret;
+  }
+
+  static Lanes shift(const Lanes &value, long k) {
+    long n = value.slots.size();
+    Lanes ret(std::vector<bool>(n, false));
+    for (long i = 0; i < n; i++)
+      if (i + k >= 0 && i + k < n)
+        ret.slots[i + k] = value.slots[i];
+    return ret;
+  }
+
+  static Lanes total_sum(const Lanes &value) {
+    bool sum = false;
+    for (auto slot : value.slots)
+      sum = sum != slot;
+    return Lanes(std::vector<bool>(value.slots.size(), sum));
+  }
+
+  static Lanes permute(const Lanes &value, const SlotMoves_t &moves) {
+    Lanes ret(std::vector<bool>(value.slots.size(), false));
+    for (auto &move : moves)
+      ret.slots.at(move.second) = value.slots.at(move.first);
+    return ret;
+  }
+
+  static long slots(const Lanes &value) {
+    return value.slots.size();
+  }
+};
+
+// Bit-sliced UInts compute one result per slot.
+void test14() {
+  vector<uint64_t> x, y;
+  for (uint64_t i = 0; i < 100; i++) {
+    x.push_back((i * 37) % 256);
+    y.push_back((i * 91 + 5) % 256);
+  }
+  auto planes = slice_bits(x, 8, 128);
+  assert(planes.size() == 8 && planes[0].size() == 128);
+  auto back = unslice_bits(planes);
+  assert(vector<uint64_t>(back.begin(), back.begin() + 100) == x);
+  assert(back[127] == 0);
+
+  ArithmeticTree<Lanes>::EvaluatorPtr_t ev(new Evaluator<Lanes>());
+  WorkerStub<Lanes>::create_n(*ev->get_scheduler(), 4);
+  auto t = ArithmeticTree<Lanes>(ev);
+  auto encode = [] (const vector<bool> &plane) { return Lanes(plane); };
+  auto a = encode_sliced<8>(t, x, 128, encode);
+  auto b = encode_sliced<8>(t, y, 128, encode);
+
+  auto sum = a + b;
+  auto diff = a - b;
+  UInt<Lanes, 8> less(t, vector<ArithmeticNode<Lanes>* >(8, &(a < b)));
+  sum.eval();
+  diff.eval();
+  less.eval();
+  ev->exec();
+
+  auto decode = [] (const Lanes &lanes) { return lanes.slots; };
+  auto sums = decode_sliced(sum, decode);
+  auto diffs = decode_sliced(diff, decode);
+  auto lesses = decode_sliced(less, decode);
+  for (size_t i = 0; i < x.size(); i++) {
+    assert(sums[i] == ((x[i] + y[i]) & 0xff));
+    assert(diffs[i] == ((x[i] - y[i]) & 0xff));
+    assert(lesses[i] == (x[i] < y[i] ? 0xff : 0));
+  }
+}
+
+// Parameters chosen from the requested nodes.
+void test15() {
+  typedef GFN<2> Bit;
+  ArithmeticTree<Bit>::EvaluatorPtr_t ev(new Evaluator<Bit>());
+  WorkerStub<Bit>::create_n(*ev->get_scheduler(), 2);
+  auto t = ArithmeticTree<Bit>(ev);
+  UInt<Bit, 4> a(t, 5), b(t, 6);
+  auto prod = a * b;
+  auto &eq = a == b;
+  prod.eval();
+  t.eval(eq);
+
+  auto stats = CircuitAnalyzer<Bit>::analyze(ev->requested());
+  assert(ev->requested().size() == 5);
+  assert(stats.prods_per_level.size() == stats.mult_depth);
+  size_t prods = 0;
+  for (auto n : stats.prods_per_level)
+    prods += n;
+  assert(prods == stats.prods);
+
+  auto params = choose_params(*ev, 128, 64);
+  assert(params.key_security == 128 && params.s == 64);
+  assert(params.depth == long(stats.mult_depth) + 1);
+  assert(params.c == 2);
+  ev->set_min_level(0);
+  assert(choose_params(*ev).depth == long(stats.mult_depth));
+
+  // Noisy circuits and deep chains.
+  CircuitStats wide;
+  wide.mult_depth = 20;
+  wide.noise_bits = 21;
+  auto deep = choose_params(wide);
+  assert(deep.depth == 20 + 1 + 1);
+  assert(deep.c == 3);
+
+  // Noise adds up in sums and multiplies in products.
+  ArithmeticTree<Bit> noisy(ev);
+  auto &fresh = noisy.new_node(Bit(1));
+  auto &four = (fresh + fresh) + (fresh + fresh);
+  assert(CircuitAnalyzer<Bit>::analyze({&four}).noise_bits == 2);
+  assert(CircuitAnalyzer<Bit>::analyze({&(four * four)}).noise_bits == 4);
+  assert(CircuitAnalyzer<Bit>::analyze({&fresh.scale(8)}).noise_bits == 3);
+
+  ev->exec();
+  assert(get_value(prod) == 14);
+  assert(eq.get_data()->get() == 0);
+  assert(ev->requested().empty());
+}
+
+// Slot rotations and total sums, packed reductions stay packed.
+void test16() {
+  ArithmeticTree<Lanes>::EvaluatorPtr_t ev(new Evaluator<Lanes>());
+  WorkerStub<Lanes>::create_n(*ev->get_scheduler(), 3);
+  auto t = ArithmeticTree<Lanes>(ev);
+  vector<bool> x = {1, 1, 0, 1, 0, 1, 1, 0}, y = {1, 0, 1, 1, 0, 1, 1, 1};
+  auto &prod = t.new_node(Lanes(x)) * t.new_node(Lanes(y));
+
+  // Dot product over GF(2), by rotate-and-add and in one node.
+  auto *reduced = &prod;
+  for (long k = 1; k < 8; k *= 2)
+    reduced = &(*reduced + reduced->rotate(k));
+  auto &dot = prod.total_sum();
+  auto &shifted = t.new_node(Lanes(x)).shift(2);
+  auto &back = t.new_node(Lanes(x)).shift(-3);
+
+  auto stats = CircuitAnalyzer<Lanes>::analyze({reduced, &dot, &shifted, &back});
+  assert(stats.rotations == 5 && stats.total_sums == 1);
+  assert(stats.mult_depth == 1 && stats.prods == 1);
+  assert((stats.rotation_amounts == std::set<long>{-3, 1, 2, 4}));
+  auto params = choose_params(stats);
+  assert((params.rotations == std::vector<long>{-3, 1, 2, 4}));
+  assert(params.total_sums);
+  assert(stats.slot_span == 5 && params.s == 5);
+  assert(choose_params(stats, 80, 64).s == 64);
+
+  for (auto node : {reduced, &dot, &shifted, &back})
+    t.eval(*node);
+  ev->exec();
+  assert(reduced->get_data()->slots == vector<bool>(8, false));  // 4 ones.
+  assert(dot.get_data()->slots == vector<bool>(8, false));
+  assert((shifted.get_data()->slots == vector<bool>{0, 0, 1, 1, 0, 1, 0, 1}));
+  assert((back.get_data()->slots == vector<bool>{1, 0, 1, 1, 0, 0, 0, 0}));
+
+  auto &odd = (prod + t.new_node(Lanes(vector<bool>(8, true)))).total_sum();
+  t.eval(odd);
+  ev->exec();
+  assert(odd.get_data()->slots == vector<bool>(8, false));  // 4 zeros.
+  auto &one = t.new_node(Lanes(x)).total_sum();
+  t.eval(one);
+  ev->exec();
+  assert(one.get_data()->slots == vector<bool>(8, true));  // 5 ones.
+
+  // Scalars are a single slot.
+  ArithmeticTree<int> ints(eval);
+  auto &five = ints.new_node(5);
+  auto &rot = five.rotate(3), &sh = five.shift(1), &ts = five.total_sum();
+  for (auto node : {&rot, &sh, &ts})
+    ints.eval(*node);
+  eval->exec();
+  assert(*rot.get_data() == 5 && *sh.get_data() == 0 && *ts.get_data() == 5);
+
+  // Operands of slot operations are never left lazy.
+  ArithmeticTree<Lazy>::EvaluatorPtr_t lazy_ev(new Evaluator<Lazy>());
+  WorkerStub<Lazy>::create_n(*lazy_ev->get_scheduler(), 2);
+  auto lt = ArithmeticTree<Lazy>(lazy_ev);
+  auto &lazy_prod = lt.new_node(Lazy(3)) * lt.new_node(Lazy(4));
+  auto &rotated = lazy_prod.rotate(1) + lt.new_node(Lazy(1));
+  lt.eval(rotated);
+  lazy_ev->exec();
+  assert(rotated.get_data()->value == 13);
+  assert(rotated.get_data()->degree == 1);
+}
+
+// Independent adders written one bit per node run packed, slot 0 keeps the
+// results.
+void test17() {
+  auto lane = [] (bool bit) {
+    vector<bool> slots(16, false);
+    slots[0] = bit;
+    return Lanes(slots);
+  };
+  auto run = [&] (ArithmeticTree<Lanes>::EvaluatorPtr_t ev, vector<uint64_t> &results) {
+    WorkerStub<Lanes>::create_n(*ev->get_scheduler(), 3);
+    auto t = ArithmeticTree<Lanes>(ev);
+    vector<UInt<Lanes, 4> > sums;
+    for (uint64_t i = 0; i < 8; i++) {
+      vector<ArithmeticNode<Lanes>* > a, b;
+      for (int j = 0; j < 4; j++) {
+        a.push_back(&t.new_node(lane(((i * 3) >> j) & 1)));
+        b.push_back(&t.new_node(lane(((i * 5 + 1) >> j) & 1)));
+      }
+      sums.push_back(UInt<Lanes, 4>(t, a) + UInt<Lanes, 4>(t, b));
+      sums.back().eval();
+    }
+    int before = n_lane_prods;
+    ev->exec();
+    results.clear();
+    for (auto &sum : sums)
+      results.push_back(decode_sliced(sum, [] (const Lanes &l) {
+                                        return vector<bool>(1, l.slots[0]); })[0]);
+    return n_lane_prods - before;
+  };
+
+  vector<uint64_t> plain, packed;
+  int plain_prods = run(ArithmeticTree<Lanes>::EvaluatorPtr_t(new Evaluator<Lanes>()),
+                        plain);
+  auto vec_ev = make_shared<VectorizingEvaluator<Lanes> >();
+  int packed_prods = run(vec_ev, packed);
+  assert(vec_ev->get_vectorized() > 0 && vec_ev->get_packed() > 0);
+  for (uint64_t i = 0; i < 8; i++)
+    assert(plain[i] == ((i * 3 + i * 5 + 1) & 15));
+  assert(packed == plain);
+  assert(packed_prods * 4 <= plain_prods);
+
+  // plan() packs before exec(), so the rotations can be sized up front on a
+  // plain copy with set_slots(), and the real run does the same ones.
+  auto sizing = make_shared<VectorizingEvaluator<GFN<2> > >();
+  sizing->set_slots(16);
+  auto plain_tree = ArithmeticTree<GFN<2> >(sizing);
+  auto planned = make_shared<VectorizingEvaluator<Lanes> >();
+  planned->set_slots(16);
+  WorkerStub<Lanes>::create_n(*planned->get_scheduler(), 2);
+  auto lane_tree = ArithmeticTree<Lanes>(planned);
+  vector<UInt<Lanes, 4> > lane_sums;
+  for (uint64_t i = 0; i < 8; i++) {
+    vector<ArithmeticNode<GFN<2> >* > pa, pb;
+    vector<ArithmeticNode<Lanes>* > la, lb;
+    for (int j = 0; j < 4; j++) {
+      pa.push_back(&plain_tree.new_node(GFN<2>(0)));
+      pb.push_back(&plain_tree.new_node(GFN<2>(0)));
+      la.push_back(&lane_tree.new_node(lane(((i * 3) >> j) & 1)));
+      lb.push_back(&lane_tree.new_node(lane(((i * 5 + 1) >> j) & 1)));
+    }
+    (UInt<GFN<2>, 4>(plain_tree, pa) + UInt<GFN<2>, 4>(plain_tree, pb)).eval();
+    lane_sums.push_back(UInt<Lanes, 4>(lane_tree, la) + UInt<Lanes, 4>(lane_tree, lb));
+    lane_sums.back().eval();
+  }
+  assert(choose_params(*sizing).rotations.empty());
+  assert(sizing->plan() > 0);
+  auto params = choose_params(*sizing, 80, 16);
+  assert(! params.rotations.empty() && params.s == 16);
+  assert(planned->plan() == sizing->get_vectorized());
+  assert(choose_params(*planned, 80, 16).rotations == params.rotations);
+  planned->exec();
+  assert(planned->get_vectorized() == sizing->get_vectorized());
+  for (uint64_t i = 0; i < 8; i++)
+    assert(decode_sliced(lane_sums[i], [] (const Lanes &l) {
+                           return vector<bool>(1, l.slots[0]); })[0] == plain[i]);
+  // The plain copy can't run what it planned.
+  WorkerStub<GFN<2> >::create_n(*sizing->get_scheduler(), 1);
+  bool thrown = false;
+  try {
+    sizing->exec();
+  } catch (std::invalid_argument &e) {
+    thrown = true;
+  }
+  assert(thrown);
+
+  // Too few slots, or too small groups, leave the circuit alone.
+  auto scalar = make_shared<VectorizingEvaluator<int> >();
+  WorkerStub<int>::create_n(*scalar->get_scheduler(), 1);
+  ArithmeticTree<int> ints(scalar);
+  auto &x = ints.new_node(3) * ints.new_node(4);
+  auto &y = ints.new_node(5) * ints.new_node(6);
+  ints.eval(x);
+  ints.eval(y);
+  scalar->exec();
+  assert(scalar->get_vectorized() == 0);
+  assert(*x.get_data() == 12 && *y.get_data() == 30);
+}
+
+// Polynomials take about 2 sqrt(d) products, tables share their monomials.
+void test18() {
+  typedef GFN<65537> F;
+  ArithmeticTree<F>::EvaluatorPtr_t ev(new Evaluator<F>());
+  WorkerStub<F>::create_n(*ev->get_scheduler(), 2);
+  auto t = ArithmeticTree<F>(ev);
+  vector<long> coeffs;
+  for (long i = 0; i < 16; i++)
+    coeffs.push_back((i * 7 + 3) % 5);
+  PolyBuilder<F> builder(t);
+  vector<ArithmeticNode<F>* > results;
+  for (uint64_t x = 0; x < 5; x++) {
+    auto &in = t.new_node(F(x * 1000 + 17));
+    auto &out = builder.poly(in, coeffs);
+    auto stats = CircuitAnalyzer<F>::analyze(vector<ArithmeticNode<F>* >(1, &out));
+    assert(stats.prods < 10 && stats.mult_depth <= 5);
+    t.eval(out);
+    results.push_back(&out);
+  }
+  ev->exec();
+  for (uint64_t x = 0; x < 5; x++) {
+    F expected(0), power(1);
+    for (auto c : coeffs) {
+      expected = expected + power * F(c);
+      power = power * F(x * 1000 + 17);
+    }
+    assert(results[x]->get_data().get() == expected);
+  }
+
+  // The PRESENT S-box and its inverse, on all 4 bit inputs.
+  const vector<uint64_t> sbox = {0xC, 5, 6, 0xB, 9, 0, 0xA, 0xD, 3, 0xE, 0xF, 8, 4, 7, 1, 2};
+  vector<uint64_t> inverse(16);
+  for (uint64_t v = 0; v < 16; v++)
+    inverse[sbox[v]] = v;
+  ArithmeticTree<GFN<2> >::EvaluatorPtr_t bev(new Evaluator<GFN<2> >());
+  WorkerStub<GFN<2> >::create_n(*bev->get_scheduler(), 2);
+  auto bt = ArithmeticTree<GFN<2> >(bev);
+  PolyBuilder<GFN<2> > bits_builder(bt);
+  vector<UInt<GFN<2>, 4> > outs, backs;
+  for (uint64_t v = 0; v < 16; v++) {
+    UInt<GFN<2>, 4> in(bt, v);
+    auto bits = in.get_bits();
+    vector<ArithmeticNode<GFN<2> >* > in_bits(bits, bits + 4);
+    outs.push_back(UInt<GFN<2>, 4>(bt, bits_builder.lut(in_bits, sbox, 4)));
+    auto prods = outs.back().stats().prods;
+    auto inv = bits_builder.lut(in_bits, inverse, 4);
+    auto both = CircuitAnalyzer<GFN<2> >::analyze({inv[0], inv[1], inv[2], inv[3],
+                                                   outs.back().get_bits()[0]});
+    assert(prods <= 11 && both.prods <= 11 && both.mult_depth <= 2);
+    backs.push_back(UInt<GFN<2>, 4>(bt, inv));
+    outs.back().eval();
+    backs.back().eval();
+  }
+  bev->exec();
+  for (uint64_t v = 0; v < 16; v++) {
+    assert(get_value(outs[v]) == sbox[v]);
+    assert(get_value(backs[v]) == inverse[v]);
+  }
+}
+
+// Bit-sliced circuits check all 2^16 inputs of an 8 bit multiply-add against
+// plain integers, one test vector per lane.
+template <unsigned int W>
+void check_sliced_mul() {
+  typedef BitSlice<W> B;
+  auto ev = make_shared<Evaluator<B> >();
+  BitSliceWorker<W>::create_n(*ev->get_scheduler(), 2);
+  for (uint64_t offset = 0; offset < (1 << 16); offset += B::n_lanes) {
+    ev->reset();
+    ArithmeticTree<B> t(ev);
+    vector<ArithmeticNode<B>* > a, b;
+    for (unsigned int i = 0; i < 8; i++) {
+      a.push_back(&t.new_node(B::counter(i, offset)));
+      b.push_back(&t.new_node(B::counter(i + 8, offset)));
+    }
+    UInt<B, 8> x(t, a), y(t, b);
+    auto result = x * y + x;
+    result.eval();
+    ev->exec();
+    auto values = decode_sliced(result, [] (const B &bits) { return bits.to_bits(); });
+    for (size_t j = 0; j < B::n_lanes; j++) {
+      uint64_t in = offset + j;
+      assert(values[j] == (((in & 255) * (in >> 8) + (in & 255)) & 255));
+    }
+  }
+}
+
+void test19() {
+  check_sliced_mul<1>();
+  check_sliced_mul<4>();
+
+  BitSlice<4> lanes(vector<bool>{true, false, true});
+  assert(lanes.get(0) && ! lanes.get(1) && lanes.get(2) && ! lanes.get(255));
+  assert((lanes * BitSlice<4>(true)) == lanes);
+  assert((lanes + lanes) == BitSlice<4>(false));
+  stringstream ss;
+  ElementOps<BitSlice<4> >::write(lanes, ss);
+  BitSlice<4> read;
+  ElementOps<BitSlice<4> >::read(read, ss);
+  assert(read == lanes);
+}
+
+// Simulated runs predict time for the number of workers, levels and noise.
+void test20() {
+  SimCosts costs;
+  costs.prod = 1;
+  costs.relin = 0.5;
+  costs.sum = 0.01;
+  costs.top_level = 4;
+  auto products = [] (ArithmeticTree<SimValue> &t, shared_ptr<SimModel> model) {
+    vector<ArithmeticNode<SimValue>* > ret;
+    for (int i = 0; i < 16; i++)
+      ret.push_back(&(t.new_node(SimValue(model)) * t.new_node(SimValue(model))));
+    return ret;
+  };
+  auto one = simulate(costs, 1, products, 1e-3);
+  auto four = simulate(costs, 4, products, 1e-3);
+  assert(one.ops == 16 && one.work == four.work);
+  assert(one.makespan == 16);
+  assert(four.makespan >= 4 && four.makespan < 0.6 * one.makespan);
+  assert(one.peak_bytes >= 32 * costs.bytes);  // The inputs.
+
+  // x^8 takes 3 levels and 3 products of noise, the output is left at level 1.
+  auto power = [] (ArithmeticTree<SimValue> &t, shared_ptr<SimModel> model) {
+    auto *x = &t.new_node(SimValue(model));
+    for (int i = 0; i < 3; i++)
+      x = &(*x * *x);
+    return vector<ArithmeticNode<SimValue>* >(1, x);
+  };
+  auto deep = simulate(costs, 2, power);
+  assert(deep.decrypts() && deep.level == 1);
+  assert(deep.noise_budget == costs.fresh_budget - 3 * costs.prod_bits);
+  assert(deep.makespan > 3 * 0.5 && deep.makespan < 3 * 1.01);
+  costs.top_level = 2;
+  assert(! simulate(costs, 2, power).decrypts());
+
+  auto measured = calibrate(3, 4, 100);
+  assert(measured.sum >= 0 && measured.prod >= 0 && measured.slots == 1);
+  assert(std::isinf(measured.fresh_budget) && measured.prod_bits == 0);
+}
+
+// Reductions for every kind of modulus against 128 bit arithmetic.
+template <uint64_t N>
+void check_gfn() {
+  uint64_t x = 0x9e3779b97f4a7c15;
+  vector<GFN<N> > a, b, sums, prods;
+  for (int i = 0; i < 1000; i++) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    uint64_t y = x * 0xbf58476d1ce4e5b9;
+    GFN<N> u(x), v(y);
+    assert(u.get() == x % N && v.get() == y % N);
+    unsigned __int128 sum = (unsigned __int128)(x % N) + y % N;
+    assert((u + v).get() == uint64_t(sum >= N ? sum - N : sum));
+    assert((u * v).get() == uint64_t((unsigned __int128)(x % N) * (y % N) % N));
+    a.push_back(u);
+    b.push_back(v);
+    sums.push_back(u + v);
+    prods.push_back(u * v);
+  }
+  vector<GFN<N> > out(a.size());
+  gfn_add(a.data(), b.data(), out.data(), a.size());
+  assert(out == sums);
+  gfn_mul(a.data(), b.data(), out.data(), a.size());
+  assert(out == prods);
+  GFN<N> top(N - 1);
+  assert((top + top).get() == N - 2 && (top * top).get() == 1);
+}
+
+void test21() {
+  check_gfn<2>();
+  check_gfn<256>();
+  check_gfn<65537>();
+  check_gfn<(uint64_t(1) << 61) - 1>();
+  check_gfn<18446744073709551557ull>();  // Largest 64 bit prime.
+
+  GFN<2> t(1), f(0);
+  assert((t && f) == f && (t || f) == t && (t ^ t) == f && (! f) == t);
+}
+
+size_t count(const string &s, const string &what) {
+  size_t n = 0;
+  for (size_t pos = s.find(what); pos != string::npos; pos = s.find(what, pos + 1))
+    n++;
+  return n;
+}
+
+// Tracing, one task span per scheduled node and nothing while disabled.
+void test22() {
+  Trace::clear();
+  auto run = [] () {
+    eval->reset();
+    auto tree = ArithmeticTree<int>(eval);
+    auto x = tree.new_node(2) * tree.new_node(3) + tree.new_node(4) * tree.new_node(5);
+    tree.eval(x);
+    eval->exec();
+    assert(*x.get_data() == 26);
+  };
+  run();
+  assert(Trace::size() == 0);
+
+  Trace::enable();
+  run();
+  Trace::enable(false);
+  assert(Trace::size() > 0);
+
+  stringstream ss;
+  Trace::write_chrome(ss);
+  auto json = ss.str();
+  assert(json.find("{\"traceEvents\": [") == 0);
+  assert(count(json, "\"name\":\"enqueue\"") == 3);
+  assert(count(json, "\"name\":\"task\"") >= 1);
+  assert(count(json, "\"name\":\"task\"") <= 3);
+  assert(count(json, "\"name\":\"prepare\"") == 1);
+  assert(json.find("WorkerStub_") != string::npos);
+
+  Trace::clear();
+  assert(Trace::size() == 0);
+}
+
+// Latencies are learned from mixed batches too, which follow the worker's
+// speed without mixing up the classes.
+class BatchingWorker : public Worker<int> {
+public:
+  BatchingWorker(Scheduler<int> &scheduler) : Worker<int>(scheduler, "Batching") {}
+
+private:
+  virtual size_t max_batch() {
+    return 64;
+  }
+
+  virtual int do_sum(const int &left, const int &right) {
+    return left + right;
+  }
+
+  virtual int do_prod(const int &left, const int &right) {
+    this_thread::sleep_for(chrono::milliseconds(this->prod_ms));
+    return left * right;
+  }
+
+public:
+  atomic<int> prod_ms{2};
+};
+
+void test23() {
+  auto ev = make_shared<Evaluator<int> >();
+  auto worker = new BatchingWorker(*ev->get_scheduler());
+  auto run = [&] (int n_sums, int n_prods) {
+    ev->reset();
+    ArithmeticTree<int> t(ev);
+    for (int i = 0; i < n_sums; i++)
+      t.eval(t.new_node(i) + t.new_node(1));
+    for (int i = 0; i < n_prods; i++)
+      t.eval(t.new_node(i) * t.new_node(2));
+    ev->exec();
+  };
+  run(0, 10);
+  run(20, 20);
+  run(20, 0);
+  auto caps = worker->get_caps();
+  assert(caps.prod_latency > 0.001);
+  assert(caps.sum_latency < caps.prod_latency / 10);
+
+  // Slower products, only ever seen in mixed batches.
+  worker->prod_ms = 8;
+  for (int i = 0; i < 6; i++)
+    run(20, 20);
+  caps = worker->get_caps();
+  assert(caps.prod_latency > 0.004);
+  assert(caps.sum_latency < caps.prod_latency / 10);
+
+  size_t mixed[4] = {2, 2, 0, 0};
+  WorkerCaps unmeasured;
+  unmeasured.cores = 2;
+  unmeasured.observe_batch(mixed, 1);
+  assert(unmeasured.sum_latency == 0.5 && unmeasured.prod_latency == 0.5);
+  size_t prods[4] = {0, 4, 0, 0};
+  unmeasured.observe_batch(prods, 1);
+  assert(fabs(unmeasured.prod_latency - 0.5) < 1e-9 && unmeasured.rotate_latency == 0);
+}
+
+// Parallel loop covers every index exactly once and forwards exceptions.
+void test24() {
+  for (unsigned int n_threads : {0u, 1u, 3u, 64u}) {
+    vector<int> hits(50, 0);
+    parallel_for(hits.size(), [&] (size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i++)
+        hits[i]++;
+    }, n_threads);
+    for (auto hit : hits)
+      assert(hit == 1);
+  }
+  parallel_for(0, [] (size_t begin, size_t end) { assert(false); });
+
+  try {
+    parallel_for(10, [] (size_t begin, size_t end) {
+      if (begin > 0)
+        throw runtime_error("chunk");
+    }, 4);
+    assert(false);
+  } catch (runtime_error&) {}
+}
+
 int main(int argc, char **argv) {
   Log::set_level(Log::DISABLE);
   WorkerStub<int>::create_n(*eval->get_scheduler(), 5);  // Creates 5 threads.
@@ -166,6 +1049,21 @@ int main(int argc, char **argv) {
   test7();
   test8();
   test9();
+  test10();
+  test11();
+  test12();
+  test13();
+  test14();
+  test15();
+  test16();
+  test17();
+  test18();
+  test19();
+  test20();
+  test21();
+  test22();
+  test23();
+  test24();
 
   return 0;
 }
\ No newline at end of file
@@ -2,9 +2,26 @@
 #include <cassert>
 #include <memory>
 #include <sstream>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstdio>
+#include <unistd.h>
+#include <thread>
 
 #include "HELContext.h"
 #include "EncBit.h"
+#include "EncBitVector.h"
+#include "Util.h"
+#include "UInt.h"
+#include "BitSlicing.h"
+#include "Worker.h"
+#include "GFN.h"
+#include "ChooseParams.h"
+#include "Simulation.h"
+#include "Evaluator.h"
+#include "NetWorker.h"
+#include "ShmWorker.h"
 
 using namespace std;
 
@@ -20,9 +37,388 @@ void test1() {
   assert(*priv.key == result);
 }
 
+// Slot-packed bit vectors, elementwise.
+void test2() {
+  auto ctx = std::make_shared<PublicCtx>(pub);
+  long n = EncBitVector(ctx).size();
+  assert(n > 1);
+
+  vector<bool> a(n), b(n), c(n);
+  for (long i = 0; i < n; i++) {
+    a[i] = i % 2;
+    b[i] = i % 3 == 0;
+    c[i] = i % 5 < 2;
+  }
+  EncBitVector ea(ctx, a), eb(ctx, b), ec(ctx, c);
+
+  auto x = (ea ^ eb).decrypt(priv);
+  auto y = (ea & eb).decrypt(priv);
+  auto z = (ea | eb).decrypt(priv);
+  auto w = (!ea).decrypt(priv);
+  auto cas = ea;
+  cas.cas(ec, eb);
+  auto s = cas.decrypt(priv);
+  // Keys only come with the relinearization matrix. More go into a new key,
+  // contexts already in use keep theirs.
+  assert(! ctx->has_rotation(1));
+  assert(ensure_rotations(priv, {1}));
+  assert(! ctx->has_rotation(1));
+  auto rotating = std::make_shared<PublicCtx>(priv);
+  assert(rotating->has_rotation(1) && rotating->has_rotation(n + 1)
+         && rotating->has_rotation(0));
+  assert(! ensure_rotations(priv, {1}));
+  auto r = EncBitVector(rotating, a).rotate(1).decrypt(priv);
+  for (long i = 0; i < n; i++) {
+    assert(x[i] == (a[i] ^ b[i]));
+    assert(y[i] == (a[i] && b[i]));
+    assert(z[i] == (a[i] || b[i]));
+    assert(w[i] == ! a[i]);
+    assert(s[i] == (c[i] ? b[i] : a[i]));
+    assert(r[(i + 1) % n] == a[i]);
+  }
+
+  // Partial vectors are zero padded, oversized ones are refused.
+  auto partial = EncBitVector(ctx, vector<bool>{true}).decrypt(priv);
+  assert(partial[0] && ! partial[n - 1]);
+  bool thrown = false;
+  try {
+    EncBitVector(ctx, vector<bool>(n + 1));
+  } catch (std::length_error &e) {
+    thrown = true;
+  }
+  assert(thrown);
+}
+
+// EncBit gates, including the in place ones, over the whole truth table.
+void test3() {
+  auto ctx = std::make_shared<PublicCtx>(pub);
+  for (int a = 0; a < 2; a++)
+    for (int b = 0; b < 2; b++) {
+      EncBit ea(ctx, a), eb(ctx, b);
+      assert((!ea).decrypt(priv) == ! a);
+      assert((ea ^ eb).decrypt(priv) == (a ^ b));
+      assert((ea & eb).decrypt(priv) == (a && b));
+      assert((ea | eb).decrypt(priv) == (a || b));
+      assert((ea == eb).decrypt(priv) == (a == b));
+
+      EncBit acc = ea;
+      acc |= eb;
+      acc ^= ea;
+      assert(acc.decrypt(priv) == (! a && b));
+
+      for (int c = 0; c < 2; c++) {
+        EncBit swapped = ea;
+        swapped.cas(EncBit(ctx, c), eb);
+        assert(swapped.decrypt(priv) == (c ? b : a));
+      }
+    }
+}
+
+// Cached contexts load back identical, corrupt entries are regenerated.
+void test4() {
+  auto dir = "/tmp/hehelp_test_" + to_string(getpid());
+  auto first = cached_private_ctx(dir, 10, 5);
+  auto second = cached_private_ctx(dir, 10, 5);
+  assert(*first.key == *second.key);
+
+  // A context loaded back must still work with the keys.
+  auto ctx = std::make_shared<PublicCtx>(second);
+  assert((EncBit(ctx, true) & EncBit(ctx, true)).decrypt(second));
+
+  string path = cached_private_ctx_path(dir, 10, 5);
+  string file;
+  assert(read_file(path, file));
+  file[file.size() / 2] ^= 1;
+  assert(write_file_atomic(path, file));
+  auto third = cached_private_ctx(dir, 10, 5);
+  assert(! (*third.key == *first.key));
+
+  remove(path.c_str());
+  rmdir(dir.c_str());
+}
+
+// Binary round trips of contexts and bits.
+void test5() {
+  stringstream ss;
+  write_binary(ss, priv);
+  PrivateCtx loaded;
+  read_binary(ss, loaded);
+  assert(ss);
+  assert(*loaded.key == *priv.key);
+
+  // Text isn't accepted as binary.
+  stringstream text;
+  text << priv;
+  PrivateCtx bad;
+  read_binary(text, bad);
+  assert(! text);
+
+  auto ctx = std::make_shared<PublicCtx>(pub);
+  for (int b = 0; b < 2; b++) {
+    stringstream bits;
+    EncBit(ctx, b).write(bits);
+    EncBit bit(ctx);
+    bit.read(bits);
+    assert(bit.decrypt(priv) == b);
+  }
+}
+
+// Copies share the immutable context, scratch space is per thread.
+void test6() {
+  PublicCtx copy(priv);
+  assert(copy.context == priv.context);
+  assert(copy.ea == priv.ea);
+  assert(copy.one == priv.one);
+  assert(&copy.scratch() == &priv.scratch());
+
+  PlaintextArray *other = nullptr;
+  thread t([&] () { other = &copy.scratch(); });
+  t.join();
+  assert(other != &priv.scratch());
+
+  // Bits encrypted concurrently from many threads.
+  auto ctx = std::make_shared<PublicCtx>(pub);
+  vector<thread> threads;
+  vector<int> ok(4, 0);
+  for (int i = 0; i < 4; i++)
+    threads.emplace_back([&, i] () { ok[i] = EncBit(ctx, i % 2).decrypt(priv) == i % 2; });
+  for (auto &thrd : threads)
+    thrd.join();
+  for (auto v : ok)
+    assert(v);
+}
+
+// Sliced additions of all the slots at once.
+void test7() {
+  auto ctx = std::make_shared<PublicCtx>(pub);
+  size_t slots = ctx->ea->size();
+  vector<uint64_t> x, y;
+  for (size_t i = 0; i < slots; i++) {
+    x.push_back(i % 16);
+    y.push_back((i * 7) % 16);
+  }
+
+  ArithmeticTree<EncBitVector>::EvaluatorPtr_t ev(new Evaluator<EncBitVector>());
+  WorkerStub<EncBitVector>::create_n(*ev->get_scheduler(), 2);
+  auto t = ArithmeticTree<EncBitVector>(ev);
+  auto encrypt = [&] (const vector<bool> &plane) { return EncBitVector(ctx, plane); };
+  auto a = encode_sliced<4>(t, x, slots, encrypt);
+  auto b = encode_sliced<4>(t, y, slots, encrypt);
+  auto sum = a + b;
+  sum.eval();
+  ev->exec();
+
+  auto sums = decode_sliced(sum, [] (const EncBitVector &v) { return v.decrypt(priv); });
+  for (size_t i = 0; i < slots; i++)
+    assert(sums[i] == ((x[i] + y[i]) % 16));
+}
+
+
+// Batch encryption and decryption.
+void test8() {
+  auto ctx = std::make_shared<PublicCtx>(pub);
+  vector<bool> bits;
+  for (int i = 0; i < 37; i++)
+    bits.push_back(i % 3 == 0);
+  auto encrypted = EncBit::encrypt_batch(ctx, bits, 4);
+  assert(encrypted.size() == bits.size());
+  assert(EncBit::decrypt_batch(encrypted, priv, 4) == bits);
+  assert(EncBit::decrypt_batch(encrypted, priv, 1) == bits);
+  assert(encrypted[5].decrypt(priv) == bits[5]);
+
+  vector<vector<bool> > planes(5, vector<bool>(ctx->ea->size(), false));
+  for (size_t i = 0; i < planes.size(); i++)
+    for (size_t j = i; j < planes[i].size(); j += 2)
+      planes[i][j] = true;
+  auto vectors = EncBitVector::encrypt_batch(ctx, planes);
+  assert(EncBitVector::decrypt_batch(vectors, priv) == planes);
+
+  planes.push_back(vector<bool>(ctx->ea->size() + 1, true));
+  try {
+    EncBitVector::encrypt_batch(ctx, planes, 3);
+    assert(false);
+  } catch (std::length_error&) {}
+}
+
+// A context generated for the circuit, sized on a plain copy of it.
+void test9() {
+  typedef GFN<2> Bit;
+  ArithmeticTree<Bit>::EvaluatorPtr_t plain_ev(new Evaluator<Bit>());
+  auto plain = ArithmeticTree<Bit>(plain_ev);
+  UInt<Bit, 3> x(plain, 3), y(plain, 5);
+  auto plain_prod = x * y;
+  plain_prod.eval();
+  auto params = choose_params(*plain_ev, 10);
+  assert(params.depth >= long(plain_prod.stats().mult_depth) + 1);
+
+  PrivateCtx sized(params);
+  auto ctx = std::make_shared<PublicCtx>(sized);
+  ArithmeticTree<EncBit>::EvaluatorPtr_t ev(new Evaluator<EncBit>());
+  WorkerStub<EncBit>::create_n(*ev->get_scheduler(), 2);
+  auto t = ArithmeticTree<EncBit>(ev);
+  std::vector<ArithmeticNode<EncBit>* > a, b;
+  for (int i = 0; i < 3; i++) {
+    a.push_back(&t.new_node(EncBit(ctx, (3 >> i) & 1)));
+    b.push_back(&t.new_node(EncBit(ctx, (5 >> i) & 1)));
+  }
+  auto prod = UInt<EncBit, 3>(t, a) * UInt<EncBit, 3>(t, b);
+  prod.eval();
+  ev->exec();
+  assert(ev->noise_budget() > 0);
+
+  auto bits = prod.get_bits();
+  uint64_t value = 0;
+  for (int i = 2; i >= 0; i--)
+    value = value * 2 + bits[i]->get_data()->decrypt(sized);
+  assert(value == (3 * 5) % 8);
+}
+
+// Rotations are part of the cache key.
+void test10() {
+  HELParams params(10, 5);
+  auto path = cached_private_ctx_path("/tmp/cache", params);
+  assert(path == cached_private_ctx_path("/tmp/cache", 10, 5));
+  params.rotations = {1, 2};
+  assert(path != cached_private_ctx_path("/tmp/cache", params));
+
+  PrivateCtx rotating(params);
+  assert(rotating.has_rotation(1) && rotating.has_rotation(2));
+  assert(! ensure_rotations(rotating, params));
+  params.rotations.push_back(3);
+  auto old_key = rotating.key;
+  assert(ensure_rotations(rotating, params));
+  assert(rotating.key != old_key && rotating.has_rotation(3));
+}
+
+// Packed dot product, with a key holding only the rotations it needs.
+void test11() {
+  auto plain_ev = std::make_shared<Evaluator<GFN<2> > >();
+  ArithmeticTree<GFN<2> > plain(plain_ev);
+  auto &plain_prod = plain.new_node(1) * plain.new_node(1);
+  auto &plain_dot = plain_prod.total_sum() + plain_prod.rotate(1);
+  auto params = choose_params(CircuitAnalyzer<GFN<2> >::analyze({&plain_dot}), 10);
+  assert(params.total_sums && params.rotations == vector<long>{1});
+
+  PrivateCtx packed(params);
+  auto ctx = std::make_shared<PublicCtx>(packed);
+  long n = ctx->ea->size();
+  assert(packed.has_rotation(1) && packed.has_rotation(2));
+  vector<bool> x(n), y(n);
+  bool expected = false;
+  for (long i = 0; i < n; i++) {
+    x[i] = i % 3 != 0;
+    y[i] = i % 2 == 0;
+    expected = expected != (x[i] && y[i]);
+  }
+
+  ArithmeticTree<EncBitVector>::EvaluatorPtr_t ev(new Evaluator<EncBitVector>());
+  WorkerStub<EncBitVector>::create_n(*ev->get_scheduler(), 2);
+  auto t = ArithmeticTree<EncBitVector>(ev);
+  auto &prod = t.new_node(EncBitVector(ctx, x)) * t.new_node(EncBitVector(ctx, y));
+  auto &dot = prod.total_sum();
+  auto &rot = prod.rotate(1);
+  t.eval(dot);
+  t.eval(rot);
+  ev->exec();
+
+  auto dots = dot.get_data()->decrypt(packed);
+  auto rots = rot.get_data()->decrypt(packed);
+  for (long i = 0; i < n; i++) {
+    assert(dots[i] == expected);
+    assert(rots[(i + 1) % n] == (x[i] && y[i]));
+  }
+}
+
+// Slot permutations, used to pack scalar circuits.
+void test12() {
+  SlotMoves_t moves = {{0, 1}, {1, 2}, {2, 3}, {2, 0}};
+  ensure_rotations(priv, {1, -2});
+  auto ctx = std::make_shared<PublicCtx>(priv);
+  long n = ctx->ea->size();
+  assert(n >= 4);
+  vector<bool> bits(n, false);
+  bits[0] = true;
+  bits[2] = true;
+  auto perm = EncBitVector(ctx, bits).permute(moves).decrypt(priv);
+  vector<bool> expected(n, false);
+  for (auto &move : moves)
+    expected[move.second] = bits[move.first];
+  assert(perm == expected);
+}
+
+// Costs calibrated on EncBits predict whether a circuit decrypts.
+void test13() {
+  auto ctx = std::make_shared<PublicCtx>(pub);
+  auto costs = calibrate(EncBit(ctx, true), EncBit(ctx, false), 5);
+  assert(costs.prod > costs.sum && costs.bytes > 0);
+  assert(costs.fresh_budget > costs.prod_bits && costs.prod_bits > 0);
+
+  auto adder = [] (ArithmeticTree<SimValue> &t, shared_ptr<SimModel> model) {
+    vector<ArithmeticNode<SimValue>* > a, b;
+    for (int i = 0; i < 4; i++) {
+      a.push_back(&t.new_node(SimValue(model)));
+      b.push_back(&t.new_node(SimValue(model)));
+    }
+    auto sum = UInt<SimValue, 4>(t, a) + UInt<SimValue, 4>(t, b);
+    auto bits = sum.get_bits();
+    return vector<ArithmeticNode<SimValue>* >(bits, bits + 4);
+  };
+  auto report = simulate(costs, 2, adder);
+  assert(report.decrypts() && report.makespan > costs.prod);
+}
+
+// EncBits through worker processes. The network one is sent the context,
+// and reads its requests under the key of a sample made with it.
+void test14() {
+  auto ctx = std::make_shared<PublicCtx>(pub);
+  stringstream serialized;
+  write_binary(serialized, pub);
+
+  ArithmeticTree<EncBit>::EvaluatorPtr_t ev(new Evaluator<EncBit>());
+  auto sched = ev->get_scheduler();
+  fork_shm_worker<EncBit>(*sched, [ctx] () { return EncBit(ctx, true); });
+  std::shared_ptr<PublicCtx> loaded;
+  fork_remote_worker<EncBit>(
+    "localhost:9003", [&loaded] () { return EncBit(loaded, true); },
+    [&loaded] (std::istream &is) {
+      loaded = std::make_shared<PublicCtx>();
+      read_binary(is, *loaded);
+    }, "/tmp/hehelp_test_" + to_string(getpid()));
+  NetWorkerListener<EncBit> listener(*sched, 9003);
+  listener.set_context(serialized.str());
+  for (int i = 0; i < 1000 && sched->get_workers().size() < 2; i++)
+    usleep(10000);
+  assert(sched->get_workers().size() == 2);
+
+  auto t = ArithmeticTree<EncBit>(ev);
+  vector<ArithmeticNode<EncBit>* > nodes;
+  for (int i = 0; i < 8; i++) {
+    auto &n = t.new_node(EncBit(ctx, i & 1)) * t.new_node(EncBit(ctx, i & 2))
+              + t.new_node(EncBit(ctx, i & 4));
+    t.eval(n);
+    nodes.push_back(&n);
+  }
+  ev->exec();
+  for (int i = 0; i < 8; i++)
+    assert(nodes[i]->get_data()->decrypt(priv) == (((i & 1) && (i & 2)) != bool(i & 4)));
+}
 
 int main(int argc, char **argv) {
   test1();
+  test2();
+  test3();
+  test4();
+  test5();
+  test6();
+  test7();
+  test8();
+  test9();
+  test10();
+  test11();
+  test12();
+  test13();
+  test14();
+  remove_dir("/tmp/hehelp_test_" + to_string(getpid()));
 
   return 0;
 }
\ No newline at end of file
@@ -7,13 +7,66 @@
 #include "Evaluator.h"
 #include "Scheduler.h"
 #include "NetWorker.h"
+#include "ShmWorker.h"
 #include "Log.h"
+#include "Trace.h"
 
 using namespace std;
 
 ArithmeticTree<int>::EvaluatorPtr_t eval(new Evaluator<int>());
 auto sched = eval->get_scheduler();
 
+// Stands in for a serialized PublicCtx.
+const std::string context("public context\n\0with binary", 28);
+const std::string cache_dir = "/tmp/hehelp_test_" + std::to_string(getpid());
+
+void load_context(std::istream &is) {
+  std::stringstream ss;
+  ss << is.rdbuf();
+  if (ss.str() != context)
+    throw std::runtime_error("Wrong context");
+}
+
+NetWorkerListener<int> *listener;
+
+// Value that can only be made under a key, like a ciphertext. Only the value
+// travels, mixing keys gives -1.
+struct Keyed {
+  int key;
+  int value;
+
+  Keyed(int key_, int value_) : key(key_), value(value_) {}
+
+  Keyed operator+(const Keyed &rhs) const {
+    return Keyed(this->key, this->key == rhs.key ? this->value + rhs.value : -1);
+  }
+
+  Keyed operator*(const Keyed &rhs) const {
+    return Keyed(this->key, this->key == rhs.key ? this->value * rhs.value : -1);
+  }
+};
+
+std::ostream& operator<<(std::ostream &os, const Keyed &obj) {
+  return os << obj.value;
+}
+
+std::istream& operator>>(std::istream &is, Keyed &obj) {
+  return is >> obj.value;
+}
+
+template <>
+struct ElementOps<Keyed> : DefaultElementOps<Keyed> {
+  static Keyed constant(bool bit, const Keyed *like) {
+    return Keyed(like->key, bit);
+  }
+
+  static Keyed make(const Keyed *like) {
+    if (like == nullptr)
+      throw std::invalid_argument("No key");
+    return Keyed(like->key, 0);
+  }
+};
+
 // Message serialization.
 void test1() {
   NetWorkerMsg<int> msg, result;
@@ -31,6 +84,34 @@ void test1() {
   assert(msg.op == result.op);
   assert(msg.left == result.left);
   assert(msg.right == result.right);
+
+  // Slot operations carry an amount instead of the right operand.
+  msg.op = NetWorkerMsg<int>::SHIFT;
+  msg.amount = -3;
+  std::stringstream unary;
+  unary << msg;
+  assert(unary.str().size() < ss.str().size() + sizeof(int64_t));
+  unary >> result;
+  assert(result.op == NetWorkerMsg<int>::SHIFT);
+  assert(result.left == 10 && result.amount == -3);
+  assert(apply_msg(result) == 0);
+
+  msg.op = NetWorkerMsg<int>::PERMUTE;
+  msg.moves = {{0, 0}, {0, 5}};
+  std::stringstream perm;
+  perm << msg;
+  perm >> result;
+  assert(result.op == NetWorkerMsg<int>::PERMUTE);
+  assert(result.moves == msg.moves);
+  assert(apply_msg(result) == 10);
+
+  msg.op = NetWorkerMsg<int>::SCALE;
+  msg.amount = 7;
+  std::stringstream scaled;
+  scaled << msg;
+  scaled >> result;
+  assert(result.op == NetWorkerMsg<int>::SCALE && result.amount == 7);
+  assert(apply_msg(result) == 70);
 }
 
 // Simple arithmetic.
@@ -48,22 +129,272 @@ void test2() {
   assert(*y.get_data() == 30);
 }
 
+// Capabilities from the handshake, refined by the observed latencies.
+void test3() {
+  NetWorkerHello hello, result;
+  hello.cores = 64;
+  hello.sum_latency = 0.5;
+  hello.prod_latency = 2;
+
+  std::stringstream ss;
+  ss << hello;
+  ss >> result;
+
+  assert(result.cores == 64);
+  assert(result.sum_latency == 0.5);
+  assert(result.prod_latency == 2);
+
+  // Remotes with cores get a frame per core at least, and run it in parallel
+  // once the operations outweigh starting the threads.
+  BatchSizer sizer;
+  sizer.min_ops = 64;
+  sizer.observe(1 << 20, 1);
+  assert(sizer.size() == 64);
+  result.sum_latency = 1e-3;
+  assert(batch_threads(result, 100) == 64);
+  assert(batch_threads(result, 2) == 2);
+  result.sum_latency = 1e-9;
+  assert(batch_threads(result, 100) == 1);
+
+  NetWorkerBatch<int> batch;
+  for (int i = 0; i < 100; i++) {
+    NetWorkerMsg<int> msg;
+    msg.op = NetWorkerMsg<int>::PROD;
+    msg.left = i;
+    msg.right = 3;
+    msg.amount = 0;
+    batch.msgs.push_back(msg);
+  }
+  auto parallel = apply_batch(batch, 8);
+  assert(parallel.results.size() == 100);
+  for (int i = 0; i < 100; i++)
+    assert(parallel.results[i] == 3 * i);
+
+  auto workers = sched->get_workers();
+  assert(workers.size() == 4);
+  for (auto w : workers) {
+    auto caps = w->get_caps();
+    assert(caps.cores >= 1);
+    assert(caps.sum_latency > 0);
+    assert(caps.prod_latency > 0);
+  }
+}
+
+// Same-host worker processes through shared memory.
+void test4() {
+  ArithmeticTree<int>::EvaluatorPtr_t shm_eval(new Evaluator<int>());
+  fork_shm_worker(*shm_eval->get_scheduler());
+  fork_shm_worker(*shm_eval->get_scheduler());
+  assert(shm_eval->get_scheduler()->get_workers().size() == 2);
+
+  auto t = ArithmeticTree<int>(shm_eval);
+  auto x = t.new_node(3) * t.new_node(4) + t.new_node(6) * t.new_node(7);
+  auto y = x * t.new_node(2);
+  t.eval(y);
+  t.get_evaluator()->exec();
+
+  assert(*x.get_data() == 54);
+  assert(*y.get_data() == 108);
+}
+
+// Batches of independent operations.
+void test5() {
+  NetWorkerBatch<int> batch, result;
+  for (int i = 0; i < 10; i++)
+    batch.msgs.push_back({i % 2 ? NetWorkerMsg<int>::SUM : NetWorkerMsg<int>::PROD,
+                          i, i + 1});
+
+  std::stringstream ss;
+  ss << batch;
+  ss >> result;
+  assert(result.msgs.size() == 10);
+  for (int i = 0; i < 10; i++) {
+    assert(result.msgs[i].op == batch.msgs[i].op);
+    assert(result.msgs[i].left == i);
+    assert(result.msgs[i].right == i + 1);
+  }
+
+  auto reply = apply_batch(result);
+  assert(reply.results.size() == 10);
+  assert(reply.results[2] == 6);
+  assert(reply.results[3] == 7);
+
+  // Small payloads get large frames, big ones go alone.
+  BatchSizer sizer;
+  assert(sizer.size() == 1);
+  sizer.observe(200, 10);
+  assert(sizer.size() == BatchSizer::max_ops);
+  BatchSizer big;
+  big.observe(1 << 20, 1);
+  assert(big.size() == 1);
+
+  // A wide layer, evaluated through the network workers.
+  eval->reset();
+  auto t = ArithmeticTree<int>(eval);
+  std::vector<ArithmeticNode<int>*> nodes;
+  for (int i = 0; i < 500; i++) {
+    auto &n = t.new_node(i) * t.new_node(2) + t.new_node(1);
+    t.eval(n);
+    nodes.push_back(&n);
+  }
+  t.get_evaluator()->exec();
+  for (int i = 0; i < 500; i++)
+    assert(*nodes[i]->get_data() == 2 * i + 1);
+}
+
+// Context distribution, a worker with the context in its cache doesn't fetch it.
+void test6() {
+  std::string cached;
+  assert(sha256("abc") ==
+         "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+  assert(read_file(cache_dir + "/context-" + sha256(context), cached));
+  assert(cached == context);
+
+  auto sends = listener->get_context_sends();
+  assert(sends >= 1);
+  fork_remote_worker<int>("localhost:9001", [] () { return 0; }, load_context, cache_dir);
+  usleep(700000);
+  assert(listener->get_context_sends() == sends);
+  assert(sched->get_workers().size() == 5);
+
+  std::remove((cache_dir + "/context-" + sha256(context)).c_str());
+  rmdir(cache_dir.c_str());
+
+  // Hashes name files in the cache, a listener can't pass anything else.
+  boost::asio::io_service io;
+  tcp::acceptor acceptor(io, tcp::endpoint(tcp::v4(), 9004));
+  for (auto hash : {std::string("../../../etc/passwd"), std::string(65, 'a'),
+                    std::string(64, 'A')}) {
+    bool refused = false;
+    std::thread remote([&] () {
+      try {
+        NetWorkerRemote<int>("localhost:9004", [] () { return 0; }, load_context, cache_dir);
+      } catch (std::runtime_error &e) {
+        refused = true;
+      }
+    });
+    tcp::iostream ssock;
+    acceptor.accept(*ssock.rdbuf());
+    write_blob(hash, ssock);
+    ssock.flush();
+    remote.join();
+    assert(refused);
+  }
+}
+
+// Traced remote evaluation shows the network round trips.
+void test7() {
+  Trace::clear();
+  Trace::enable();
+  test2();
+  Trace::enable(false);
+
+  std::stringstream ss;
+  Trace::write_chrome(ss);
+  auto json = ss.str();
+  assert(json.find("\"name\":\"send\",\"cat\":\"net\"") != std::string::npos);
+  assert(json.find("\"name\":\"recv\",\"cat\":\"net\"") != std::string::npos);
+  assert(json.find("\"name\":\"task\"") != std::string::npos);
+  Trace::clear();
+
+  // Untraced threads don't get a buffer, traced ones keep their name.
+  std::thread([] () { Trace::set_thread_name("untraced"); }).join();
+  std::thread([] () {
+    Trace::set_thread_name("traced");
+    Trace::enable();
+    Trace::instant("event", "test");
+    Trace::enable(false);
+  }).join();
+  ss.str("");
+  Trace::write_chrome(ss);
+  assert(ss.str().find("untraced") == std::string::npos);
+  assert(ss.str().find("\"traced\"") != std::string::npos);
+  Trace::clear();
+}
+
+// A joiner that never answers doesn't hold up the others, and is dropped
+// after the handshake timeout.
+void test8() {
+  listener->set_handshake_timeout(1);
+  auto n_workers = sched->get_workers().size();
+  // Forked first, so it doesn't inherit the hung connection. It connects
+  // after 0.5s.
+  fork_remote_worker<int>("localhost:9001", [] () { return 0; }, load_context,
+                          cache_dir);
+  tcp::iostream hung("localhost", "9001");
+  assert(hung);
+  auto hash = read_blob(hung);
+  assert(hung && hash == sha256(context));
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (sched->get_workers().size() == n_workers
+         && std::chrono::steady_clock::now() < deadline)
+    usleep(10000);
+  assert(sched->get_workers().size() == n_workers + 1);
+  test2();
+
+  // The listener hangs up on the hung one.
+  deserialize<uint8_t>(hung);
+  assert(! hung);
+}
+
+// Values without a default constructor go through both kinds of workers,
+// made under the key of the operands on one end and of the sample on the other.
+void test9() {
+  ArithmeticTree<Keyed>::EvaluatorPtr_t keyed_eval(new Evaluator<Keyed>());
+  auto keyed_sched = keyed_eval->get_scheduler();
+  auto sample = [] () { return Keyed(7, 3); };
+  fork_shm_worker<Keyed>(*keyed_sched, sample);
+  fork_remote_worker<Keyed>("localhost:9002", sample);
+  NetWorkerListener<Keyed> keyed_listener(*keyed_sched, 9002);
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (keyed_sched->get_workers().size() < 2
+         && std::chrono::steady_clock::now() < deadline)
+    usleep(10000);
+  assert(keyed_sched->get_workers().size() == 2);
+
+  auto t = ArithmeticTree<Keyed>(keyed_eval);
+  std::vector<ArithmeticNode<Keyed>*> nodes;
+  for (int i = 0; i < 50; i++) {
+    auto &n = t.new_node(Keyed(7, i)) * t.new_node(Keyed(7, 2)) + t.new_node(Keyed(7, 1));
+    t.eval(n);
+    nodes.push_back(&n);
+  }
+  keyed_eval->exec();
+  for (int i = 0; i < 50; i++)
+    assert(nodes[i]->get_data()->key == 7 && nodes[i]->get_data()->value == 2 * i + 1);
+
+  NetWorkerResults<Keyed> results;
+  std::stringstream ss;
+  ss << apply_batch(NetWorkerBatch<Keyed>());
+  ss >> results;
+  assert(ss && results.results.empty());
+}
+
 int main(int argc, char **argv) {
   Log::set_level(Log::DISABLE);
 
   test1();
-  fork_remote_worker<int>("localhost:9001");
-  fork_remote_worker<int>("localhost:9001");
-  fork_remote_worker<int>("localhost:9001");
-  fork_remote_worker<int>("localhost:9001");
+  for (int i = 0; i < 4; i++)
+    fork_remote_worker<int>("localhost:9001", [] () { return 0; }, load_context,
+                            cache_dir);
 
-  auto *listener = new NetWorkerListener<int>(*sched, 9001);
+  listener = new NetWorkerListener<int>(*sched, 9001);
+  listener->set_context(context);
   usleep(600000);
   // kill(pid, 9);
   usleep(100000);
   test1();
   test2();
+  test3();
+  test4();
+  test5();
+  test6();
+  test7();
+  test8();
+  test9();
   delete listener;
+  remove_dir(cache_dir);
 
   return 0;
 }
\ No newline at end of file